@@ -6,28 +6,97 @@
 #include "../kvstore.h"
 #include "../mm/mymalloc.h"
 
-#define MAX_TABLE_SIZE  1024
+#define ARRAY_INIT_PAIRS    1024
+#define ARRAY_BULK_MIN      8           // smaller batches are inserted one by one
 
-int kv_array_destory = 0;
-
-typedef struct kvpair_s {
-    char* key;
-    char* value;
-
-    // struct kvpair_s *next;
-
-} kvpair_t;
+static __thread int kv_array_destory = 0;
 
+/*
+ * pairs are kept sorted by key, as three parallel arrays. the search only
+ * reads prefixes, a dense array of the first 8 key bytes, so a lookup is a
+ * branchless binary search over 8 byte integers and touches full keys only
+ * for pairs that share the prefix. keys and values live out of line.
+ */
 typedef struct kvstore_s {
-    kvpair_t *table;
+    uint64_t *prefixes;
+    kv_key_t **keys;
+    kv_value_t **values;
+
     int max_pairs;
     int num_pairs;
+    size_t bytes;
 
     pthread_mutex_t mutex;
     
 } kvstore_t;
 
-kvstore_t *store = NULL;
+// one instance per reactor thread
+__thread kvstore_t *store = NULL;
+
+static int _reserve(int pairs) {
+    if(pairs <= store->max_pairs) return 0;
+
+    int max = store->max_pairs ? store->max_pairs : ARRAY_INIT_PAIRS;
+    while(max < pairs) max <<= 1;
+
+    uint64_t *prefixes = (uint64_t *)mymalloc(sizeof(uint64_t) * max);
+    kv_key_t **keys = (kv_key_t **)mymalloc(sizeof(kv_key_t *) * max);
+    kv_value_t **values = (kv_value_t **)mymalloc(sizeof(kv_value_t *) * max);
+    if(!prefixes || !keys || !values) {
+        if(prefixes) myfree(prefixes);
+        if(keys) myfree(keys);
+        if(values) myfree(values);
+        return -1;
+    }
+
+    if(store->num_pairs) {
+        memcpy(prefixes, store->prefixes, sizeof(uint64_t) * store->num_pairs);
+        memcpy(keys, store->keys, sizeof(kv_key_t *) * store->num_pairs);
+        memcpy(values, store->values, sizeof(kv_value_t *) * store->num_pairs);
+    }
+    if(store->prefixes) {
+        myfree(store->prefixes);
+        myfree(store->keys);
+        myfree(store->values);
+    }
+
+    store->prefixes = prefixes;
+    store->keys = keys;
+    store->values = values;
+    store->max_pairs = max;
+    return 0;
+}
+
+// first index whose prefix is not below prefix
+static int _lower_bound(uint64_t prefix) {
+    const uint64_t *base = store->prefixes;
+    int n = store->num_pairs;
+    if(n == 0) return 0;
+
+    while(n > 1) {
+        int half = n / 2;
+        // both halves the next round may look at
+        __builtin_prefetch(&base[half / 2]);
+        __builtin_prefetch(&base[half + half / 2]);
+        base = base[half] < prefix ? base + half : base;
+        n -= half;
+    }
+    return (base - store->prefixes) + (*base < prefix);
+}
+
+// index of key, or -1 with *pos set to where it would be inserted
+static int _find(const char *key, size_t klen, int *pos) {
+    uint64_t prefix = kv_key_prefix(key, klen);
+    int i = _lower_bound(prefix);
+
+    for(; i < store->num_pairs && store->prefixes[i] == prefix; i ++) {
+        int ret = kv_key_compare(key, klen, prefix, store->keys[i]);
+        if(ret == 0) return i;
+        if(ret < 0) break;
+    }
+    if(pos) *pos = i;
+    return -1;
+}
 
 int kv_array_init(void) {
     
@@ -36,14 +105,12 @@ int kv_array_init(void) {
         fprintf(stderr, "malloc store error\n");
         return -1;
     }
+    memset(store, 0, sizeof(kvstore_t));
 
-    store->table = (kvpair_t *)mymalloc(sizeof(kvpair_t) * MAX_TABLE_SIZE);
-    if(!store->table) {
+    if(_reserve(ARRAY_INIT_PAIRS)) {
         fprintf(stderr, "malloc store table error\n");
         return -1;
     }
-    store->max_pairs = MAX_TABLE_SIZE;
-    store->num_pairs = 0;
 
     pthread_mutex_init(&store -> mutex, NULL);
 
@@ -58,18 +125,13 @@ void kv_array_destroy(void) {
     kv_array_destory = 1;
 
     // free all key-value pairs
-    if (store->table) {
-        for (int i = 0; i < store->num_pairs; i++) {
-            if (store->table[i].key) {
-                myfree(store->table[i].key);
-            }
-            if (store->table[i].value) {
-                myfree(store->table[i].value);
-            }
-        }
-        
-        myfree(store->table);
-        store->table = NULL;
+    for (int i = 0; i < store->num_pairs; i++) {
+        kv_entry_free(store->keys[i], store->values[i]);
+    }
+    if (store->prefixes) {
+        myfree(store->prefixes);
+        myfree(store->keys);
+        myfree(store->values);
     }
     pthread_mutex_unlock(&store->mutex);
     pthread_mutex_destroy(&store->mutex);
@@ -78,127 +140,311 @@ void kv_array_destroy(void) {
     store = NULL; 
 }
 
-int kv_array_set(const char* key, const char *value) {
-    
-    if(!store || !store->table || !key || !value) {
-        fprintf(stderr, "store %p, store->table %p, key %s, value %s\n", store, store->table, key, value);
-        return -1;
-    }
+/*
+ * set/get/delete/modify expect the caller to hold the store lock, a batch
+ * of ops takes it once for all of them.
+ */
+void kv_array_lock(void) {
+    pthread_mutex_lock(&store->mutex);
+}
 
-    if(store->num_pairs >= store -> max_pairs) {
-        fprintf(stderr, "kv store full\n");
+void kv_array_unlock(void) {
+    pthread_mutex_unlock(&store->mutex);
+}
+
+int kv_array_set(const char* key, size_t klen, const char *value, size_t vlen) {
+    
+    if(!store || !key || !value) {
+        fprintf(stderr, "store %p, key %p, value %p\n", store, key, value);
         return -1;
     }
 
-    int idx = 0;
-    pthread_mutex_lock(&store -> mutex);
-    idx = store->num_pairs;
-    store->num_pairs ++;
-    pthread_mutex_unlock(&store -> mutex);
+    // an existing key is left as it is
+    int pos = 0;
+    if(_find(key, klen, &pos) >= 0) return 0;
 
-    char* kcopy = mymalloc(strlen(key) + 1);
-    if(!kcopy) {
-        fprintf(stderr, "kcopy malloc failed\n");
+    if(_reserve(store->num_pairs + 1)) {
+        fprintf(stderr, "kv store full\n");
         return -1;
     }
 
-    char* vcopy = mymalloc(strlen(value) + 1);
-    if(!vcopy) {
-        myfree(kcopy);
-        fprintf(stderr, "vcopy malloc failed\n");
+    // a small value shares the key's allocation, see kv_entry_create()
+    kv_key_t *kcopy = NULL;
+    kv_value_t *vcopy = NULL;
+    if(!kv_entry_create(0, key, klen, value, vlen, &kcopy, &vcopy)) {
+        fprintf(stderr, "entry malloc failed\n");
         return -1;
     }
 
-    strcpy(kcopy, key);
-    strcpy(vcopy, value);
+    int tail = store->num_pairs - pos;
+    memmove(&store->prefixes[pos + 1], &store->prefixes[pos], sizeof(uint64_t) * tail);
+    memmove(&store->keys[pos + 1], &store->keys[pos], sizeof(kv_key_t *) * tail);
+    memmove(&store->values[pos + 1], &store->values[pos], sizeof(kv_value_t *) * tail);
 
-    store->table[idx].key = kcopy;
-    store->table[idx].value = vcopy;
+    store->prefixes[pos] = kcopy->prefix;
+    store->keys[pos] = kcopy;
+    store->values[pos] = vcopy;
+    store->num_pairs ++;
+    store->bytes += klen + vlen;
 
     return 0;
 }
 
-char* kv_array_get(const char* key) {
-    if(!store || !store->table || !key) return NULL;
+typedef struct kv_array_entry_s {
+    kv_key_t *key;
+    kv_value_t *value;
+    int idx;            // position in the batch, orders duplicates
+} kv_array_entry_t;
+
+static int _entry_compare(const void *a, const void *b) {
+    const kv_array_entry_t *x = a, *y = b;
+    int ret = kv_key_compare(x->key->data, x->key->len, x->key->prefix, y->key);
+    return ret ? ret : x->idx - y->idx;
+}
+
+/*
+ * bulk insert. the new pairs are sorted on their own and merged into the
+ * array from the back in one pass, so n inserts cost O(n log n + pairs)
+ * moves instead of one memmove each. like set, a key that is already
+ * stored, or repeated in the batch, keeps its first value.
+ */
+void kv_array_mset(const char **keys, const size_t *klens, const char **values,
+    const size_t *vlens, int *status, int n) {
 
     int i = 0;
-    for(i = 0; i < store->num_pairs; i ++) {
-        if(!store->table[i].key) continue;
-        if(strcmp(store->table[i].key, key) == 0) {
-            return store->table[i].value;
+    if(!store) {
+        for(i = 0; i < n; i ++) status[i] = -1;
+        return;
+    }
+
+    if(n < ARRAY_BULK_MIN) {
+        for(i = 0; i < n; i ++) {
+            status[i] = keys[i] ? kv_array_set(keys[i], klens[i], values[i], vlens[i]) : -1;
         }
+        return;
     }
-    return NULL;
-}
 
-int kv_array_delete(char *key) {
-    int i = 0;
-    for (i = 0; i < store->num_pairs; i ++) {
-        if(!store->table[i].key) continue;
-        if(strcmp(store->table[i].key, key) == 0) {
-
-            myfree(store->table[i].key);
-            myfree(store->table[i].value);
-            
-            // NOTE: Breaks original insertion ordering
-            if (i < store->num_pairs - 1) {
-                store->table[i] = store->table[store->num_pairs - 1];
-            }
-            
-            store->table[store->num_pairs - 1].key = NULL;
-            store->table[store->num_pairs - 1].value = NULL;
-            store->num_pairs--;
-
-            return 0;
+    kv_array_entry_t *entries = (kv_array_entry_t *)mymalloc(sizeof(kv_array_entry_t) * n);
+    if(!entries) {
+        for(i = 0; i < n; i ++) status[i] = -1;
+        return;
+    }
+
+    int m = 0;
+    for(i = 0; i < n; i ++) {
+        status[i] = -1;
+        if(!keys[i] || !values[i]) continue;
+
+        // already stored, nothing to do
+        if(_find(keys[i], klens[i], NULL) >= 0) {
+            status[i] = 0;
+            continue;
+        }
+
+        kv_key_t *kcopy = NULL;
+        kv_value_t *vcopy = NULL;
+        if(!kv_entry_create(0, keys[i], klens[i], values[i], vlens[i], &kcopy, &vcopy)) {
+            fprintf(stderr, "bulk insert malloc failed\n");
+            continue;
         }
+        entries[m].key = kcopy;
+        entries[m].value = vcopy;
+        entries[m].idx = i;
+        m ++;
     }
-    return -1;
+
+    qsort(entries, m, sizeof(kv_array_entry_t), _entry_compare);
+
+    // drop repeated keys, the first in the batch wins
+    int u = 0;
+    for(i = 0; i < m; i ++) {
+        kv_key_t *key = entries[i].key;
+        if(u > 0 && kv_key_compare(key->data, key->len, key->prefix, entries[u - 1].key) == 0) {
+            status[entries[i].idx] = 0;
+            kv_entry_free(entries[i].key, entries[i].value);
+            continue;
+        }
+        entries[u ++] = entries[i];
+    }
+
+    if(u && _reserve(store->num_pairs + u)) {
+        for(i = 0; i < u; i ++) {
+            kv_entry_free(entries[i].key, entries[i].value);
+        }
+        myfree(entries);
+        return;
+    }
+
+    // merge from the back, every pair moves at most once
+    int old = store->num_pairs - 1;
+    int k = store->num_pairs + u - 1;
+    for(i = u - 1; i >= 0; k --) {
+        kv_key_t *key = entries[i].key;
+        if(old >= 0 && kv_key_compare(key->data, key->len, key->prefix, store->keys[old]) < 0) {
+            store->prefixes[k] = store->prefixes[old];
+            store->keys[k] = store->keys[old];
+            store->values[k] = store->values[old];
+            old --;
+        } else {
+            store->prefixes[k] = key->prefix;
+            store->keys[k] = key;
+            store->values[k] = entries[i].value;
+            store->bytes += key->len + entries[i].value->len;
+            status[entries[i].idx] = 0;
+            i --;
+        }
+    }
+    store->num_pairs += u;
+
+    myfree(entries);
+}
+
+// the caller owns a reference to the returned value
+kv_value_t* kv_array_get(const char* key, size_t klen) {
+    if(!store || !key) return NULL;
+
+    int i = _find(key, klen, NULL);
+    if(i < 0) return NULL;
+
+    return kv_value_get(store->values[i]);
+}
+
+int kv_array_delete(const char *key, size_t klen) {
+    if(!store || !key) return -1;
+
+    int i = _find(key, klen, NULL);
+    if(i < 0) return -1;
+
+    store->bytes -= store->keys[i]->len + store->values[i]->len;
+    kv_entry_free(store->keys[i], store->values[i]);
+
+    int tail = store->num_pairs - i - 1;
+    memmove(&store->prefixes[i], &store->prefixes[i + 1], sizeof(uint64_t) * tail);
+    memmove(&store->keys[i], &store->keys[i + 1], sizeof(kv_key_t *) * tail);
+    memmove(&store->values[i], &store->values[i + 1], sizeof(kv_value_t *) * tail);
+    store->num_pairs--;
+
+    return 0;
+}
+
+int kv_array_modify(const char* key, size_t klen, const char *value, size_t vlen) {
+    if(!store || !key || !value) return -1;
+
+    int i = _find(key, klen, NULL);
+    if(i < 0) return -1;
+
+    kv_value_t* vcopy = kv_value_create(value, vlen);
+    if(!vcopy) {
+        return -1;
+    }
+
+    store->bytes += vlen - store->values[i]->len;
+    kv_entry_value_put(store->keys[i], store->values[i]);
+    store->values[i] = vcopy;
+    return 0;
 }
 
-int kv_array_modify(char* key, char *value) {
-    if(!store || !store->table || !key || !value) return -1;
+// visit every pair in key order until fn returns non zero, takes the lock
+int kv_array_scan(kvs_scan_fn fn, void *arg) {
+    if(!store || !fn) return -1;
 
+    int ret = 0;
     int i = 0;
-    for(i = 0; i < store->num_pairs; i ++) {
-        if(strcmp(store->table[i].key, key) == 0) {
-            char* vcopy = mymalloc(strlen(value) + 1);
-            if(!vcopy) {
-                return -1;
-            }
-            strcpy(vcopy, value);
-            
-            pthread_mutex_lock(&store -> mutex);
-            // may be we need unlock here
-            myfree(store->table[i].value);
-            store->table[i].value = vcopy;
-            pthread_mutex_unlock(&store -> mutex);
-            return 0;
-        }
+    pthread_mutex_lock(&store->mutex);
+    for(i = 0; i < store->num_pairs && !ret; i ++) {
+        ret = fn(store->keys[i], store->values[i], arg);
     }
-    return i;
+    pthread_mutex_unlock(&store->mutex);
+    return ret;
 }
 
+void kv_array_stats(kvs_engine_stats_t *stats) {
+    if(!store) return;
+    stats->count = store->num_pairs;
+    stats->bytes = store->bytes;
+}
+
+const kvs_engine_t kv_array_engine = {
+    .name = "array",
+    .init = kv_array_init,
+    .destroy = kv_array_destroy,
+    .lock = kv_array_lock,
+    .unlock = kv_array_unlock,
+    .set = kv_array_set,
+    .mset = kv_array_mset,
+    .get = kv_array_get,
+    .del = kv_array_delete,
+    .mod = kv_array_modify,
+    .scan = kv_array_scan,
+    .stats = kv_array_stats,
+};
+
 
 #ifdef KV_ARRAY_DEBUG
+static int print_pair(const kv_key_t *key, kv_value_t *value, void *arg) {
+    printf("%s => %s\n", key->data, value->data);
+    return 0;
+}
+
 int main(int argc, char* argv[]) {
     kv_array_init();
     
-    kv_array_set("name", "jjc");
-    kv_array_set("city", "sz");
-    kv_array_set("server", "nginx");
-    kv_array_set("request url", "https://jjc.com");
-    kv_array_set("status code", "200");
-    kv_array_set("request method", "GET");
-
-    char *result = kv_array_get("city");
-    printf("result fot city %s\n", result);
-
-    char *server = kv_array_get("server");
-    printf("result fot server %s\n", server);
-
-    kv_array_delete("city");
-    result = kv_array_get("city");
-    printf("result fot city %s\n", result);
+    kv_array_set(KV_STR("name"), KV_STR("jjc"));
+    kv_array_set(KV_STR("city"), KV_STR("sz"));
+    kv_array_set(KV_STR("server"), KV_STR("nginx"));
+    kv_array_set(KV_STR("request url"), KV_STR("https://jjc.com"));
+    kv_array_set(KV_STR("status code"), KV_STR("200"));
+    kv_array_set(KV_STR("request method"), KV_STR("GET"));
+
+    kv_value_t *result = kv_array_get(KV_STR("city"));
+    printf("result fot city %s\n", result->data);
+    kv_value_put(result);
+
+    kv_value_t *server = kv_array_get(KV_STR("server"));
+    printf("result fot server %s\n", server->data);
+    kv_value_put(server);
+
+    // keys and values may hold any byte
+    kv_array_set(KV_STR("bin\0key"), KV_STR("a\0b"));
+    result = kv_array_get(KV_STR("bin\0key"));
+    printf("result fot bin key %u bytes\n", result->len);
+    kv_value_put(result);
+
+    kv_array_delete(KV_STR("city"));
+    result = kv_array_get(KV_STR("city"));
+    printf("result fot city %s\n", result ? result->data : NULL);
+
+    // bulk insert with a repeat and an existing key, merged in one pass
+    const char *keys[] = {"k3", "k1", "name", "k9", "k2", "k1", "k7", "k5", "k0"};
+    size_t klens[] = {2, 2, 4, 2, 2, 2, 2, 2, 2};
+    const char *values[] = {"v3", "v1", "dup", "v9", "v2", "again", "v7", "v5", "v0"};
+    size_t vlens[] = {2, 2, 3, 2, 2, 5, 2, 2, 2};
+    int status[9];
+    kv_array_mset(keys, klens, values, vlens, status, 9);
+    result = kv_array_get(KV_STR("k1"));
+    printf("result fot k1 %s\n", result->data);
+    kv_value_put(result);
+
+    // grow well past the initial capacity
+    char key[32];
+    int i = 0, missing = 0;
+    for(i = 0; i < 5000; i ++) {
+        int len = snprintf(key, sizeof(key), "grow%d", i);
+        kv_array_set(key, len, key, len);
+    }
+    for(i = 0; i < 5000; i ++) {
+        int len = snprintf(key, sizeof(key), "grow%d", i);
+        kv_value_t *value = kv_array_get(key, len);
+        if(!value) missing ++;
+        else kv_value_put(value);
+        kv_array_delete(key, len);
+    }
+    printf("%d missing\n", missing);
+
+    kvs_engine_stats_t stats = {0};
+    kv_array_engine.scan(print_pair, NULL);
+    kv_array_engine.stats(&stats);
+    printf("%zu pairs, %zu bytes\n", stats.count, stats.bytes);
 
     kv_array_destroy();
 
@@ -0,0 +1,977 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "../kvstore.h"
+#include "../mm/mymalloc.h"
+
+/*
+ * an adaptive radix tree. an inner node branches on one key byte and comes
+ * in four sizes, 4, 16, 48 and 256 children, grown and shrunk as children
+ * come and go. node 4 and 16 keep sorted key bytes next to their children,
+ * node 16 is searched with one SIMD compare, node 48 maps a byte to one of
+ * 48 slots and node 256 is indexed by the byte directly.
+ *
+ * a run of bytes every key below a node shares is compressed into the node:
+ * plen counts them, prefix holds the first ART_PREFIX_MAX. a lookup skips
+ * the bytes that are not stored and checks the whole key at the leaf it
+ * reaches, an insert compares them against a leaf of the subtree.
+ *
+ * a key that ends where a node ends, "user:1" above "user:10", hangs off
+ * the node's leaf pointer and comes before all of its children. leaves are
+ * tagged in bit 0 of child pointers and hold the key inline, a lookup costs
+ * one node per key byte not compressed away and a single full compare.
+ */
+#define ART_NODE4           0
+#define ART_NODE16          1
+#define ART_NODE48          2
+#define ART_NODE256         3
+
+#define ART_PREFIX_MAX      8
+
+typedef struct art_leaf_s {
+    kv_value_t *value;
+    kv_key_t *key;                  // right behind the leaf
+} art_leaf_t;
+
+typedef struct art_node_s {
+    uint8_t type;
+    uint16_t count;                 // children
+    uint32_t plen;                  // compressed bytes, only ART_PREFIX_MAX stored
+    uint8_t prefix[ART_PREFIX_MAX];
+    art_leaf_t *leaf;               // the key that ends at this node
+} art_node_t;
+
+typedef struct art_node4_s {
+    art_node_t n;
+    uint8_t keys[4];
+    void *children[4];
+} art_node4_t;
+
+typedef struct art_node16_s {
+    art_node_t n;
+    uint8_t keys[16];
+    void *children[16];
+} art_node16_t;
+
+typedef struct art_node48_s {
+    art_node_t n;
+    uint8_t index[256];             // slot + 1, 0 for none
+    void *children[48];
+} art_node48_t;
+
+typedef struct art_node256_s {
+    art_node_t n;
+    void *children[256];
+} art_node256_t;
+
+typedef struct art_s {
+    void *root;                     // a node, a tagged leaf or NULL
+
+    size_t count;
+    size_t bytes;
+    size_t nodes;
+
+    pthread_mutex_t lock;
+} art_t;
+
+// bounds of a range walk, see kv_art_range
+typedef struct art_walk_s {
+    const char *start;
+    size_t slen;
+    const char *end;                // NULL for open
+    size_t elen;
+    int reverse;
+    int start_excl;
+    int end_excl;
+
+    kvs_scan_fn fn;
+    void *arg;
+    int ret;
+} art_walk_t;
+
+// one instance per reactor thread
+__thread art_t *art = NULL;
+
+static const size_t art_sizes[] = {
+    sizeof(art_node4_t), sizeof(art_node16_t), sizeof(art_node48_t), sizeof(art_node256_t),
+};
+static const int art_capacity[] = {4, 16, 48, 256};
+static const int art_min[] = {0, 3, 12, 37};       // shrink at this many children
+
+static inline int _is_leaf(const void *ptr) {
+    return ((uintptr_t)ptr & 1) != 0;
+}
+
+static inline art_leaf_t *_leaf(const void *ptr) {
+    return (art_leaf_t *)((uintptr_t)ptr & ~(uintptr_t)1);
+}
+
+static inline void *_tag(art_leaf_t *leaf) {
+    return (void *)((uintptr_t)leaf | 1);
+}
+
+static inline int _leaf_match(const art_leaf_t *leaf, const char *key, size_t klen) {
+    return leaf->key->len == klen && memcmp(leaf->key->data, key, klen) == 0;
+}
+
+static art_leaf_t *_leaf_create(const char *key, size_t klen, const char *value, size_t vlen) {
+    art_leaf_t *leaf = (art_leaf_t *)mymalloc(sizeof(art_leaf_t) + sizeof(kv_key_t) + klen + 1);
+    if(!leaf) return NULL;
+
+    leaf->value = kv_value_create(value, vlen);
+    if(!leaf->value) {
+        myfree(leaf);
+        return NULL;
+    }
+
+    leaf->key = (kv_key_t *)(leaf + 1);
+    leaf->key->prefix = kv_key_prefix(key, klen);
+    leaf->key->len = klen;
+    memcpy(leaf->key->data, key, klen);
+    leaf->key->data[klen] = '\0';
+    return leaf;
+}
+
+static void _leaf_free(art_leaf_t *leaf) {
+    kv_value_put(leaf->value);
+    myfree(leaf);
+}
+
+static art_node_t *_node_alloc(int type) {
+    art_node_t *node = (art_node_t *)mymalloc(art_sizes[type]);
+    if(!node) return NULL;
+
+    memset(node, 0, art_sizes[type]);
+    node->type = type;
+    art->nodes ++;
+    return node;
+}
+
+static void _node_free(art_node_t *node) {
+    art->nodes --;
+    myfree(node);
+}
+
+// the slot of the child for byte c, NULL if there is none
+static void **_find_child(art_node_t *node, uint8_t c) {
+    int i = 0;
+
+    switch(node->type) {
+    case ART_NODE4: {
+        art_node4_t *n = (art_node4_t *)node;
+        for(i = 0; i < node->count; i ++) {
+            if(n->keys[i] == c) return &n->children[i];
+        }
+        return NULL;
+    }
+    case ART_NODE16: {
+        art_node16_t *n = (art_node16_t *)node;
+#if defined(__SSE2__)
+        __m128i keys = _mm_loadu_si128((const __m128i *)n->keys);
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(keys, _mm_set1_epi8((char)c)));
+        mask &= (1 << node->count) - 1;
+        return mask ? &n->children[__builtin_ctz(mask)] : NULL;
+#else
+        for(i = 0; i < node->count; i ++) {
+            if(n->keys[i] == c) return &n->children[i];
+        }
+        return NULL;
+#endif
+    }
+    case ART_NODE48: {
+        art_node48_t *n = (art_node48_t *)node;
+        return n->index[c] ? &n->children[n->index[c] - 1] : NULL;
+    }
+    default: {
+        art_node256_t *n = (art_node256_t *)node;
+        return n->children[c] ? &n->children[c] : NULL;
+    }
+    }
+}
+
+/*
+ * child i in key order, i below 4 or 16 for the small nodes and a byte for
+ * the large ones, NULL for an empty byte. *c is its key byte.
+ */
+static void *_child_at(art_node_t *node, int i, uint8_t *c) {
+    switch(node->type) {
+    case ART_NODE4:
+        *c = ((art_node4_t *)node)->keys[i];
+        return ((art_node4_t *)node)->children[i];
+    case ART_NODE16:
+        *c = ((art_node16_t *)node)->keys[i];
+        return ((art_node16_t *)node)->children[i];
+    case ART_NODE48: {
+        art_node48_t *n = (art_node48_t *)node;
+        *c = i;
+        return n->index[i] ? n->children[n->index[i] - 1] : NULL;
+    }
+    default:
+        *c = i;
+        return ((art_node256_t *)node)->children[i];
+    }
+}
+
+static inline int _child_slots(const art_node_t *node) {
+    return node->type <= ART_NODE16 ? node->count : 256;
+}
+
+// add a child to a node with room for it, the small nodes stay sorted
+static void _node_add(art_node_t *node, uint8_t c, void *child) {
+    int i = 0;
+
+    switch(node->type) {
+    case ART_NODE4:
+    case ART_NODE16: {
+        uint8_t *keys = node->type == ART_NODE4 ? ((art_node4_t *)node)->keys :
+            ((art_node16_t *)node)->keys;
+        void **children = node->type == ART_NODE4 ? ((art_node4_t *)node)->children :
+            ((art_node16_t *)node)->children;
+        while(i < node->count && keys[i] < c) i ++;
+        memmove(keys + i + 1, keys + i, node->count - i);
+        memmove(children + i + 1, children + i, (node->count - i) * sizeof(void *));
+        keys[i] = c;
+        children[i] = child;
+        break;
+    }
+    case ART_NODE48: {
+        art_node48_t *n = (art_node48_t *)node;
+        while(n->children[i]) i ++;
+        n->children[i] = child;
+        n->index[c] = i + 1;
+        break;
+    }
+    default:
+        ((art_node256_t *)node)->children[c] = child;
+        break;
+    }
+    node->count ++;
+}
+
+static void _node_remove(art_node_t *node, uint8_t c, void **slot) {
+    switch(node->type) {
+    case ART_NODE4:
+    case ART_NODE16: {
+        uint8_t *keys = node->type == ART_NODE4 ? ((art_node4_t *)node)->keys :
+            ((art_node16_t *)node)->keys;
+        void **children = node->type == ART_NODE4 ? ((art_node4_t *)node)->children :
+            ((art_node16_t *)node)->children;
+        int i = slot - children;
+        memmove(keys + i, keys + i + 1, node->count - i - 1);
+        memmove(children + i, children + i + 1, (node->count - i - 1) * sizeof(void *));
+        break;
+    }
+    case ART_NODE48: {
+        art_node48_t *n = (art_node48_t *)node;
+        n->children[n->index[c] - 1] = NULL;
+        n->index[c] = 0;
+        break;
+    }
+    default:
+        ((art_node256_t *)node)->children[c] = NULL;
+        break;
+    }
+    node->count --;
+}
+
+// move a node's header and children into a node of another size
+static art_node_t *_node_resize(art_node_t *node, int type) {
+    art_node_t *resized = _node_alloc(type);
+    if(!resized) return NULL;
+
+    resized->plen = node->plen;
+    memcpy(resized->prefix, node->prefix, ART_PREFIX_MAX);
+    resized->leaf = node->leaf;
+
+    int i = 0, slots = _child_slots(node);
+    for(i = 0; i < slots; i ++) {
+        uint8_t c = 0;
+        void *child = _child_at(node, i, &c);
+        if(child) _node_add(resized, c, child);
+    }
+
+    _node_free(node);
+    return resized;
+}
+
+static int _add_child(void **ref, art_node_t *node, uint8_t c, void *child) {
+    if(node->count == art_capacity[node->type]) {
+        node = _node_resize(node, node->type + 1);
+        if(!node) return -1;
+        *ref = node;
+    }
+    _node_add(node, c, child);
+    return 0;
+}
+
+static art_leaf_t *_minimum(const void *ptr) {
+    while(!_is_leaf(ptr)) {
+        art_node_t *node = (art_node_t *)ptr;
+        if(node->leaf) return node->leaf;
+
+        int i = 0;
+        uint8_t c = 0;
+        for(ptr = NULL; !ptr; i ++) ptr = _child_at(node, i, &c);
+    }
+    return _leaf(ptr);
+}
+
+// the compressed bytes of a node entered at depth
+static const uint8_t *_prefix(const art_node_t *node, size_t depth) {
+    if(node->plen <= ART_PREFIX_MAX) return node->prefix;
+    return (const uint8_t *)_minimum(node)->key->data + depth;
+}
+
+// how many of the compressed bytes the key matches from depth on
+static uint32_t _prefix_mismatch(const art_node_t *node, const char *key, size_t klen, size_t depth) {
+    const uint8_t *prefix = _prefix(node, depth);
+    uint32_t i = 0;
+
+    for(i = 0; i < node->plen && depth + i < klen; i ++) {
+        if(prefix[i] != (uint8_t)key[depth + i]) break;
+    }
+    return i;
+}
+
+// the node that ends at depth, NULL if key diverges before
+static const art_node_t *_skip_prefix(const art_node_t *node, const char *key, size_t klen,
+    size_t *depth) {
+
+    if(*depth + node->plen > klen) return NULL;
+
+    uint32_t i = 0, stored = node->plen < ART_PREFIX_MAX ? node->plen : ART_PREFIX_MAX;
+    for(i = 0; i < stored; i ++) {
+        if(node->prefix[i] != (uint8_t)key[*depth + i]) return NULL;
+    }
+    *depth += node->plen;
+    return node;
+}
+
+static art_leaf_t *_search(const char *key, size_t klen) {
+    const void *ptr = art->root;
+    size_t depth = 0;
+
+    while(ptr) {
+        if(_is_leaf(ptr)) {
+            art_leaf_t *leaf = _leaf(ptr);
+            return _leaf_match(leaf, key, klen) ? leaf : NULL;
+        }
+
+        const art_node_t *node = _skip_prefix((const art_node_t *)ptr, key, klen, &depth);
+        if(!node) return NULL;
+        if(depth == klen) {
+            return node->leaf && _leaf_match(node->leaf, key, klen) ? node->leaf : NULL;
+        }
+
+        void **slot = _find_child((art_node_t *)node, (uint8_t)key[depth]);
+        if(!slot) return NULL;
+        ptr = *slot;
+        depth ++;
+    }
+    return NULL;
+}
+
+/*
+ * a node 4 holding two keys that agree on the bytes before depth, one of
+ * them the leaf at *ref, the other one new.
+ */
+static int _split_leaf(void **ref, size_t depth, art_leaf_t *leaf) {
+    art_leaf_t *old = _leaf(*ref);
+    const char *a = old->key->data, *b = leaf->key->data;
+    size_t alen = old->key->len, blen = leaf->key->len;
+    size_t i = depth;
+
+    while(i < alen && i < blen && a[i] == b[i]) i ++;
+
+    art_node_t *node = _node_alloc(ART_NODE4);
+    if(!node) return -1;
+
+    node->plen = i - depth;
+    memcpy(node->prefix, b + depth, node->plen < ART_PREFIX_MAX ? node->plen : ART_PREFIX_MAX);
+
+    if(alen == i) node->leaf = old;
+    else _node_add(node, (uint8_t)a[i], *ref);
+    if(blen == i) node->leaf = leaf;
+    else _node_add(node, (uint8_t)b[i], _tag(leaf));
+
+    *ref = node;
+    return 0;
+}
+
+// a node 4 above node, where the key leaves its compressed bytes
+static int _split_prefix(void **ref, art_node_t *node, size_t depth, uint32_t mismatch,
+    art_leaf_t *leaf) {
+
+    art_node_t *parent = _node_alloc(ART_NODE4);
+    if(!parent) return -1;
+
+    const uint8_t *prefix = _prefix(node, depth);
+    parent->plen = mismatch;
+    memcpy(parent->prefix, prefix, mismatch < ART_PREFIX_MAX ? mismatch : ART_PREFIX_MAX);
+
+    // the byte at mismatch now selects node, the bytes after it stay compressed
+    uint8_t c = prefix[mismatch];
+    node->plen -= mismatch + 1;
+    memmove(node->prefix, prefix + mismatch + 1,
+        node->plen < ART_PREFIX_MAX ? node->plen : ART_PREFIX_MAX);
+    _node_add(parent, c, node);
+
+    if(leaf->key->len == depth + mismatch) parent->leaf = leaf;
+    else _node_add(parent, (uint8_t)leaf->key->data[depth + mismatch], _tag(leaf));
+
+    *ref = parent;
+    return 0;
+}
+
+// 1 if the key is there already, the leaf is then left to the caller
+static int _insert(art_leaf_t *leaf) {
+    const char *key = leaf->key->data;
+    size_t klen = leaf->key->len;
+    void **ref = &art->root;
+    size_t depth = 0;
+
+    while(*ref) {
+        if(_is_leaf(*ref)) {
+            if(_leaf_match(_leaf(*ref), key, klen)) return 1;
+            return _split_leaf(ref, depth, leaf);
+        }
+
+        art_node_t *node = *ref;
+        if(node->plen) {
+            uint32_t mismatch = _prefix_mismatch(node, key, klen, depth);
+            if(mismatch < node->plen) return _split_prefix(ref, node, depth, mismatch, leaf);
+            depth += node->plen;
+        }
+
+        if(depth == klen) {
+            if(node->leaf) return 1;
+            node->leaf = leaf;
+            return 0;
+        }
+
+        void **slot = _find_child(node, (uint8_t)key[depth]);
+        if(!slot) return _add_child(ref, node, (uint8_t)key[depth], _tag(leaf));
+        ref = slot;
+        depth ++;
+    }
+
+    *ref = _tag(leaf);
+    return 0;
+}
+
+/*
+ * after a child or the leaf of node went away: a node left with only its
+ * leaf becomes that leaf, one left with a single child is merged into it
+ * and a sparse one moves into a smaller size.
+ */
+static void _shrink(void **ref, art_node_t *node) {
+    if(node->count == 0) {
+        *ref = node->leaf ? _tag(node->leaf) : NULL;
+        _node_free(node);
+        return;
+    }
+
+    if(node->count == 1 && !node->leaf) {
+        int i = 0;
+        uint8_t c = 0;
+        void *child = NULL;
+        for(i = 0; !child; i ++) child = _child_at(node, i, &c);
+
+        if(!_is_leaf(child)) {
+            // the child's compressed bytes become node's, c and its own
+            art_node_t *next = child;
+            uint8_t prefix[ART_PREFIX_MAX];
+            uint32_t len = node->plen < ART_PREFIX_MAX ? node->plen : ART_PREFIX_MAX;
+            uint32_t j = 0;
+
+            memcpy(prefix, node->prefix, len);
+            if(len < ART_PREFIX_MAX) prefix[len ++] = c;
+            for(j = 0; j < next->plen && len < ART_PREFIX_MAX; j ++) {
+                prefix[len ++] = next->prefix[j];
+            }
+            memcpy(next->prefix, prefix, len);
+            next->plen += node->plen + 1;
+        }
+
+        *ref = child;
+        _node_free(node);
+        return;
+    }
+
+    if(node->count <= art_min[node->type]) {
+        // kept as it is if there is no memory for the smaller one
+        art_node_t *small = _node_resize(node, node->type - 1);
+        if(small) *ref = small;
+    }
+}
+
+static art_leaf_t *_delete(const char *key, size_t klen) {
+    void **ref = &art->root;
+    size_t depth = 0;
+
+    while(*ref) {
+        if(_is_leaf(*ref)) {
+            // only a root that is a leaf is reached this way
+            art_leaf_t *leaf = _leaf(*ref);
+            if(!_leaf_match(leaf, key, klen)) return NULL;
+            *ref = NULL;
+            return leaf;
+        }
+
+        art_node_t *node = *ref;
+        if(!_skip_prefix(node, key, klen, &depth)) return NULL;
+
+        if(depth == klen) {
+            art_leaf_t *leaf = node->leaf;
+            if(!leaf || !_leaf_match(leaf, key, klen)) return NULL;
+            node->leaf = NULL;
+            _shrink(ref, node);
+            return leaf;
+        }
+
+        uint8_t c = (uint8_t)key[depth];
+        void **slot = _find_child(node, c);
+        if(!slot) return NULL;
+
+        if(_is_leaf(*slot)) {
+            art_leaf_t *leaf = _leaf(*slot);
+            if(!_leaf_match(leaf, key, klen)) return NULL;
+            _node_remove(node, c, slot);
+            _shrink(ref, node);
+            return leaf;
+        }
+        ref = slot;
+        depth ++;
+    }
+    return NULL;
+}
+
+static void _destroy(void *ptr) {
+    if(!ptr) return;
+    if(_is_leaf(ptr)) {
+        _leaf_free(_leaf(ptr));
+        return;
+    }
+
+    art_node_t *node = ptr;
+    int i = 0, slots = _child_slots(node);
+    for(i = 0; i < slots; i ++) {
+        uint8_t c = 0;
+        _destroy(_child_at(node, i, &c));
+    }
+    if(node->leaf) _leaf_free(node->leaf);
+    _node_free(node);
+}
+
+int kv_art_init(void) {
+
+    art = (art_t *)mymalloc(sizeof(art_t));
+    if(!art) return -1;
+
+    memset(art, 0, sizeof(art_t));
+    pthread_mutex_init(&art->lock, NULL);
+
+    return 0;
+}
+
+void kv_art_destroy(void) {
+    if(!art) return;
+
+    pthread_mutex_lock(&art->lock);
+    _destroy(art->root);
+    pthread_mutex_unlock(&art->lock);
+    pthread_mutex_destroy(&art->lock);
+
+    myfree(art);
+    art = NULL;
+}
+
+/*
+ * set/get/delete/modify/range expect the caller to hold the tree lock, a
+ * batch of ops takes it once for all of them.
+ */
+void kv_art_lock(void) {
+    pthread_mutex_lock(&art->lock);
+}
+
+void kv_art_unlock(void) {
+    pthread_mutex_unlock(&art->lock);
+}
+
+int kv_art_set(const char *key, size_t klen, const char *value, size_t vlen) {
+    if(!art || !key || !value) return -1;
+
+    // an existing key is left as it is
+    if(_search(key, klen)) return 0;
+
+    art_leaf_t *leaf = _leaf_create(key, klen, value, vlen);
+    if(!leaf) {
+        fprintf(stderr, "leaf malloc failed\n");
+        return -1;
+    }
+
+    if(_insert(leaf)) {
+        _leaf_free(leaf);
+        return -1;
+    }
+
+    art->count ++;
+    art->bytes += klen + vlen;
+    return 0;
+}
+
+// the caller owns a reference to the returned value
+kv_value_t *kv_art_get(const char *key, size_t klen) {
+    if(!art || !key) return NULL;
+
+    art_leaf_t *leaf = _search(key, klen);
+    return leaf ? kv_value_get(leaf->value) : NULL;
+}
+
+int kv_art_delete(const char *key, size_t klen) {
+    if(!art || !key) return -1;
+
+    art_leaf_t *leaf = _delete(key, klen);
+    if(!leaf) return -1;
+
+    art->count --;
+    art->bytes -= klen + leaf->value->len;
+    _leaf_free(leaf);
+
+    return 0;
+}
+
+int kv_art_modify(const char *key, size_t klen, const char *value, size_t vlen) {
+    if(!art || !key || !value) return -1;
+
+    art_leaf_t *leaf = _search(key, klen);
+    if(!leaf) return -1;
+
+    kv_value_t *vcopy = kv_value_create(value, vlen);
+    if(!vcopy) {
+        fprintf(stderr, "vcopy malloc failed\n");
+        return -1;
+    }
+
+    art->bytes += vlen - leaf->value->len;
+    kv_value_put(leaf->value);
+    leaf->value = vcopy;
+
+    return 0;
+}
+
+// non zero once the walk is over, either fn asked to stop or a bound was passed
+static int _walk_leaf(art_walk_t *w, art_leaf_t *leaf, int lo, int hi) {
+    const kv_key_t *key = leaf->key;
+    int cmp;
+
+    if(lo) {
+        cmp = kv_key_compare(w->start, w->slen, kv_key_prefix(w->start, w->slen), key);
+        if(cmp > 0 || (cmp == 0 && w->start_excl)) return w->reverse;
+    }
+    if(hi) {
+        cmp = kv_key_compare(w->end, w->elen, kv_key_prefix(w->end, w->elen), key);
+        if(cmp < 0 || (cmp == 0 && w->end_excl)) return !w->reverse;
+    }
+
+    w->ret = w->fn(key, leaf->value, w->arg);
+    return w->ret != 0;
+}
+
+/*
+ * in order walk below ptr, entered at depth. lo and hi are set while the
+ * path so far equals the first bytes of start and end, only then can the
+ * bounds cut into the subtree, every other subtree is taken or left whole.
+ */
+static int _walk(art_walk_t *w, const void *ptr, size_t depth, int lo, int hi) {
+    if(_is_leaf(ptr)) return _walk_leaf(w, _leaf(ptr), lo, hi);
+
+    const art_node_t *node = ptr;
+    if(node->plen && (lo || hi)) {
+        const uint8_t *prefix = _prefix(node, depth);
+        uint32_t i = 0;
+
+        // every key below is longer than a bound the prefix runs past
+        for(i = 0; lo && i < node->plen; i ++) {
+            if(depth + i == w->slen || prefix[i] > (uint8_t)w->start[depth + i]) lo = 0;
+            else if(prefix[i] < (uint8_t)w->start[depth + i]) return w->reverse;
+        }
+        for(i = 0; hi && i < node->plen; i ++) {
+            if(depth + i == w->elen || prefix[i] > (uint8_t)w->end[depth + i]) return !w->reverse;
+            if(prefix[i] < (uint8_t)w->end[depth + i]) hi = 0;
+        }
+    }
+    depth += node->plen;
+
+    if(!w->reverse && node->leaf && _walk_leaf(w, node->leaf, lo, hi)) return 1;
+
+    int i = 0, slots = _child_slots(node);
+    for(i = 0; i < slots; i ++) {
+        uint8_t c = 0;
+        void *child = _child_at((art_node_t *)node, w->reverse ? slots - 1 - i : i, &c);
+        if(!child) continue;
+
+        if(lo && depth < w->slen && c < (uint8_t)w->start[depth]) {
+            if(w->reverse) return 1;
+            continue;
+        }
+        if(hi && (depth == w->elen || c > (uint8_t)w->end[depth])) {
+            if(!w->reverse) return 1;
+            continue;
+        }
+
+        int clo = lo && depth < w->slen && c == (uint8_t)w->start[depth];
+        int chi = hi && c == (uint8_t)w->end[depth];
+        if(_walk(w, child, depth + 1, clo, chi)) return 1;
+    }
+
+    if(w->reverse && node->leaf && _walk_leaf(w, node->leaf, lo, hi)) return 1;
+    return 0;
+}
+
+// visit every pair in key order until fn returns non zero, takes the lock
+int kv_art_scan(kvs_scan_fn fn, void *arg) {
+    if(!art || !fn) return -1;
+
+    art_walk_t w = {0};
+    w.fn = fn;
+    w.arg = arg;
+
+    pthread_mutex_lock(&art->lock);
+    if(art->root) _walk(&w, art->root, 0, 0, 0);
+    pthread_mutex_unlock(&art->lock);
+    return w.ret;
+}
+
+/*
+ * walk the pairs between start and end, see kvs_engine_t. the walk goes
+ * straight down the path both bounds share, so the pairs under a key
+ * prefix cost one descent to its node and a walk of that subtree alone.
+ */
+int kv_art_range(const char *start, size_t slen, const char *end, size_t elen,
+    int flags, kvs_scan_fn fn, void *arg) {
+    if(!art || !fn) return -1;
+
+    art_walk_t w = {0};
+    w.start = start;
+    w.slen = slen;
+    w.end = end;
+    w.elen = elen;
+    w.reverse = (flags & KVS_OP_REVERSE) != 0;
+    w.start_excl = (flags & KVS_OP_START_EXCL) != 0;
+    w.end_excl = (flags & KVS_OP_END_EXCL) != 0;
+    w.fn = fn;
+    w.arg = arg;
+
+    if(art->root) _walk(&w, art->root, 0, 1, end != NULL);
+    return w.ret;
+}
+
+void kv_art_stats(kvs_engine_stats_t *stats) {
+    if(!art) return;
+    stats->count = art->count;
+    stats->bytes = art->bytes;
+}
+
+const kvs_engine_t kv_art_engine = {
+    .name = "art",
+    .init = kv_art_init,
+    .destroy = kv_art_destroy,
+    .lock = kv_art_lock,
+    .unlock = kv_art_unlock,
+    .set = kv_art_set,
+    .get = kv_art_get,
+    .del = kv_art_delete,
+    .mod = kv_art_modify,
+    .scan = kv_art_scan,
+    .range = kv_art_range,
+    .stats = kv_art_stats,
+};
+
+
+#ifdef KV_ART_DEBUG
+static int print_pair(const kv_key_t *key, kv_value_t *value, void *arg) {
+    printf("%s => %s\n", key->data, value->data);
+    return 0;
+}
+
+// stop after *arg pairs
+static int print_some(const kv_key_t *key, kv_value_t *value, void *arg) {
+    printf("  %s => %s\n", key->data, value->data);
+    return -- *(int *)arg == 0;
+}
+
+static int count_pair(const kv_key_t *key, kv_value_t *value, void *arg) {
+    (*(int *)arg) ++;
+    return 0;
+}
+
+// the second byte of two byte keys must move one way, arg is {last byte, direction, count, bad}
+static int walk_order(const kv_key_t *key, kv_value_t *value, void *arg) {
+    int *state = arg;
+    int b = (uint8_t)key->data[1];
+    if(state[2] && (b - state[0]) * state[1] <= 0) state[3] ++;
+    state[0] = b;
+    state[2] ++;
+    return 0;
+}
+
+// node sizes in use, every subtree is checked to be in key order
+static int _check(const void *ptr, int *types, char *last, size_t *llen, int *first) {
+    if(!ptr) return 0;
+    if(_is_leaf(ptr)) {
+        const kv_key_t *key = _leaf(ptr)->key;
+        int bad = !*first && kv_key_compare(last, *llen, kv_key_prefix(last, *llen), key) >= 0;
+        memcpy(last, key->data, key->len);
+        *llen = key->len;
+        *first = 0;
+        return bad;
+    }
+
+    const art_node_t *node = ptr;
+    int bad = node->count + (node->leaf != NULL) < 2;
+    types[node->type] ++;
+    if(node->leaf) bad += _check(_tag(node->leaf), types, last, llen, first);
+
+    int i = 0, slots = _child_slots(node);
+    for(i = 0; i < slots; i ++) {
+        uint8_t c = 0;
+        bad += _check(_child_at((art_node_t *)node, i, &c), types, last, llen, first);
+    }
+    return bad;
+}
+
+int main() {
+
+    kv_art_init();
+
+    kv_art_set(KV_STR("city"), KV_STR("sz"));
+    kv_art_set(KV_STR("server"), KV_STR("nginx"));
+    kv_art_set(KV_STR("request url"), KV_STR("https://jjc.com"));
+    kv_art_set(KV_STR("status code"), KV_STR("200"));
+    kv_art_set(KV_STR("request method"), KV_STR("GET"));
+
+    kv_value_t *result = kv_art_get(KV_STR("city"));
+    printf("result fot city %s\n", result->data);
+    kv_value_put(result);
+
+    kv_art_modify(KV_STR("city"), KV_STR("shenzhen"));
+    result = kv_art_get(KV_STR("city"));
+    printf("result fot city %s\n", result->data);
+    kv_value_put(result);
+
+    // keys and values may hold any byte, "bin\0key" sorts after "bin"
+    kv_art_set(KV_STR("bin"), KV_STR("short"));
+    kv_art_set(KV_STR("bin\0key"), KV_STR("a\0b"));
+    result = kv_art_get(KV_STR("bin\0key"));
+    printf("result fot bin key %u bytes\n", result->len);
+    kv_value_put(result);
+
+    kv_art_delete(KV_STR("city"));
+    result = kv_art_get(KV_STR("city"));
+    printf("result fot city %s\n", result ? result->data : NULL);
+
+    kv_art_engine.scan(print_pair, NULL);
+
+    int limit = 100;
+    printf("range [bin, s]:\n");
+    kv_art_range(KV_STR("bin"), KV_STR("s"), 0, print_some, &limit);
+    printf("reverse [request, status code):\n");
+    kv_art_range(KV_STR("request"), KV_STR("status code"),
+        KVS_OP_REVERSE | KVS_OP_END_EXCL, print_some, &limit);
+
+    // hierarchical keys share long prefixes, node sizes follow the fanout
+    char key[64];
+    int i = 0, j = 0, n = 0;
+    for(i = 0; i < 300; i ++) {
+        for(j = 0; j < 20; j ++) {
+            int len = snprintf(key, sizeof(key), "tenant:%d:service:orders:object:%d", i, j);
+            kv_art_set(key, len, key, len);
+        }
+    }
+    printf("prefix tenant:42:\n");
+    limit = 3;
+    kv_art_range(KV_STR("tenant:42:"), KV_STR("tenant:42;"), KVS_OP_END_EXCL, print_some, &limit);
+    kv_art_range(KV_STR("tenant:42:"), KV_STR("tenant:42;"), KVS_OP_END_EXCL, count_pair, &n);
+    printf("%d keys under tenant:42:\n", n);
+
+    int types[4] = {0}, first = 1;
+    size_t llen = 0;
+    char last[KVS_MAX_KEY_LEN];
+    int bad = _check(art->root, types, last, &llen, &first);
+    printf("nodes 4/16/48/256: %d/%d/%d/%d, %d bad\n", types[0], types[1], types[2], types[3], bad);
+
+    for(i = 0; i < 300; i ++) {
+        for(j = 0; j < 20; j ++) {
+            if(i % 7 == 0 && j % 5 == 0) continue;
+            int len = snprintf(key, sizeof(key), "tenant:%d:service:orders:object:%d", i, j);
+            if(kv_art_delete(key, len)) bad ++;
+        }
+    }
+    memset(types, 0, sizeof(types));
+    first = 1;
+    bad += _check(art->root, types, last, &llen, &first);
+
+    // every byte after 'w' grows a Node256, 40 of them after 'm' a Node48
+    char fan[2];
+    for(i = 0; i < 256; i ++) {
+        fan[0] = 'w';
+        fan[1] = (char)i;
+        kv_art_set(fan, 2, fan, 2);
+        if(i % 6 == 0 && i / 6 < 40) {
+            fan[0] = 'm';
+            kv_art_set(fan, 2, fan, 2);
+        }
+    }
+    memset(types, 0, sizeof(types));
+    first = 1;
+    bad += _check(art->root, types, last, &llen, &first);
+    printf("wide fanout nodes 4/16/48/256: %d/%d/%d/%d\n", types[0], types[1], types[2], types[3]);
+    if(!types[2] || !types[3]) bad ++;
+
+    int walk[4] = {0, 1, 0, 0};
+    kv_art_range(KV_STR("w"), KV_STR("x"), KVS_OP_END_EXCL, walk_order, walk);
+    int back[4] = {0, -1, 0, 0};
+    kv_art_range(KV_STR("w"), KV_STR("x"), KVS_OP_END_EXCL | KVS_OP_REVERSE, walk_order, back);
+    printf("256 way walk: %d forward, %d reverse\n", walk[2], back[2]);
+    if(walk[2] != 256 || back[2] != 256 || walk[3] || back[3]) bad ++;
+
+    // below art_min the Node256 shrinks to a Node48, then both to a Node16
+    for(i = 30; i < 256; i ++) {
+        fan[0] = 'w';
+        fan[1] = (char)i;
+        if(kv_art_delete(fan, 2)) bad ++;
+    }
+    memset(types, 0, sizeof(types));
+    first = 1;
+    bad += _check(art->root, types, last, &llen, &first);
+    printf("shrunk nodes 4/16/48/256: %d/%d/%d/%d\n", types[0], types[1], types[2], types[3]);
+    if(types[3]) bad ++;
+
+    for(i = 10; i < 240; i ++) {
+        fan[1] = (char)i;
+        fan[0] = 'w';
+        if(i < 30 && kv_art_delete(fan, 2)) bad ++;
+        fan[0] = 'm';
+        if(i >= 60 && i % 6 == 0 && i / 6 < 40 && kv_art_delete(fan, 2)) bad ++;
+    }
+    memset(types, 0, sizeof(types));
+    first = 1;
+    bad += _check(art->root, types, last, &llen, &first);
+    printf("shrunk nodes 4/16/48/256: %d/%d/%d/%d\n", types[0], types[1], types[2], types[3]);
+    if(types[2] || types[3]) bad ++;
+
+    kvs_engine_stats_t stats = {0};
+    kv_art_engine.stats(&stats);
+    printf("%zu pairs, %zu bytes, %zu nodes, %d bad\n", stats.count, stats.bytes, art->nodes, bad);
+    kv_art_destroy();
+
+    return 0;
+}
+#endif
@@ -0,0 +1,672 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "../kvstore.h"
+#include "../mm/mymalloc.h"
+
+/*
+ * an ordered engine with wide nodes. every node holds up to BPT_ORDER keys
+ * next to an inline array of their 8 byte big endian prefixes, so the binary
+ * search inside a node runs over four cache lines of integers and a key is
+ * only read when its prefix ties. a lookup takes one miss or so per level,
+ * and with 32 way fanout there are five levels at tens of millions of keys
+ * where the red-black tree has more than twenty.
+ *
+ * pairs live in the leaves, which are linked both ways for scans. inner
+ * nodes hold separator copies: keys[i] is at most the smallest key below
+ * children[i + 1] and above every key below children[i]. inserts split full
+ * nodes on the way down, deletes merge an underfull node with a sibling, or
+ * for inner nodes borrow from it, on the way back up. a delete never
+ * allocates, so a leaf whose sibling is too full to merge stays underfull.
+ */
+#define BPT_ORDER           32          // keys per node
+#define BPT_MIN             (BPT_ORDER / 4)
+#define BPT_MAX_DEPTH       16
+
+typedef struct bpt_node_s bpt_node_t;
+
+struct bpt_node_s {
+    uint64_t prefixes[BPT_ORDER];       // keys[i]->prefix, searched first
+    kv_key_t *keys[BPT_ORDER];
+    int n;
+    int leaf;
+    union {
+        bpt_node_t *children[BPT_ORDER + 1];
+        struct {
+            kv_value_t *values[BPT_ORDER];
+            bpt_node_t *prev;
+            bpt_node_t *next;
+        };
+    };
+};
+
+typedef struct bptree_s {
+    bpt_node_t *root;
+    int depth;              // levels, 1 while the root is a leaf
+
+    size_t count;
+    size_t bytes;
+    size_t nodes;
+
+    pthread_mutex_t lock;
+} bptree_t;
+
+// inner nodes passed on the way to a leaf and the child taken in each
+typedef struct bpt_path_s {
+    bpt_node_t *nodes[BPT_MAX_DEPTH];
+    int idx[BPT_MAX_DEPTH];
+    int depth;
+} bpt_path_t;
+
+// one instance per reactor thread
+__thread bptree_t *bptree = NULL;
+
+static bpt_node_t *_node_alloc(int leaf) {
+    bpt_node_t *node = (bpt_node_t *)mymalloc(sizeof(bpt_node_t));
+    if(!node) return NULL;
+
+    memset(node, 0, sizeof(bpt_node_t));
+    node->leaf = leaf;
+    bptree->nodes ++;
+    return node;
+}
+
+static void _node_free(bpt_node_t *node) {
+    bptree->nodes --;
+    myfree(node);
+}
+
+static inline void _set_key(bpt_node_t *node, int i, kv_key_t *key) {
+    node->keys[i] = key;
+    node->prefixes[i] = key->prefix;
+}
+
+// move the keys (and values of a leaf) of [src, src + n) to dst
+static inline void _move(bpt_node_t *dst_node, int dst, bpt_node_t *src_node, int src, int n) {
+    memmove(&dst_node->prefixes[dst], &src_node->prefixes[src], n * sizeof(uint64_t));
+    memmove(&dst_node->keys[dst], &src_node->keys[src], n * sizeof(kv_key_t *));
+    if(src_node->leaf) {
+        memmove(&dst_node->values[dst], &src_node->values[src], n * sizeof(kv_value_t *));
+    }
+}
+
+static inline void _move_children(bpt_node_t *dst_node, int dst, bpt_node_t *src_node, int src, int n) {
+    memmove(&dst_node->children[dst], &src_node->children[src], n * sizeof(bpt_node_t *));
+}
+
+// key against keys[i] like memcmp, the full key is only read on a prefix tie
+static inline int _cmp(const bpt_node_t *node, int i, const char *key, size_t klen, uint64_t prefix) {
+    if(prefix != node->prefixes[i]) return prefix < node->prefixes[i] ? -1 : 1;
+    return kv_key_compare(key, klen, prefix, node->keys[i]);
+}
+
+// first i whose key is not below key, not above it with upper, n if none
+static inline int _search(const bpt_node_t *node, const char *key, size_t klen, uint64_t prefix, int upper) {
+    int lo = 0, hi = node->n;
+    while(lo < hi) {
+        int mid = (lo + hi) >> 1;
+        int ret = _cmp(node, mid, key, klen, prefix);
+        if(ret > 0 || (ret == 0 && upper)) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// the leaf that holds key if anything does, recording the way down in path
+static bpt_node_t *_descend(const char *key, size_t klen, uint64_t prefix, bpt_path_t *path) {
+    bpt_node_t *node = bptree->root;
+    int depth = 0;
+
+    while(!node->leaf) {
+        int i = _search(node, key, klen, prefix, 1);
+        if(path) {
+            path->nodes[depth] = node;
+            path->idx[depth] = i;
+        }
+        depth ++;
+        node = node->children[i];
+        __builtin_prefetch(node->prefixes);
+        __builtin_prefetch(&node->prefixes[BPT_ORDER / 2]);
+    }
+    if(path) path->depth = depth;
+    return node;
+}
+
+// the leaf position of key, -1 if it is not stored
+static int _find(const char *key, size_t klen, bpt_node_t **leaf) {
+    uint64_t prefix = kv_key_prefix(key, klen);
+    bpt_node_t *node = _descend(key, klen, prefix, NULL);
+    int i = _search(node, key, klen, prefix, 0);
+
+    if(i == node->n || _cmp(node, i, key, klen, prefix) != 0) return -1;
+    *leaf = node;
+    return i;
+}
+
+// split the full children[i] of parent in two halves, parent has room for one more key
+static int _split(bpt_node_t *parent, int i) {
+    bpt_node_t *child = parent->children[i];
+    int mid = BPT_ORDER / 2;
+    kv_key_t *sep = NULL;
+
+    if(child->leaf) {
+        // the separator outlives the leaf key it was copied from
+        sep = kv_key_create(child->keys[mid]->data, child->keys[mid]->len);
+        if(!sep) return -1;
+    }
+
+    bpt_node_t *right = _node_alloc(child->leaf);
+    if(!right) {
+        if(sep) kv_key_free(sep);
+        return -1;
+    }
+
+    if(child->leaf) {
+        _move(right, 0, child, mid, BPT_ORDER - mid);
+        right->n = BPT_ORDER - mid;
+        child->n = mid;
+
+        right->next = child->next;
+        right->prev = child;
+        if(child->next) child->next->prev = right;
+        child->next = right;
+    } else {
+        // the middle key moves up
+        sep = child->keys[mid];
+        _move(right, 0, child, mid + 1, BPT_ORDER - mid - 1);
+        _move_children(right, 0, child, mid + 1, BPT_ORDER - mid);
+        right->n = BPT_ORDER - mid - 1;
+        child->n = mid;
+    }
+
+    _move(parent, i + 1, parent, i, parent->n - i);
+    _move_children(parent, i + 2, parent, i + 1, parent->n - i);
+    _set_key(parent, i, sep);
+    parent->children[i + 1] = right;
+    parent->n ++;
+
+    return 0;
+}
+
+// fold children[li + 1] of parent into children[li] with the separator between them
+static void _merge(bpt_node_t *parent, int li) {
+    bpt_node_t *left = parent->children[li];
+    bpt_node_t *right = parent->children[li + 1];
+
+    if(left->leaf) {
+        _move(left, left->n, right, 0, right->n);
+        left->n += right->n;
+
+        left->next = right->next;
+        if(right->next) right->next->prev = left;
+        kv_key_free(parent->keys[li]);
+    } else {
+        _set_key(left, left->n, parent->keys[li]);
+        _move(left, left->n + 1, right, 0, right->n);
+        _move_children(left, left->n + 1, right, 0, right->n + 1);
+        left->n += 1 + right->n;
+    }
+
+    _move(parent, li, parent, li + 1, parent->n - li - 1);
+    _move_children(parent, li + 1, parent, li + 2, parent->n - li - 1);
+    parent->n --;
+
+    _node_free(right);
+}
+
+// rotate one key of an inner sibling through the parent into children[li] or children[li + 1]
+static void _borrow(bpt_node_t *parent, int li, int into_left) {
+    bpt_node_t *left = parent->children[li];
+    bpt_node_t *right = parent->children[li + 1];
+
+    if(into_left) {
+        _set_key(left, left->n, parent->keys[li]);
+        left->children[left->n + 1] = right->children[0];
+        left->n ++;
+
+        _set_key(parent, li, right->keys[0]);
+        _move(right, 0, right, 1, right->n - 1);
+        _move_children(right, 0, right, 1, right->n);
+        right->n --;
+    } else {
+        _move(right, 1, right, 0, right->n);
+        _move_children(right, 1, right, 0, right->n + 1);
+        _set_key(right, 0, parent->keys[li]);
+        right->children[0] = left->children[left->n];
+        right->n ++;
+
+        _set_key(parent, li, left->keys[left->n - 1]);
+        left->n --;
+    }
+}
+
+// restore the fill of node and the inner nodes above it after a delete
+static void _rebalance(bpt_path_t *path, bpt_node_t *node) {
+    int level = path->depth;
+
+    while(level > 0 && node->n < BPT_MIN) {
+        bpt_node_t *parent = path->nodes[level - 1];
+        int ci = path->idx[level - 1];
+        int li = ci > 0 ? ci - 1 : 0;
+        bpt_node_t *left = parent->children[li];
+        bpt_node_t *right = parent->children[li + 1];
+
+        if(node->leaf) {
+            if(left->n + right->n > BPT_ORDER) break;
+        } else {
+            bpt_node_t *sibling = node == left ? right : left;
+            if(sibling->n > BPT_MIN) {
+                _borrow(parent, li, node == left);
+                break;
+            }
+        }
+        _merge(parent, li);
+
+        node = parent;
+        level --;
+    }
+
+    if(!bptree->root->leaf && bptree->root->n == 0) {
+        bpt_node_t *root = bptree->root;
+        bptree->root = root->children[0];
+        bptree->depth --;
+        _node_free(root);
+    }
+}
+
+static void _destroy(bpt_node_t *node) {
+    int i = 0;
+    for(i = 0; i < node->n; i ++) {
+        kv_key_free(node->keys[i]);
+        if(node->leaf) kv_value_put(node->values[i]);
+    }
+    if(!node->leaf) {
+        for(i = 0; i <= node->n; i ++) {
+            _destroy(node->children[i]);
+        }
+    }
+    _node_free(node);
+}
+
+int kv_bptree_init(void) {
+
+    bptree = (bptree_t *)mymalloc(sizeof(bptree_t));
+    if(!bptree) return -1;
+
+    memset(bptree, 0, sizeof(bptree_t));
+    bptree->root = _node_alloc(1);
+    if(!bptree->root) {
+        myfree(bptree);
+        bptree = NULL;
+        return -1;
+    }
+    bptree->depth = 1;
+
+    pthread_mutex_init(&bptree->lock, NULL);
+
+    return 0;
+}
+
+void kv_bptree_destroy(void) {
+    if(!bptree) return;
+
+    pthread_mutex_lock(&bptree->lock);
+    _destroy(bptree->root);
+    pthread_mutex_unlock(&bptree->lock);
+    pthread_mutex_destroy(&bptree->lock);
+
+    myfree(bptree);
+    bptree = NULL;
+}
+
+/*
+ * set/get/delete/modify/range expect the caller to hold the tree lock, a
+ * batch of ops takes it once for all of them.
+ */
+void kv_bptree_lock(void) {
+    pthread_mutex_lock(&bptree->lock);
+}
+
+void kv_bptree_unlock(void) {
+    pthread_mutex_unlock(&bptree->lock);
+}
+
+int kv_bptree_set(const char *key, size_t klen, const char *value, size_t vlen) {
+    if(!bptree || !key || !value) return -1;
+
+    uint64_t prefix = kv_key_prefix(key, klen);
+
+    if(bptree->root->n == BPT_ORDER) {
+        if(bptree->depth == BPT_MAX_DEPTH) return -1;
+
+        bpt_node_t *root = _node_alloc(0);
+        if(!root) return -1;
+        root->children[0] = bptree->root;
+        if(_split(root, 0)) {
+            _node_free(root);
+            return -1;
+        }
+        bptree->root = root;
+        bptree->depth ++;
+    }
+
+    // split full nodes on the way down, so the leaf and its parents have room
+    bpt_node_t *node = bptree->root;
+    while(!node->leaf) {
+        int i = _search(node, key, klen, prefix, 1);
+        if(node->children[i]->n == BPT_ORDER) {
+            if(_split(node, i)) return -1;
+            if(_cmp(node, i, key, klen, prefix) >= 0) i ++;
+        }
+        node = node->children[i];
+    }
+
+    int i = _search(node, key, klen, prefix, 0);
+    if(i < node->n && _cmp(node, i, key, klen, prefix) == 0) {
+        return 0;
+    }
+
+    kv_key_t *kcopy = kv_key_create(key, klen);
+    if(!kcopy) {
+        fprintf(stderr, "kcopy malloc failed\n");
+        return -1;
+    }
+
+    kv_value_t *vcopy = kv_value_create(value, vlen);
+    if(!vcopy) {
+        kv_key_free(kcopy);
+        fprintf(stderr, "vcopy malloc failed\n");
+        return -1;
+    }
+
+    _move(node, i + 1, node, i, node->n - i);
+    _set_key(node, i, kcopy);
+    node->values[i] = vcopy;
+    node->n ++;
+
+    bptree->count ++;
+    bptree->bytes += klen + vlen;
+
+    return 0;
+}
+
+// the caller owns a reference to the returned value
+kv_value_t *kv_bptree_get(const char *key, size_t klen) {
+    if(!bptree || !key) return NULL;
+
+    bpt_node_t *leaf = NULL;
+    int i = _find(key, klen, &leaf);
+    if(i < 0) return NULL;
+
+    return kv_value_get(leaf->values[i]);
+}
+
+int kv_bptree_delete(const char *key, size_t klen) {
+    if(!bptree || !key) return -1;
+
+    uint64_t prefix = kv_key_prefix(key, klen);
+    bpt_path_t path;
+    bpt_node_t *leaf = _descend(key, klen, prefix, &path);
+    int i = _search(leaf, key, klen, prefix, 0);
+    if(i == leaf->n || _cmp(leaf, i, key, klen, prefix) != 0) return -1;
+
+    bptree->count --;
+    bptree->bytes -= leaf->keys[i]->len + leaf->values[i]->len;
+    kv_key_free(leaf->keys[i]);
+    kv_value_put(leaf->values[i]);
+
+    _move(leaf, i, leaf, i + 1, leaf->n - i - 1);
+    leaf->n --;
+
+    _rebalance(&path, leaf);
+
+    return 0;
+}
+
+int kv_bptree_modify(const char *key, size_t klen, const char *value, size_t vlen) {
+    if(!bptree || !key || !value) return -1;
+
+    bpt_node_t *leaf = NULL;
+    int i = _find(key, klen, &leaf);
+    if(i < 0) return -1;
+
+    kv_value_t *vcopy = kv_value_create(value, vlen);
+    if(!vcopy) {
+        fprintf(stderr, "vcopy malloc failed\n");
+        return -1;
+    }
+
+    bptree->bytes += vlen - leaf->values[i]->len;
+    kv_value_put(leaf->values[i]);
+    leaf->values[i] = vcopy;
+
+    return 0;
+}
+
+static bpt_node_t *_leftmost(void) {
+    bpt_node_t *node = bptree->root;
+    while(!node->leaf) node = node->children[0];
+    return node;
+}
+
+static bpt_node_t *_rightmost(void) {
+    bpt_node_t *node = bptree->root;
+    while(!node->leaf) node = node->children[node->n];
+    return node;
+}
+
+// visit every pair in key order until fn returns non zero, takes the lock
+int kv_bptree_scan(kvs_scan_fn fn, void *arg) {
+    if(!bptree || !fn) return -1;
+
+    int ret = 0;
+    pthread_mutex_lock(&bptree->lock);
+    bpt_node_t *leaf = _leftmost();
+    for(; leaf && !ret; leaf = leaf->next) {
+        int i = 0;
+        for(i = 0; i < leaf->n && !ret; i ++) {
+            ret = fn(leaf->keys[i], leaf->values[i], arg);
+        }
+    }
+    pthread_mutex_unlock(&bptree->lock);
+    return ret;
+}
+
+/*
+ * walk the pairs between start and end, see kvs_engine_t. one descent
+ * finds the first pair, the rest is a walk along the leaf chain.
+ */
+int kv_bptree_range(const char *start, size_t slen, const char *end, size_t elen,
+    int flags, kvs_scan_fn fn, void *arg) {
+    if(!bptree || !fn) return -1;
+
+    int reverse = flags & KVS_OP_REVERSE;
+    int start_excl = (flags & KVS_OP_START_EXCL) != 0;
+    int end_excl = (flags & KVS_OP_END_EXCL) != 0;
+    uint64_t sprefix = kv_key_prefix(start, slen);
+    uint64_t eprefix = end ? kv_key_prefix(end, elen) : 0;
+    bpt_node_t *leaf;
+    int i;
+
+    if(!reverse) {
+        leaf = _descend(start, slen, sprefix, NULL);
+        i = _search(leaf, start, slen, sprefix, start_excl);
+    } else if(end) {
+        leaf = _descend(end, elen, eprefix, NULL);
+        i = _search(leaf, end, elen, eprefix, !end_excl) - 1;
+    } else {
+        leaf = _rightmost();
+        i = leaf->n - 1;
+    }
+
+    int ret = 0;
+    while(!ret) {
+        if(!reverse) {
+            while(leaf && i >= leaf->n) {
+                leaf = leaf->next;
+                i = 0;
+            }
+        } else {
+            while(leaf && i < 0) {
+                leaf = leaf->prev;
+                i = leaf ? leaf->n - 1 : 0;
+            }
+        }
+        if(!leaf) break;
+
+        int cmp;
+        if(!reverse && end) {
+            cmp = _cmp(leaf, i, end, elen, eprefix);
+            if(cmp < 0 || (cmp == 0 && end_excl)) break;
+        } else if(reverse) {
+            cmp = _cmp(leaf, i, start, slen, sprefix);
+            if(cmp > 0 || (cmp == 0 && start_excl)) break;
+        }
+
+        ret = fn(leaf->keys[i], leaf->values[i], arg);
+        i += reverse ? -1 : 1;
+    }
+    return ret;
+}
+
+void kv_bptree_stats(kvs_engine_stats_t *stats) {
+    if(!bptree) return;
+    stats->count = bptree->count;
+    stats->bytes = bptree->bytes;
+}
+
+const kvs_engine_t kv_bptree_engine = {
+    .name = "bptree",
+    .init = kv_bptree_init,
+    .destroy = kv_bptree_destroy,
+    .lock = kv_bptree_lock,
+    .unlock = kv_bptree_unlock,
+    .set = kv_bptree_set,
+    .get = kv_bptree_get,
+    .del = kv_bptree_delete,
+    .mod = kv_bptree_modify,
+    .scan = kv_bptree_scan,
+    .range = kv_bptree_range,
+    .stats = kv_bptree_stats,
+};
+
+
+#ifdef KV_BPTREE_DEBUG
+static int print_pair(const kv_key_t *key, kv_value_t *value, void *arg) {
+    printf("%s => %s\n", key->data, value->data);
+    return 0;
+}
+
+// stop after *arg pairs
+static int print_some(const kv_key_t *key, kv_value_t *value, void *arg) {
+    printf("  %s => %s\n", key->data, value->data);
+    return -- *(int *)arg == 0;
+}
+
+// order, separator bounds, fill and leaf depth below node, returns the pairs found
+static long _check(bpt_node_t *node, const kv_key_t *lo, const kv_key_t *hi, int depth) {
+    long pairs = 0;
+    int i = 0;
+
+    for(i = 0; i < node->n; i ++) {
+        const kv_key_t *k = node->keys[i];
+        if(node->prefixes[i] != k->prefix) return -1;
+        if(i && kv_key_compare(k->data, k->len, k->prefix, node->keys[i - 1]) <= 0) return -1;
+        if(lo && kv_key_compare(k->data, k->len, k->prefix, lo) < 0) return -1;
+        if(hi && kv_key_compare(k->data, k->len, k->prefix, hi) >= 0) return -1;
+    }
+    if(node->leaf) return depth == bptree->depth ? node->n : -1;
+    if(node != bptree->root && node->n < BPT_MIN) return -1;
+
+    for(i = 0; i <= node->n; i ++) {
+        long sub = _check(node->children[i], i ? node->keys[i - 1] : lo,
+            i < node->n ? node->keys[i] : hi, depth + 1);
+        if(sub < 0) return -1;
+        pairs += sub;
+    }
+    return pairs;
+}
+
+int main() {
+
+    kv_bptree_init();
+
+    kv_bptree_set(KV_STR("city"), KV_STR("sz"));
+    kv_bptree_set(KV_STR("server"), KV_STR("nginx"));
+    kv_bptree_set(KV_STR("request url"), KV_STR("https://jjc.com"));
+    kv_bptree_set(KV_STR("status code"), KV_STR("200"));
+    kv_bptree_set(KV_STR("request method"), KV_STR("GET"));
+
+    kv_value_t *result = kv_bptree_get(KV_STR("city"));
+    printf("result fot city %s\n", result->data);
+    kv_value_put(result);
+
+    kv_bptree_modify(KV_STR("city"), KV_STR("shenzhen"));
+    result = kv_bptree_get(KV_STR("city"));
+    printf("result fot city %s\n", result->data);
+    kv_value_put(result);
+
+    // keys and values may hold any byte, "bin\0key" sorts after "bin"
+    kv_bptree_set(KV_STR("bin"), KV_STR("short"));
+    kv_bptree_set(KV_STR("bin\0key"), KV_STR("a\0b"));
+    result = kv_bptree_get(KV_STR("bin\0key"));
+    printf("result fot bin key %u bytes\n", result->len);
+    kv_value_put(result);
+
+    kv_bptree_delete(KV_STR("city"));
+    result = kv_bptree_get(KV_STR("city"));
+    printf("result fot city %s\n", result ? result->data : NULL);
+
+    kvs_engine_stats_t stats = {0};
+    kv_bptree_engine.scan(print_pair, NULL);
+
+    int limit = 100;
+    printf("range [bin, s]:\n");
+    kv_bptree_range(KV_STR("bin"), KV_STR("s"), 0, print_some, &limit);
+    printf("reverse [request, status code):\n");
+    kv_bptree_range(KV_STR("request"), KV_STR("status code"),
+        KVS_OP_REVERSE | KVS_OP_END_EXCL, print_some, &limit);
+
+    // enough keys for three levels, then delete down to an empty tree
+    char key[32];
+    int i = 0, wrong = 0;
+    for(i = 0; i < 50000; i ++) {
+        int len = snprintf(key, sizeof(key), "grow%d", (i * 7919) % 50000);
+        kv_bptree_set(key, len, key, len);
+    }
+    printf("depth %d, %zu nodes, check %ld\n", bptree->depth, bptree->nodes,
+        _check(bptree->root, NULL, NULL, 1));
+
+    limit = 3;
+    printf("range (grow49997, +):\n");
+    kv_bptree_range(KV_STR("grow49997"), NULL, 0, KVS_OP_START_EXCL, print_some, &limit);
+
+    for(i = 0; i < 50000; i += 2) {
+        int len = snprintf(key, sizeof(key), "grow%d", i);
+        kv_bptree_delete(key, len);
+    }
+    for(i = 0; i < 50000; i ++) {
+        int len = snprintf(key, sizeof(key), "grow%d", i);
+        kv_value_t *value = kv_bptree_get(key, len);
+        if(!value != !(i & 1)) wrong ++;
+        if(value) kv_value_put(value);
+    }
+    printf("depth %d, %zu nodes, check %ld, %d wrong\n", bptree->depth, bptree->nodes,
+        _check(bptree->root, NULL, NULL, 1), wrong);
+    for(i = 1; i < 50000; i += 2) {
+        int len = snprintf(key, sizeof(key), "grow%d", i);
+        kv_bptree_delete(key, len);
+    }
+    printf("depth %d, %zu nodes, check %ld\n", bptree->depth, bptree->nodes,
+        _check(bptree->root, NULL, NULL, 1));
+
+    kv_bptree_engine.stats(&stats);
+    printf("%zu pairs, %zu bytes\n", stats.count, stats.bytes);
+
+    kv_bptree_destroy();
+
+    return 0;
+}
+#endif
@@ -2,66 +2,224 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
 
 #include "../kvstore.h"
 #include "../mm/mymalloc.h"
+#include "../mm/epoch.h"
 
-#define MAX_TABLE_SIZE 1024
+#define HASH_INIT_SLOTS     1024        // a power of two
+#define HASH_STRIPES        64          // writer locks, at most HASH_INIT_SLOTS
+#define HASH_REHASH_STEP    4           // buckets moved by every write
+#define HASH_REHASH_TICK    1024        // buckets moved by a poller tick
 
+// the key and a small value follow the node, see kv_entry_create()
 typedef struct hashnode_s {
     
-    char *key;
-    char *value;
+    kv_key_t *key;
+    _Atomic(kv_value_t *) value;
+    uint64_t hash;
 
-    struct hashnode_s *next;
+    _Atomic(struct hashnode_s *) next;
 
 } hashnode_t;
 
+/*
+ * the bucket array doubles once it holds more pairs than buckets. the
+ * bigger array hangs off the current one and is filled incrementally,
+ * every write moves a few buckets over and so does the reactor poller.
+ * buckets below moved live in next, the others still in this array, so a
+ * lookup walks a single chain. when all are moved next becomes the table.
+ */
+typedef struct hashslots_s {
+    size_t mask;                        // nodes has mask + 1 slots
+    _Atomic(struct hashslots_s *) next;
+    _Atomic size_t moved;
+    _Atomic(hashnode_t *) nodes[];
+} hashslots_t;
+
+typedef struct hashstripe_s {
+    spinlock_t lock;
+    char pad[64 - sizeof(spinlock_t)];
+} hashstripe_t;
+
+/*
+ * readers take no lock. set/delete/modify take the lock of the key's
+ * stripe, a stripe covers the same buckets in every array size, so moving
+ * a bucket takes its stripe lock too. unlinked nodes and replaced values
+ * are retired to the epoch code rather than freed, and are released once
+ * no reader can still hold them.
+ */
 typedef struct hashtable_s {
-    hashnode_t **nodes;
+    _Atomic(hashslots_t *) slots;
 
-    int max_slots;
-    int count;
+    uint64_t seed;
+    _Atomic size_t count;
+    _Atomic size_t bytes;
 
-    pthread_mutex_t lock;
+    pthread_mutex_t resize;             // one mover at a time, only tried
+    hashstripe_t stripes[HASH_STRIPES];
 
 } hashtable_t;
 
-hashtable_t *hash = NULL;
+// one instance per reactor thread
+__thread hashtable_t *hash = NULL;
 
-static int _hash(const char* key, int size) {
-    if(!key) return -1;
-    int sum = 0;
-    int i = 0;
-    while (key[i] != 0) {
-        sum += key[i];
-        i ++;
+static hashslots_t *_alloc_slots(size_t slots) {
+    hashslots_t *s = (hashslots_t *)mymalloc(sizeof(hashslots_t) + sizeof(hashnode_t *) * slots);
+    if(!s) return NULL;
+
+    memset(s, 0, sizeof(hashslots_t) + sizeof(hashnode_t *) * slots);
+    s->mask = slots - 1;
+    return s;
+}
+
+static inline hashstripe_t *_stripe(uint64_t h) {
+    return &hash->stripes[h & (HASH_STRIPES - 1)];
+}
+
+static _Atomic(hashnode_t *) *_bucket(uint64_t h) {
+    hashslots_t *s = atomic_load_explicit(&hash->slots, memory_order_acquire);
+    for(;;) {
+        size_t idx = h & s->mask;
+        hashslots_t *next = atomic_load_explicit(&s->next, memory_order_acquire);
+        if(!next || idx >= atomic_load_explicit(&s->moved, memory_order_acquire)) {
+            return &s->nodes[idx];
+        }
+        s = next;
     }
-    return sum % size;
 }
 
-static hashnode_t *_create_node(const char *key, const char *value) {
-    hashnode_t *node = (hashnode_t *)mymalloc(sizeof(hashnode_t));
-    if(!node) return NULL;
+static hashnode_t *_find(const char *key, size_t klen, uint64_t h, _Atomic(hashnode_t *) **link) {
+    uint64_t prefix = kv_key_prefix(key, klen);
+    _Atomic(hashnode_t *) *prev = _bucket(h);
+    hashnode_t *node = atomic_load_explicit(prev, memory_order_acquire);
 
-    char* kcopy = mymalloc(strlen(key) + 1);
-    if(!kcopy) {
-        fprintf(stderr, "kcopy malloc failed\n");
-        return NULL;
+    while(node) {
+        if(node->hash == h && kv_key_equal(key, klen, prefix, node->key)) {
+            break;
+        }
+        prev = &node->next;
+        node = atomic_load_explicit(prev, memory_order_acquire);
     }
+    if(link) *link = prev;
+    return node;
+}
 
-    char* vcopy = mymalloc(strlen(value) + 1);
-    if(!vcopy) {
-        myfree(kcopy);
-        fprintf(stderr, "vcopy malloc failed\n");
-        return NULL;
+static void _free_node(void *ptr) {
+    hashnode_t *node = ptr;
+    kv_entry_free(node->key, atomic_load_explicit(&node->value, memory_order_relaxed));
+}
+
+// a node whose value was moved into a copy
+static void _release_node(void *ptr) {
+    kv_entry_release(((hashnode_t *)ptr)->key);
+}
+
+static void _put_value(void *ptr) {
+    kv_value_put(ptr);
+}
+
+/*
+ * move up to n buckets into the bigger array, returns the number moved.
+ * nodes are copied rather than relinked, a reader may still be walking
+ * the old chain, and the old ones are retired. callers are in a section.
+ */
+static int _rehash(int n) {
+    hashslots_t *s = atomic_load_explicit(&hash->slots, memory_order_acquire);
+    if(!atomic_load_explicit(&s->next, memory_order_acquire)) return 0;
+    if(pthread_mutex_trylock(&hash->resize)) return 0;
+
+    s = atomic_load_explicit(&hash->slots, memory_order_acquire);
+    hashslots_t *next = atomic_load_explicit(&s->next, memory_order_acquire);
+    size_t b = atomic_load_explicit(&s->moved, memory_order_relaxed);
+    int moved = 0;
+
+    for(; next && moved < n && b <= s->mask; moved ++, b ++) {
+        hashstripe_t *stripe = _stripe(b);
+        spin_lock(&stripe->lock);
+
+        hashnode_t *head = atomic_load_explicit(&s->nodes[b], memory_order_acquire);
+        hashnode_t *node = head;
+        for(; node; node = atomic_load_explicit(&node->next, memory_order_relaxed)) {
+            kv_key_t *kcopy = NULL;
+            kv_value_t *vcopy = NULL;
+            hashnode_t *copy = (hashnode_t *)kv_entry_copy(sizeof(hashnode_t), node->key,
+                atomic_load_explicit(&node->value, memory_order_relaxed), &kcopy, &vcopy);
+            if(!copy) break;
+
+            _Atomic(hashnode_t *) *slot = &next->nodes[node->hash & next->mask];
+            copy->key = kcopy;
+            copy->hash = node->hash;
+            atomic_init(&copy->value, vcopy);
+            atomic_init(&copy->next, atomic_load_explicit(slot, memory_order_relaxed));
+            atomic_store_explicit(slot, copy, memory_order_relaxed);
+        }
+
+        if(node) {
+            // out of memory, the copies were never reachable, retry later
+            size_t i = 0;
+            for(i = b; i <= next->mask; i += s->mask + 1) {
+                hashnode_t *copy = atomic_load_explicit(&next->nodes[i], memory_order_relaxed);
+                while(copy) {
+                    hashnode_t *tmp = atomic_load_explicit(&copy->next, memory_order_relaxed);
+                    _release_node(copy);
+                    copy = tmp;
+                }
+                atomic_store_explicit(&next->nodes[i], NULL, memory_order_relaxed);
+            }
+            spin_unlock(&stripe->lock);
+            break;
+        }
+
+        atomic_store_explicit(&s->moved, b + 1, memory_order_release);
+        spin_unlock(&stripe->lock);
+
+        // the old chain is frozen now
+        while(head) {
+            hashnode_t *tmp = atomic_load_explicit(&head->next, memory_order_relaxed);
+            epoch_retire(_release_node, head);
+            head = tmp;
+        }
+    }
+
+    if(next && b > s->mask) {
+        atomic_store_explicit(&hash->slots, next, memory_order_release);
+        epoch_retire(myfree, s);
+    }
+    pthread_mutex_unlock(&hash->resize);
+    return moved;
+}
+
+// past a load factor of 1 start doubling, a failed allocation is retried later
+static void _maybe_grow(void) {
+    hashslots_t *s = atomic_load_explicit(&hash->slots, memory_order_acquire);
+    if(atomic_load_explicit(&s->next, memory_order_relaxed)) return;
+    if(atomic_load_explicit(&hash->count, memory_order_relaxed) <= s->mask + 1) return;
+    if(pthread_mutex_trylock(&hash->resize)) return;
+
+    s = atomic_load_explicit(&hash->slots, memory_order_acquire);
+    if(!atomic_load_explicit(&s->next, memory_order_relaxed) &&
+        atomic_load_explicit(&hash->count, memory_order_relaxed) > s->mask + 1) {
+        hashslots_t *next = _alloc_slots((s->mask + 1) << 1);
+        if(next) atomic_store_explicit(&s->next, next, memory_order_release);
     }
+    pthread_mutex_unlock(&hash->resize);
+}
 
-    strcpy(kcopy, key);
-    strcpy(vcopy, value);
+static hashnode_t *_create_node(const char *key, size_t klen, const char *value, size_t vlen) {
+    kv_key_t *kcopy = NULL;
+    kv_value_t *vcopy = NULL;
+    hashnode_t *node = (hashnode_t *)kv_entry_create(sizeof(hashnode_t), key, klen,
+        value, vlen, &kcopy, &vcopy);
+    if(!node) {
+        fprintf(stderr, "node malloc failed\n");
+        return NULL;
+    }
 
 	node->key = kcopy;
-	node->value = vcopy;
+	atomic_init(&node->value, vcopy);
 
     return node;
 }
@@ -71,14 +229,24 @@ int kv_hash_init(void) {
     hash = (hashtable_t *)mymalloc(sizeof(hashtable_t));
     if(!hash) return -1;
 
-    hash->nodes = (hashnode_t **)mymalloc(sizeof(hashnode_t*) * MAX_TABLE_SIZE);
+    hashslots_t *slots = _alloc_slots(HASH_INIT_SLOTS);
 
-    if (!hash->nodes) return -1;
+    if (!slots) return -1;
 
-    hash->max_slots = MAX_TABLE_SIZE;
-    hash->count = 0;
+    atomic_init(&hash->slots, slots);
+    atomic_init(&hash->count, 0);
+    atomic_init(&hash->bytes, 0);
 
-    pthread_mutex_init(&hash->lock, NULL);
+    // a per table seed keeps crafted keys from piling into one chain
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    hash->seed = kv_hash64((const char *)&ts, sizeof(ts), (uintptr_t)hash);
+
+    pthread_mutex_init(&hash->resize, NULL);
+    int i = 0;
+    for(i = 0; i < HASH_STRIPES; i ++) {
+        atomic_init(&hash->stripes[i].lock.status, UNLOCKED);
+    }
 
     return 0;
 }
@@ -87,155 +255,487 @@ int kv_hash_init(void) {
 void kv_hash_destroy(void) {
     if(!hash) return;
 
-    pthread_mutex_lock(&hash->lock);
-    int i = 0;
-    for (i = 0; i < hash->max_slots; i ++) {
-        hashnode_t *node = hash->nodes[i];
+    // finish a resize so every pair is in one array
+    epoch_enter();
+    while(_rehash(HASH_REHASH_TICK) > 0);
+    epoch_exit();
+
+    hashslots_t *s = atomic_load(&hash->slots);
+    size_t i = 0;
+    for (i = 0; i <= s->mask; i ++) {
+        hashnode_t *node = atomic_load(&s->nodes[i]);
         while(node) {
             hashnode_t *prev = node;
-            node = node->next;
-            myfree(prev->key);
-            myfree(prev->value);
-            myfree(prev);
+            node = atomic_load(&node->next);
+            _free_node(prev);
         }
     }
-    myfree(hash->nodes);
-    pthread_mutex_unlock(&hash->lock);
-    pthread_mutex_destroy(&hash->lock);
+    myfree(s);
+    pthread_mutex_destroy(&hash->resize);
 
     myfree(hash);
 }
 
-int kv_hash_set(const char* key, const char *value) {
+/*
+ * there is no table lock any more: kv_hash_lock enters an epoch section
+ * for a batch of ops, set/get/delete/modify also enter one themselves.
+ */
+void kv_hash_lock(void) {
+    epoch_enter();
+}
+
+void kv_hash_unlock(void) {
+    epoch_exit();
+}
+
+int kv_hash_set(const char* key, size_t klen, const char *value, size_t vlen) {
     if(!hash || !key || !value) return -1;
 
-    int idx = _hash(key, MAX_TABLE_SIZE);
+    uint64_t h = kv_hash64(key, klen, hash->seed);
+    epoch_enter();
 
-    pthread_mutex_lock(&hash->lock);
-    hashnode_t *node = hash->nodes[idx];
-    while(node) {
-        if(strcmp(node->key, key) == 0) {
-            pthread_mutex_unlock(&hash->lock);
-            return 0;
-        }
-        node = node->next;
+    if(_find(key, klen, h, NULL)) {
+        epoch_exit();
+        return 0;
     }
 
-    hashnode_t *new_node =_create_node(key, value);
+    hashnode_t *new_node =_create_node(key, klen, value, vlen);
+    if(!new_node) {
+        epoch_exit();
+        return -1;
+    }
+    new_node->hash = h;
+
+    hashstripe_t *stripe = _stripe(h);
+    spin_lock(&stripe->lock);
+
+    // another writer may have won the race for the key
+    if(_find(key, klen, h, NULL)) {
+        spin_unlock(&stripe->lock);
+        _free_node(new_node);
+        epoch_exit();
+        return 0;
+    }
 
-    new_node->next = hash->nodes[idx];
-    hash->nodes[idx] = new_node;
+    _Atomic(hashnode_t *) *slot = _bucket(h);
+    atomic_init(&new_node->next, atomic_load_explicit(slot, memory_order_relaxed));
+    atomic_store_explicit(slot, new_node, memory_order_release);
+    spin_unlock(&stripe->lock);
 
-    hash->count ++;
+    atomic_fetch_add_explicit(&hash->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&hash->bytes, klen + vlen, memory_order_relaxed);
 
-    pthread_mutex_unlock(&hash->lock);
+    _maybe_grow();
+    _rehash(HASH_REHASH_STEP);
 
+    epoch_exit();
     return 0;
 }
 
-char* kv_hash_get(const char* key) {
+// the caller owns a reference to the returned value
+kv_value_t* kv_hash_get(const char* key, size_t klen) {
     if(!hash || !key) return NULL;
 
-    pthread_mutex_lock(&hash->lock);
-    int idx = _hash(key, MAX_TABLE_SIZE);
-    hashnode_t *node = hash->nodes[idx];
-
-    while(node) {
-        if(strcmp(node->key, key) == 0) {
-            pthread_mutex_unlock(&hash->lock);
-            return node->value;
-        }
-        node = node->next;
+    kv_value_t *value = NULL;
+    epoch_enter();
+    hashnode_t *node = _find(key, klen, kv_hash64(key, klen, hash->seed), NULL);
+    if(node) {
+        value = kv_value_get(atomic_load_explicit(&node->value, memory_order_acquire));
     }
-    pthread_mutex_unlock(&hash->lock);
+    epoch_exit();
 
-    return NULL;
+    return value;
 }
 
-int kv_hash_delete(char *key) {
-    if(!hash || !key) return -1;
+/*
+ * group lookup. HASH_GROUP keys are in flight at once and each one is
+ * advanced a step per round: find the bucket, load the node, load its key,
+ * compare. every step prefetches what the next one of the same key reads,
+ * so the cache misses of different keys overlap instead of queueing.
+ */
+#define HASH_GROUP 8
+
+enum {
+    HASH_STEP_BUCKET,
+    HASH_STEP_NODE,
+    HASH_STEP_KEY,
+};
+
+typedef struct hash_lookup_s {
+    int idx;            // key in the batch, -1 for an idle slot
+    int step;
+    uint64_t prefix;
+    uint64_t hash;
+    _Atomic(hashnode_t *) *bucket;
+    hashnode_t *node;
+} hash_lookup_t;
+
+void kv_hash_mget(const char **keys, const size_t *klens, kv_value_t **values, int n) {
+    hash_lookup_t group[HASH_GROUP];
+    int next = 0, active = 0;
+    int i = 0;
 
-    pthread_mutex_lock(&hash->lock);
-    int idx = _hash(key, MAX_TABLE_SIZE);
-    hashnode_t *node = hash->nodes[idx];
-    hashnode_t *prev = node;
-    while(node) {
-        if(strcmp(node->key, key) == 0) {
-            myfree(node->key);
-            myfree(node->value);
+    for(i = 0; i < HASH_GROUP; i ++) {
+        group[i].idx = -1;
+    }
 
-            // not the first
-            if(node != hash->nodes[idx]) {
-                prev->next = node->next;
-            } else {
-                hash->nodes[idx] = node->next;
-            }      
+    if(hash) epoch_enter();
+    while(next < n || active > 0) {
+        for(i = 0; i < HASH_GROUP; i ++) {
+            hash_lookup_t *l = &group[i];
+
+            if(l->idx < 0) {
+                if(next == n) continue;
+                l->idx = next ++;
+                values[l->idx] = NULL;
+                if(!hash || !keys[l->idx]) {
+                    l->idx = -1;
+                    continue;
+                }
+                l->prefix = kv_key_prefix(keys[l->idx], klens[l->idx]);
+                l->hash = kv_hash64(keys[l->idx], klens[l->idx], hash->seed);
+                l->bucket = _bucket(l->hash);
+                l->step = HASH_STEP_BUCKET;
+                __builtin_prefetch(l->bucket);
+                active ++;
+                continue;
+            }
 
-            myfree(node);  
+            switch(l->step) {
+            case HASH_STEP_BUCKET:
+                l->node = atomic_load_explicit(l->bucket, memory_order_acquire);
+                break;
+            case HASH_STEP_NODE:
+                // the stored hash settles most nodes without touching their key
+                if(l->node->hash == l->hash) {
+                    __builtin_prefetch(l->node->key);
+                    l->step = HASH_STEP_KEY;
+                    continue;
+                }
+                l->node = atomic_load_explicit(&l->node->next, memory_order_acquire);
+                break;
+            case HASH_STEP_KEY:
+                if(kv_key_equal(keys[l->idx], klens[l->idx], l->prefix, l->node->key)) {
+                    values[l->idx] = kv_value_get(atomic_load_explicit(&l->node->value, memory_order_acquire));
+                    l->node = NULL;
+                } else {
+                    l->node = atomic_load_explicit(&l->node->next, memory_order_acquire);
+                }
+                break;
+            }
 
-            pthread_mutex_unlock(&hash->lock);
-            return 0;
+            if(!l->node) {
+                l->idx = -1;
+                active --;
+                continue;
+            }
+            __builtin_prefetch(l->node);
+            l->step = HASH_STEP_NODE;
         }
-        prev = node;
-        node = node->next;
     }
-    pthread_mutex_unlock(&hash->lock);
+    if(hash) epoch_exit();
+}
+
+int kv_hash_delete(const char *key, size_t klen) {
+    if(!hash || !key) return -1;
+
+    uint64_t h = kv_hash64(key, klen, hash->seed);
+    hashstripe_t *stripe = _stripe(h);
+    epoch_enter();
+    spin_lock(&stripe->lock);
+
+    _Atomic(hashnode_t *) *link = NULL;
+    hashnode_t *node = _find(key, klen, h, &link);
+    if(!node) {
+        spin_unlock(&stripe->lock);
+        epoch_exit();
+        return -1;
+    }
 
-    return -1;
+    // readers on the node still find the rest of the chain behind it
+    atomic_store_explicit(link, atomic_load_explicit(&node->next, memory_order_relaxed),
+        memory_order_release);
+    spin_unlock(&stripe->lock);
+
+    atomic_fetch_sub_explicit(&hash->count, 1, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&hash->bytes,
+        node->key->len + atomic_load_explicit(&node->value, memory_order_relaxed)->len,
+        memory_order_relaxed);
+    epoch_retire(_free_node, node);
+
+    _rehash(HASH_REHASH_STEP);
+
+    epoch_exit();
+    return 0;
 }
 
-int kv_hash_modify(char *key, char* value) {
+int kv_hash_modify(const char *key, size_t klen, const char* value, size_t vlen) {
 	if(!hash || !key || !value) return -1;
 
-    int idx = _hash(key, MAX_TABLE_SIZE);
-    hashnode_t *node = hash->nodes[idx];
-    while(node) {
-        if(strcmp(node->key, key) == 0) {
+    kv_value_t* vcopy = kv_value_create(value, vlen);
+    if(!vcopy) {
+        fprintf(stderr, "vcopy malloc failed\n");
+        return -1;
+    }
 
-            char* vcopy = (char *)mymalloc(strlen(value) + 1);
-            if(!vcopy) {
-                fprintf(stderr, "vcopy malloc failed\n");
-                return -1;
-            }
-            strcpy(vcopy, value);
+    uint64_t h = kv_hash64(key, klen, hash->seed);
+    hashstripe_t *stripe = _stripe(h);
+    epoch_enter();
+    spin_lock(&stripe->lock);
+
+    hashnode_t *node = _find(key, klen, h, NULL);
+    if(!node) {
+        spin_unlock(&stripe->lock);
+        epoch_exit();
+        kv_value_put(vcopy);
+        return -1;
+    }
+
+    kv_value_t *old = atomic_exchange_explicit(&node->value, vcopy, memory_order_acq_rel);
+    spin_unlock(&stripe->lock);
+
+    atomic_fetch_add_explicit(&hash->bytes, vlen - old->len, memory_order_relaxed);
+    // an inline value goes with its node
+    if(!kv_entry_inline(node->key, old)) epoch_retire(_put_value, old);
+
+    _rehash(HASH_REHASH_STEP);
+
+    epoch_exit();
+    return 0;
+}
 
-            pthread_mutex_lock(&hash->lock);
-            myfree(node->value);
-            node->value = vcopy;
-            pthread_mutex_unlock(&hash->lock);
+// finish a resize and free what readers have let go of, run by the reactor poller
+int kv_hash_tick(void) {
+    if(!hash) return 0;
 
-            return 0;
+    epoch_enter();
+    int moved = _rehash(HASH_REHASH_TICK);
+    epoch_exit();
+
+    return moved + (int)epoch_reclaim();
+}
+
+/*
+ * visit every pair in bucket order until fn returns non zero. lock free
+ * like a lookup, pairs written meanwhile may or may not be seen.
+ */
+int kv_hash_scan(kvs_scan_fn fn, void *arg) {
+    if(!hash || !fn) return -1;
+
+    int ret = 0;
+    epoch_enter();
+    hashslots_t *s = atomic_load_explicit(&hash->slots, memory_order_acquire);
+    while(s && !ret) {
+        hashslots_t *next = atomic_load_explicit(&s->next, memory_order_acquire);
+        size_t i = next ? atomic_load_explicit(&s->moved, memory_order_acquire) : 0;
+        for(; i <= s->mask && !ret; i ++) {
+            hashnode_t *node = atomic_load_explicit(&s->nodes[i], memory_order_acquire);
+            while(node && !ret) {
+                ret = fn(node->key, atomic_load_explicit(&node->value, memory_order_acquire), arg);
+                node = atomic_load_explicit(&node->next, memory_order_acquire);
+            }
         }
-        node = node->next;
+        s = next;
     }
-    return -1;
+    epoch_exit();
+    return ret;
 }
 
+void kv_hash_stats(kvs_engine_stats_t *stats) {
+    if(!hash) return;
+    stats->count = atomic_load_explicit(&hash->count, memory_order_relaxed);
+    stats->bytes = atomic_load_explicit(&hash->bytes, memory_order_relaxed);
+}
+
+const kvs_engine_t kv_hash_engine = {
+    .name = "hash",
+    .init = kv_hash_init,
+    .destroy = kv_hash_destroy,
+    .lock = kv_hash_lock,
+    .unlock = kv_hash_unlock,
+    .set = kv_hash_set,
+    .get = kv_hash_get,
+    .mget = kv_hash_mget,
+    .del = kv_hash_delete,
+    .mod = kv_hash_modify,
+    .scan = kv_hash_scan,
+    .tick = kv_hash_tick,
+    .stats = kv_hash_stats,
+};
+
 
 #ifdef KV_HASH_DEBUG
+static int print_pair(const kv_key_t *key, kv_value_t *value, void *arg) {
+    printf("%s => %s\n", key->data, value->data);
+    return 0;
+}
+
+/*
+ * readers and writers share one table. the writers each set, modify and
+ * delete keys of their own, enough of them to double the table while the
+ * readers look up stable keys that must never go missing or change.
+ */
+#define HT_READERS      4
+#define HT_WRITERS      2
+#define HT_STABLE       1000
+#define HT_KEYS         6000
+
+static hashtable_t *shared;
+static atomic_int stop;
+
+static void *reader(void *arg) {
+    long wrong = 0;
+    char key[32];
+    int i = 0;
+
+    hash = shared;
+    while(!atomic_load(&stop)) {
+        for(i = 0; i < HT_STABLE; i ++) {
+            int len = snprintf(key, sizeof(key), "stable%d", i);
+            kv_value_t *value = kv_hash_get(key, len);
+            if(!value || strcmp(value->data, key)) wrong ++;
+            if(value) kv_value_put(value);
+        }
+        // the group lookup walks the same chains
+        const char *keys[] = {"stable0", "stable1", "stable999"};
+        size_t klens[] = {7, 7, 9};
+        kv_value_t *values[3];
+        kv_hash_mget(keys, klens, values, 3);
+        for(i = 0; i < 3; i ++) {
+            if(!values[i] || strcmp(values[i]->data, keys[i])) wrong ++;
+            if(values[i]) kv_value_put(values[i]);
+        }
+    }
+    return (void *)wrong;
+}
+
+static void *writer(void *arg) {
+    long id = (long)arg, wrong = 0;
+    char key[32];
+    int i = 0, round = 0;
+
+    hash = shared;
+    for(round = 0; round < 4; round ++) {
+        for(i = 0; i < HT_KEYS; i ++) {
+            int len = snprintf(key, sizeof(key), "w%ld_%d", id, i);
+            if(kv_hash_set(key, len, key, len)) wrong ++;
+        }
+        for(i = id; i < HT_STABLE; i += HT_WRITERS) {
+            int len = snprintf(key, sizeof(key), "stable%d", i);
+            if(kv_hash_modify(key, len, key, len)) wrong ++;
+        }
+        for(i = 0; i < HT_KEYS; i ++) {
+            int len = snprintf(key, sizeof(key), "w%ld_%d", id, i);
+            kv_value_t *value = kv_hash_get(key, len);
+            if(!value || strcmp(value->data, key)) wrong ++;
+            if(value) kv_value_put(value);
+            if(kv_hash_delete(key, len)) wrong ++;
+        }
+        kv_hash_tick();
+    }
+    return (void *)wrong;
+}
+
 int main() {
     
     kv_hash_init();
 
-    kv_hash_set("city", "sz");
-    kv_hash_set("server", "nginx");
-    kv_hash_set("request url", "https://jjc.com");
-    kv_hash_set("status code", "200");
-    kv_hash_set("request method", "GET");
+    kv_hash_set(KV_STR("city"), KV_STR("sz"));
+    kv_hash_set(KV_STR("server"), KV_STR("nginx"));
+    kv_hash_set(KV_STR("request url"), KV_STR("https://jjc.com"));
+    kv_hash_set(KV_STR("status code"), KV_STR("200"));
+    kv_hash_set(KV_STR("request method"), KV_STR("GET"));
+
+    kv_value_t *result = kv_hash_get(KV_STR("city"));
+    printf("result fot city %s\n", result->data);
+
+    kv_value_t *server = kv_hash_get(KV_STR("server"));
+    printf("result fot server %s\n", server->data);
+    kv_value_put(server);
+
+    // the old value stays readable while a reference is held
+    kv_hash_modify(KV_STR("city"), KV_STR("shenzhen"));
+    printf("old result fot city %s\n", result->data);
+    kv_value_put(result);
+
+    result = kv_hash_get(KV_STR("city"));
+    printf("result fot city %s\n", result->data);
+    kv_value_put(result);
+
+    // keys and values may hold any byte
+    kv_hash_set(KV_STR("bin\0key"), KV_STR("a\0b"));
+    result = kv_hash_get(KV_STR("bin\0key"));
+    printf("result fot bin key %u bytes\n", result->len);
+    kv_value_put(result);
+
+    // looked up as one group
+    const char *keys[] = {"server", "nokey", "status code"};
+    size_t klens[] = {6, 5, 11};
+    kv_value_t *values[3];
+    kv_hash_mget(keys, klens, values, 3);
+    for(int i = 0; i < 3; i ++) {
+        printf("mget %s: %s\n", keys[i], values[i] ? values[i]->data : NULL);
+        if(values[i]) kv_value_put(values[i]);
+    }
+
+    kv_hash_delete(KV_STR("city"));
+    result = kv_hash_get(KV_STR("city"));
+    printf("result fot city %s\n", result ? result->data : NULL);
 
-    char *result = kv_hash_get("city");
-    printf("result fot city %s\n", result);
+    kvs_engine_stats_t stats = {0};
+    kv_hash_engine.scan(print_pair, NULL);
 
-    char *server = kv_hash_get("server");
-    printf("result fot server %s\n", server);
+    // enough keys to double the table a few times, then finish the resize
+    char key[32];
+    int i = 0, missing = 0;
+    for(i = 0; i < 5000; i ++) {
+        int len = snprintf(key, sizeof(key), "grow%d", i);
+        kv_hash_set(key, len, key, len);
+    }
+    for(i = 0; i < 5000; i ++) {
+        int len = snprintf(key, sizeof(key), "grow%d", i);
+        kv_value_t *value = kv_hash_get(key, len);
+        if(!value) missing ++;
+        else kv_value_put(value);
+    }
+    while(kv_hash_tick() > 0);
+    printf("%zu slots, %d missing\n", atomic_load(&hash->slots)->mask + 1, missing);
+    for(i = 0; i < 5000; i ++) {
+        int len = snprintf(key, sizeof(key), "grow%d", i);
+        kv_hash_delete(key, len);
+    }
 
-    kv_hash_modify("city", "shenzhen");
-    result = kv_hash_get("city");
-    printf("result fot city %s\n", result);
+    kv_hash_engine.stats(&stats);
+    printf("%zu pairs, %zu bytes\n", stats.count, stats.bytes);
 
-    kv_hash_delete("city");
-    result = kv_hash_get("city");
-    printf("result fot city %s\n", result);
+    // lock free gets against writers on other stripes, across a resize
+    for(i = 0; i < HT_STABLE; i ++) {
+        int len = snprintf(key, sizeof(key), "stable%d", i);
+        kv_hash_set(key, len, key, len);
+    }
+    size_t before = atomic_load(&hash->slots)->mask + 1, pairs = stats.count + HT_STABLE;
+    shared = hash;
+    pthread_t readers[HT_READERS], writers[HT_WRITERS];
+    long r = 0, wrong = 0, lost = 0;
+    for(r = 0; r < HT_READERS; r ++) pthread_create(&readers[r], NULL, reader, NULL);
+    for(r = 0; r < HT_WRITERS; r ++) pthread_create(&writers[r], NULL, writer, (void *)r);
+    for(r = 0; r < HT_WRITERS; r ++) {
+        void *ret = NULL;
+        pthread_join(writers[r], &ret);
+        wrong += (long)ret;
+    }
+    atomic_store(&stop, 1);
+    for(r = 0; r < HT_READERS; r ++) {
+        void *ret = NULL;
+        pthread_join(readers[r], &ret);
+        lost += (long)ret;
+    }
+    while(kv_hash_tick() > 0);
+    kv_hash_engine.stats(&stats);
+    printf("concurrent: %zu -> %zu slots, %ld wrong, %ld lost reads, %zu pairs\n",
+        before, atomic_load(&hash->slots)->mask + 1, wrong, lost, stats.count);
+    printf("concurrent %s\n", !wrong && !lost && stats.count == pairs &&
+        atomic_load(&hash->slots)->mask + 1 > before ? "passed" : "FAILED");
 
     kv_hash_destroy();
 
@@ -2,9 +2,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <stdatomic.h>
 
 #include "../kvstore.h"
 #include "../mm/mymalloc.h"
+#include "../mm/epoch.h"
 
 #define RED				1
 #define BLACK 			2
@@ -12,7 +14,7 @@
 #define KEYTYPE_ENABLE 1
 
 #if KEYTYPE_ENABLE
-typedef char* KEY_TYPE;
+typedef kv_key_t* KEY_TYPE;
 #else
 typedef int KEY_TYPE;
 #endif
@@ -23,8 +25,8 @@ typedef struct _rbtree_node {
 	struct _rbtree_node *left;
 	struct _rbtree_node *parent;
 #if KEYTYPE_ENABLE
-	char* key;
-	char* value;
+	kv_key_t* key;
+	kv_value_t* value;
 #else
 	KEY_TYPE key;
 	void *value;
@@ -36,11 +38,15 @@ typedef struct _rbtree_node rbtree_node_t;
 typedef struct _rbtree {
 	rbtree_node *root;
 	rbtree_node *nil;
-	pthread_mutex_t lock;
+	int count;
+	size_t bytes;
+	pthread_mutex_t lock;		// writers, scans and ranges
+	_Atomic uint64_t seq;		// odd while a writer reshapes the tree
 } rbtree;
 
 typedef struct _rbtree rbtree_t;
-rbtree_t *tree = NULL;
+// one instance per reactor thread
+__thread rbtree_t *tree = NULL;
 
 static rbtree_node *rbtree_mini(rbtree *T, rbtree_node *x) {
 	while (x->left != T->nil) {
@@ -70,6 +76,20 @@ static rbtree_node *rbtree_successor(rbtree *T, rbtree_node *x) {
 	return y;
 }
 
+static rbtree_node *rbtree_predecessor(rbtree *T, rbtree_node *x) {
+	rbtree_node *y = x->parent;
+
+	if (x->left != T->nil) {
+		return rbtree_maxi(T, x->left);
+	}
+
+	while ((y != T->nil) && (x == y->left)) {
+		x = y;
+		y = y->parent;
+	}
+	return y;
+}
+
 
 static void rbtree_left_rotate(rbtree *T, rbtree_node *x) {
 
@@ -164,21 +184,26 @@ static void rbtree_insert_fixup(rbtree *T, rbtree_node *z) {
 }
 
 
-static void rbtree_insert(rbtree *T, rbtree_node *z) {
+// returns -1 and leaves the tree alone if the key exists
+static int rbtree_insert(rbtree *T, rbtree_node *z) {
 
 	rbtree_node *y = T->nil;
 	rbtree_node *x = T->root;
 
-	// strcmp(s1, s2) -1 <, 0 =, 1 >
+	// kv_key_compare(z, x) <0 <, 0 =, >0 >
+#if KEYTYPE_ENABLE
+	int ret = 0;
+#endif
 	while (x != T->nil) {
 		y = x;
 #if KEYTYPE_ENABLE
-		if(strcmp(z->key, x->key) < 0) {
+		ret = kv_key_compare(z->key->data, z->key->len, z->key->prefix, x->key);
+		if(ret < 0) {
 			x = x->left;
-		} else if(strcmp(z->key, x->key) > 0) {
+		} else if(ret > 0) {
 			x = x->right;
 		} else {
-			return;
+			return -1;
 		}
 
 #else
@@ -187,7 +212,7 @@ static void rbtree_insert(rbtree *T, rbtree_node *z) {
 		} else if (z->key > x->key) {
 			x = x->right;
 		} else { //Exist
-			return ;
+			return -1;
 		}
 #endif
 	}
@@ -196,7 +221,7 @@ static void rbtree_insert(rbtree *T, rbtree_node *z) {
 #if KEYTYPE_ENABLE
 	if (y == T->nil) {
 		T->root = z;
-	} else if (strcmp(z->key, y->key) < 0) {
+	} else if (ret < 0) {
 		y->left = z;
 	} else {
 		y->right = z;
@@ -215,6 +240,7 @@ static void rbtree_insert(rbtree *T, rbtree_node *z) {
 	z->color = RED;
 
 	rbtree_insert_fixup(T, z);
+	return 0;
 }
 
 static void rbtree_delete_fixup(rbtree *T, rbtree_node *x) {
@@ -287,6 +313,7 @@ static void rbtree_delete_fixup(rbtree *T, rbtree_node *x) {
 	x->color = BLACK;
 }
 
+// unlinks z and returns it, its key and value live in its own allocation
 static rbtree_node *rbtree_delete(rbtree *T, rbtree_node *z) {
 
 	rbtree_node *y = T->nil;
@@ -313,29 +340,98 @@ static rbtree_node *rbtree_delete(rbtree *T, rbtree_node *z) {
 		y->parent->right = x;
 	}
 
+	unsigned char color = y->color;
 	if (y != z) {
-#if KEYTYPE_ENABLE
-	strcpy(z->key, y->key);
-	strcpy(z->value, y->value);
-#else
-		z->key = y->key;
-		z->value = y->value;
-#endif
+		// the successor takes z's place rather than its key and value
+		if (x->parent == z) x->parent = y;
+		y->parent = z->parent;
+		y->left = z->left;
+		y->right = z->right;
+		y->color = z->color;
+
+		if (z->parent == T->nil) {
+			T->root = y;
+		} else if (z == z->parent->left) {
+			z->parent->left = y;
+		} else {
+			z->parent->right = y;
+		}
+		if (y->left != T->nil) y->left->parent = y;
+		if (y->right != T->nil) y->right->parent = y;
 	}
 
-	if (y->color == BLACK) {
+	if (color == BLACK) {
 		rbtree_delete_fixup(T, x);
 	}
 
-	return y;
+	return z;
 }
 
-static rbtree_node *rbtree_search(rbtree *T, KEY_TYPE key) {
+#if KEYTYPE_ENABLE
+/*
+ * readers take no lock. a writer makes seq odd while it links, unlinks or
+ * rotates nodes, a reader notes seq before its descent and retries if it
+ * was odd or has moved by the end. a descent that overlaps a rotation may
+ * take a wrong turn or a cycle, never a freed node: removed nodes and
+ * replaced values are retired to the epoch and readers are in a section.
+ * modify swaps one value pointer and leaves seq alone.
+ */
+#define RBTREE_MAX_DEPTH	128	// beyond any valid tree, a longer walk is a torn one
+#define RBTREE_RETRIES		8	// optimistic attempts before waiting on the writers
+
+#define RB_READ(field)		__atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+static inline uint64_t rbtree_read_begin(rbtree *T) {
+	uint64_t seq;
+	do {
+		seq = atomic_load_explicit(&T->seq, memory_order_acquire);
+	} while (seq & 1);
+	return seq;
+}
+
+static inline int rbtree_read_retry(rbtree *T, uint64_t seq) {
+	atomic_thread_fence(memory_order_acquire);
+	return atomic_load_explicit(&T->seq, memory_order_relaxed) != seq;
+}
 
+static inline void rbtree_write_begin(rbtree *T) {
+	atomic_store_explicit(&T->seq, atomic_load_explicit(&T->seq, memory_order_relaxed) + 1,
+		memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+}
+
+static inline void rbtree_write_end(rbtree *T) {
+	atomic_store_explicit(&T->seq, atomic_load_explicit(&T->seq, memory_order_relaxed) + 1,
+		memory_order_release);
+}
+
+// the value stored under key, unreferenced, in *value. -1 for a torn walk
+static int rbtree_search_optimistic(rbtree *T, const char *key, size_t len, uint64_t prefix,
+	kv_value_t **value) {
+
+	rbtree_node *node = RB_READ(T->root);
+	int depth = 0;
+
+	*value = NULL;
+	while (node != T->nil) {
+		if (++ depth > RBTREE_MAX_DEPTH) return -1;
+
+		int ret = kv_key_compare(key, len, prefix, RB_READ(node->key));
+		if (ret == 0) {
+			*value = RB_READ(node->value);
+			return 0;
+		}
+		node = ret < 0 ? RB_READ(node->left) : RB_READ(node->right);
+	}
+	return 0;
+}
+
+static rbtree_node *rbtree_search(rbtree *T, const char *key, size_t len) {
+
+	uint64_t prefix = kv_key_prefix(key, len);
 	rbtree_node *node = T->root;
 	while (node != T->nil) {
-#if KEYTYPE_ENABLE
-		int ret = strcmp(key, node->key);
+		int ret = kv_key_compare(key, len, prefix, node->key);
 		if (ret < 0) {
 			node = node->left;
 		} else if (ret > 0) {
@@ -343,7 +439,14 @@ static rbtree_node *rbtree_search(rbtree *T, KEY_TYPE key) {
 		} else {
 			return node;
 		}	
+	}
+	return T->nil;
+}
 #else
+static rbtree_node *rbtree_search(rbtree *T, KEY_TYPE key) {
+
+	rbtree_node *node = T->root;
+	while (node != T->nil) {
 		if (key < node->key) {
 			node = node->left;
 		} else if (key > node->key) {
@@ -351,23 +454,11 @@ static rbtree_node *rbtree_search(rbtree *T, KEY_TYPE key) {
 		} else {
 			return node;
 		}	
-#endif
 	}
 	return T->nil;
 }
-
-
-static void rbtree_traversal(rbtree *T, rbtree_node *node) {
-	if (node != T->nil) {
-		rbtree_traversal(T, node->left);
-#if KEYTYPE_ENABLE
-		printf("key:%s, color:%d\n", node->key, node->color);
-#else
-		printf("key:%d, color:%d\n", node->key, node->color);
 #endif
-		rbtree_traversal(T, node->right);
-	}
-}
+
 
 int kv_rbtree_init(void) {
 	tree = (rbtree *)mymalloc(sizeof(rbtree));
@@ -381,6 +472,9 @@ int kv_rbtree_init(void) {
 	tree->nil->left = tree->nil;
 	tree->nil->right = tree->nil;
 	tree->root = tree->nil;
+	tree->count = 0;
+	tree->bytes = 0;
+	atomic_init(&tree->seq, 0);
 
 	pthread_mutex_init(&tree->lock, NULL);
 	return 0;
@@ -398,121 +492,515 @@ void kv_rbtree_destroy(void) {
 		node = rbtree_delete(tree, node);
 		pthread_mutex_unlock(&tree->lock);
 		
-		myfree(node);
+		kv_entry_free(node->key, node->value);
 	}
 
 	myfree(tree->nil);
 }
 
-int kv_rbtree_set(const char* key, const char *value) {
-	if(!tree || !key || !value) return -1;
+static void rbtree_node_retire(void *ptr) {
+	rbtree_node *node = ptr;
+	kv_entry_free(node->key, node->value);
+}
 
-	rbtree_node *node = (rbtree_node*)mymalloc(sizeof(rbtree_node));
-	if(!node) return -1;
+static void rbtree_value_retire(void *ptr) {
+	kv_value_put(ptr);
+}
 
-	char* kcopy = mymalloc(strlen(key) + 1);
-    if(!kcopy) {
-        fprintf(stderr, "kcopy malloc failed\n");
-        return -1;
-    }
+/*
+ * lock and unlock bracket a batch of ops with an epoch section. gets run
+ * without any lock, set/delete/modify take the writer lock themselves.
+ */
+void kv_rbtree_lock(void) {
+	epoch_enter();
+}
 
-    char* vcopy = mymalloc(strlen(value) + 1);
-    if(!vcopy) {
-        myfree(kcopy);
-        fprintf(stderr, "vcopy malloc failed\n");
-        return -1;
-    }
+void kv_rbtree_unlock(void) {
+	epoch_exit();
+}
 
-    strcpy(kcopy, key);
-    strcpy(vcopy, value);
+int kv_rbtree_set(const char* key, size_t klen, const char *value, size_t vlen) {
+	if(!tree || !key || !value) return -1;
 
+	// the key and a small value follow the node, see kv_entry_create()
+	kv_key_t *kcopy = NULL;
+	kv_value_t *vcopy = NULL;
+	rbtree_node *node = (rbtree_node*)kv_entry_create(sizeof(rbtree_node), key, klen,
+		value, vlen, &kcopy, &vcopy);
+	if(!node) {
+		fprintf(stderr, "node malloc failed\n");
+		return -1;
+	}
+
+	// a reader may reach the node as soon as it is linked
 	node->key = kcopy;
 	node->value = vcopy;
+	node->left = tree->nil;
+	node->right = tree->nil;
 
+	// an existing key is left as it is, readers only retry for real inserts
 	pthread_mutex_lock(&tree->lock);
-	rbtree_insert(tree, node);
+	int exists = rbtree_search(tree, key, klen) != tree->nil;
+	if(!exists) {
+		rbtree_write_begin(tree);
+		rbtree_insert(tree, node);
+		rbtree_write_end(tree);
+		tree->count ++;
+		tree->bytes += klen + vlen;
+	}
 	pthread_mutex_unlock(&tree->lock);
 
+	if(exists) {
+		kv_entry_free(kcopy, vcopy);
+	}
+
 	return 0;
 }
 
-char *kv_rbtree_get(char* key) {
+// the caller owns a reference to the returned value
+kv_value_t *kv_rbtree_get(const char* key, size_t klen) {
 	if(!tree || !key) return NULL;
 
-	rbtree_node *node = rbtree_search(tree, key);
-	if(node == tree->nil) return NULL;
+	uint64_t prefix = kv_key_prefix(key, klen);
+	kv_value_t *value = NULL;
+	int attempt = 0;
+
+	epoch_enter();
+	for(attempt = 0; attempt < RBTREE_RETRIES; attempt ++) {
+		uint64_t seq = rbtree_read_begin(tree);
+		if(rbtree_search_optimistic(tree, key, klen, prefix, &value) == 0
+			&& !rbtree_read_retry(tree, seq)) {
+			// retired values keep the tree's reference until the section ends
+			if(value) kv_value_get(value);
+			epoch_exit();
+			return value;
+		}
+	}
+
+	// the writers keep winning, queue behind them
+	pthread_mutex_lock(&tree->lock);
+	rbtree_node *node = rbtree_search(tree, key, klen);
+	value = node == tree->nil ? NULL : kv_value_get(node->value);
+	pthread_mutex_unlock(&tree->lock);
+	epoch_exit();
 
-	return node->value;
+	return value;
 }
 
-int kv_rbtree_delete(char *key) {
-	if(!tree || !key) return -1;
+/*
+ * group lookup. RBTREE_GROUP descents are in flight at once, each one is
+ * advanced a level per round and prefetches the node and then the key it
+ * compares next, so the misses of different keys overlap. the group is
+ * validated against seq as a whole, a writer in between sends every key
+ * through kv_rbtree_get.
+ */
+#define RBTREE_GROUP 8
+
+enum {
+	RBTREE_STEP_NODE,
+	RBTREE_STEP_KEY,
+};
+
+typedef struct rbtree_lookup_s {
+	int idx;			// key in the batch, -1 for an idle slot
+	int step;
+	int depth;
+	uint64_t prefix;
+	rbtree_node *node;
+} rbtree_lookup_t;
+
+void kv_rbtree_mget(const char **keys, const size_t *klens, kv_value_t **values, int n) {
+	rbtree_lookup_t group[RBTREE_GROUP];
+	int next = 0, active = 0, torn = 0;
+	int i = 0;
 
-	rbtree_node *node = rbtree_search(tree, key);
+	for (i = 0; i < RBTREE_GROUP; i ++) {
+		group[i].idx = -1;
+	}
+	if (!tree) {
+		for (i = 0; i < n; i ++) values[i] = NULL;
+		return;
+	}
+
+	epoch_enter();
+	uint64_t seq = rbtree_read_begin(tree);
+	rbtree_node *root = RB_READ(tree->root);
+
+	while (next < n || active > 0) {
+		for (i = 0; i < RBTREE_GROUP; i ++) {
+			rbtree_lookup_t *l = &group[i];
+
+			if (l->idx < 0) {
+				if (next == n) continue;
+				l->idx = next ++;
+				values[l->idx] = NULL;
+				if (!keys[l->idx] || root == tree->nil) {
+					l->idx = -1;
+					continue;
+				}
+				l->prefix = kv_key_prefix(keys[l->idx], klens[l->idx]);
+				l->node = root;
+				l->depth = 0;
+				l->step = RBTREE_STEP_NODE;
+				__builtin_prefetch(l->node);
+				active ++;
+				continue;
+			}
+
+			if (l->step == RBTREE_STEP_NODE) {
+				__builtin_prefetch(RB_READ(l->node->key));
+				l->step = RBTREE_STEP_KEY;
+				continue;
+			}
+
+			int ret = kv_key_compare(keys[l->idx], klens[l->idx], l->prefix, RB_READ(l->node->key));
+			if (ret == 0) {
+				values[l->idx] = RB_READ(l->node->value);
+			}
+			l->node = ret < 0 ? RB_READ(l->node->left) : RB_READ(l->node->right);
+			if (ret == 0 || l->node == tree->nil || ++ l->depth > RBTREE_MAX_DEPTH) {
+				torn |= l->depth > RBTREE_MAX_DEPTH;
+				l->idx = -1;
+				active --;
+				continue;
+			}
+			__builtin_prefetch(l->node);
+			l->step = RBTREE_STEP_NODE;
+		}
+	}
+
+	if (torn || rbtree_read_retry(tree, seq)) {
+		for (i = 0; i < n; i ++) {
+			values[i] = keys[i] ? kv_rbtree_get(keys[i], klens[i]) : NULL;
+		}
+	} else {
+		for (i = 0; i < n; i ++) {
+			if (values[i]) kv_value_get(values[i]);
+		}
+	}
+	epoch_exit();
+}
+
+int kv_rbtree_delete(const char *key, size_t klen) {
+	if(!tree || !key) return -1;
 
-	if(node == tree->nil) return -1;
-	
 	pthread_mutex_lock(&tree->lock);
-	node = rbtree_delete(tree, node);
+	rbtree_node *node = rbtree_search(tree, key, klen);
+
 	if(node == tree->nil) {
-		myfree(node->key);
-		myfree(node->value);
-		myfree(node);
+		pthread_mutex_unlock(&tree->lock);
+		return -1;
 	}
+
+	rbtree_write_begin(tree);
+	node = rbtree_delete(tree, node);
+	rbtree_write_end(tree);
+
+	tree->count --;
+	tree->bytes -= node->key->len + node->value->len;
 	pthread_mutex_unlock(&tree->lock);
-	
+
+	// a reader may still be on the node or hold its key
+	epoch_retire(rbtree_node_retire, node);
+
 	return 0;
 }
 
-int kv_rbtree_modify(char *key, char* value) {
+int kv_rbtree_modify(const char *key, size_t klen, const char* value, size_t vlen) {
 	if(!tree || !key || !value) return -1;
-	rbtree_node *node = rbtree_search(tree, key);
-	if(node == tree->nil) {
-		return -1;
-	}
 
-	char* vcopy = mymalloc(strlen(value) + 1);
+	kv_value_t* vcopy = kv_value_create(value, vlen);
     if(!vcopy) {
         fprintf(stderr, "vcopy malloc failed\n");
         return -1;
     }
-	strcpy(vcopy, value);
 
 	pthread_mutex_lock(&tree->lock);
-	myfree(node->value);
-	node->value = vcopy;
+	rbtree_node *node = rbtree_search(tree, key, klen);
+	if(node == tree->nil) {
+		pthread_mutex_unlock(&tree->lock);
+		kv_value_put(vcopy);
+		return -1;
+	}
+
+	kv_value_t *old = node->value;
+	tree->bytes += vlen - old->len;
+	__atomic_store_n(&node->value, vcopy, __ATOMIC_RELEASE);
+	int inline_value = kv_entry_inline(node->key, old);
 	pthread_mutex_unlock(&tree->lock);
 
+	// an inline value goes with its node
+	if(!inline_value) epoch_retire(rbtree_value_retire, old);
+
 	return 0;
 }
 
+int kv_rbtree_tick(void) {
+	if(!tree) return 0;
+	return (int)epoch_reclaim();
+}
+// visit every pair in key order until fn returns non zero, takes the lock
+int kv_rbtree_scan(kvs_scan_fn fn, void *arg) {
+	if(!tree || !fn) return -1;
+
+	int ret = 0;
+	pthread_mutex_lock(&tree->lock);
+	rbtree_node *node = tree->root == tree->nil ? tree->nil : rbtree_mini(tree, tree->root);
+	while(node != tree->nil && !ret) {
+		ret = fn(node->key, node->value, arg);
+		node = rbtree_successor(tree, node);
+	}
+	pthread_mutex_unlock(&tree->lock);
+	return ret;
+}
+
+// first node at or above key, above it with excl, nil if there is none
+static rbtree_node *rbtree_lower_bound(rbtree *T, const char *key, size_t len, int excl) {
+	uint64_t prefix = kv_key_prefix(key, len);
+	rbtree_node *node = T->root;
+	rbtree_node *found = T->nil;
+
+	while (node != T->nil) {
+		int ret = kv_key_compare(key, len, prefix, node->key);
+		if (ret < 0 || (ret == 0 && !excl)) {
+			found = node;
+			node = node->left;
+		} else {
+			node = node->right;
+		}
+	}
+	return found;
+}
+
+// last node at or below key, below it with excl
+static rbtree_node *rbtree_upper_bound(rbtree *T, const char *key, size_t len, int excl) {
+	uint64_t prefix = kv_key_prefix(key, len);
+	rbtree_node *node = T->root;
+	rbtree_node *found = T->nil;
+
+	while (node != T->nil) {
+		int ret = kv_key_compare(key, len, prefix, node->key);
+		if (ret > 0 || (ret == 0 && !excl)) {
+			found = node;
+			node = node->right;
+		} else {
+			node = node->left;
+		}
+	}
+	return found;
+}
+
+/*
+ * walk the pairs between start and end, see kvs_engine_t. one descent
+ * finds the first node, the rest is a successor (predecessor) walk that
+ * stops at the other bound. the caller holds the tree lock.
+ */
+static int rbtree_range(const char *start, size_t slen, const char *end, size_t elen,
+	int flags, kvs_scan_fn fn, void *arg) {
+
+	int reverse = flags & KVS_OP_REVERSE;
+	int start_excl = (flags & KVS_OP_START_EXCL) != 0;
+	int end_excl = (flags & KVS_OP_END_EXCL) != 0;
+	uint64_t sprefix = kv_key_prefix(start, slen);
+	uint64_t eprefix = end ? kv_key_prefix(end, elen) : 0;
+	rbtree_node *node;
+
+	if (!reverse) {
+		node = rbtree_lower_bound(tree, start, slen, start_excl);
+	} else if (end) {
+		node = rbtree_upper_bound(tree, end, elen, end_excl);
+	} else {
+		node = tree->root == tree->nil ? tree->nil : rbtree_maxi(tree, tree->root);
+	}
+
+	int ret = 0;
+	while (node != tree->nil && !ret) {
+		int cmp;
+		if (!reverse && end) {
+			cmp = kv_key_compare(end, elen, eprefix, node->key);
+			if (cmp < 0 || (cmp == 0 && end_excl)) break;
+		} else if (reverse) {
+			cmp = kv_key_compare(start, slen, sprefix, node->key);
+			if (cmp > 0 || (cmp == 0 && start_excl)) break;
+		}
+
+		ret = fn(node->key, node->value, arg);
+		node = reverse ? rbtree_predecessor(tree, node) : rbtree_successor(tree, node);
+	}
+	return ret;
+}
+
+// a walk follows parent links, it holds off the writers rather than validate
+int kv_rbtree_range(const char *start, size_t slen, const char *end, size_t elen,
+	int flags, kvs_scan_fn fn, void *arg) {
+	if (!tree || !fn) return -1;
+
+	pthread_mutex_lock(&tree->lock);
+	int ret = rbtree_range(start, slen, end, elen, flags, fn, arg);
+	pthread_mutex_unlock(&tree->lock);
+	return ret;
+}
+
+void kv_rbtree_stats(kvs_engine_stats_t *stats) {
+	if(!tree) return;
+	stats->count = tree->count;
+	stats->bytes = tree->bytes;
+}
+
+const kvs_engine_t kv_rbtree_engine = {
+	.name = "rbtree",
+	.init = kv_rbtree_init,
+	.destroy = kv_rbtree_destroy,
+	.lock = kv_rbtree_lock,
+	.unlock = kv_rbtree_unlock,
+	.set = kv_rbtree_set,
+	.get = kv_rbtree_get,
+	.mget = kv_rbtree_mget,
+	.del = kv_rbtree_delete,
+	.mod = kv_rbtree_modify,
+	.scan = kv_rbtree_scan,
+	.range = kv_rbtree_range,
+	.stats = kv_rbtree_stats,
+	.tick = kv_rbtree_tick,
+};
+
 #ifdef KV_RBTREE_DEBUG
-int main() {
+static int print_pair(const kv_key_t *key, kv_value_t *value, void *arg) {
+	printf("%s => %s\n", key->data, value->data);
+	return 0;
+}
 
-#if 1
-	kv_rbtree_init();
+// stop after *arg pairs
+static int print_some(const kv_key_t *key, kv_value_t *value, void *arg) {
+	printf("  %s => %s\n", key->data, value->data);
+	return -- *(int *)arg == 0;
+}
 
-	kv_rbtree_set("city", "sz");
-    kv_rbtree_set("server", "nginx");
-    kv_rbtree_set("request url", "https://jjc.com");
-    kv_rbtree_set("status code", "200");
-    kv_rbtree_set("request method", "GET");
+// readers share the writer's tree, a stable key must never go missing
+static rbtree *shared;
+static atomic_int stop;
 
-	char *result = kv_rbtree_get("city");
-    printf("result fot city %s\n", result);
+static void *reader(void *arg) {
+	long missing = 0;
+	char key[32];
+	int i = 0;
 
-    char *server = kv_rbtree_get("server");
-    printf("result fot server %s\n", server);
+	tree = shared;
+	while (!atomic_load(&stop)) {
+		for (i = 0; i < 1000; i ++) {
+			int len = snprintf(key, sizeof(key), "stable%d", i);
+			kv_value_t *value = kv_rbtree_get(key, len);
+			if (!value || strcmp(value->data, key)) missing ++;
+			if (value) kv_value_put(value);
+		}
+	}
+	return (void *)missing;
+}
 
-	kv_rbtree_modify("city", "SHENZHEN");
+int main() {
 
-	result = kv_rbtree_get("city");
-    printf("result fot city %s\n", result);
+#if 1
+	kv_rbtree_init();
 
-	kv_rbtree_delete("city");
+	kv_rbtree_set(KV_STR("city"), KV_STR("sz"));
+    kv_rbtree_set(KV_STR("server"), KV_STR("nginx"));
+    kv_rbtree_set(KV_STR("request url"), KV_STR("https://jjc.com"));
+    kv_rbtree_set(KV_STR("status code"), KV_STR("200"));
+    kv_rbtree_set(KV_STR("request method"), KV_STR("GET"));
+
+	kv_value_t *result = kv_rbtree_get(KV_STR("city"));
+    printf("result fot city %s\n", result->data);
+    kv_value_put(result);
+
+    kv_value_t *server = kv_rbtree_get(KV_STR("server"));
+    printf("result fot server %s\n", server->data);
+    kv_value_put(server);
+
+	kv_rbtree_modify(KV_STR("city"), KV_STR("SHENZHEN"));
+
+	result = kv_rbtree_get(KV_STR("city"));
+    printf("result fot city %s\n", result->data);
+    kv_value_put(result);
+
+	// keys and values may hold any byte, "bin\0key" sorts after "bin"
+	kv_rbtree_set(KV_STR("bin"), KV_STR("short"));
+	kv_rbtree_set(KV_STR("bin\0key"), KV_STR("a\0b"));
+	result = kv_rbtree_get(KV_STR("bin\0key"));
+    printf("result fot bin key %u bytes\n", result->len);
+    kv_value_put(result);
+
+	// looked up as one group, more keys than lookups in flight
+	const char *keys[] = {"server", "nokey", "status code", "bin", "zzz",
+		"request url", "a", "request method", "city", "bin\0key"};
+	size_t klens[] = {6, 5, 11, 3, 3, 11, 1, 14, 4, 7};
+	kv_value_t *values[10];
+	kv_rbtree_mget(keys, klens, values, 10);
+	for (int i = 0; i < 10; i ++) {
+		printf("mget %s: %s\n", keys[i], values[i] ? values[i]->data : NULL);
+		if (values[i]) kv_value_put(values[i]);
+	}
 
-	result = kv_rbtree_get("city");
-    printf("result fot city %s\n", result);
+	kv_rbtree_delete(KV_STR("city"));
+
+	result = kv_rbtree_get(KV_STR("city"));
+    printf("result fot city %s\n", result ? result->data : NULL);
+
+	kvs_engine_stats_t stats = {0};
+	kv_rbtree_engine.scan(print_pair, NULL);
+	kv_rbtree_engine.stats(&stats);
+	printf("%zu pairs, %zu bytes\n", stats.count, stats.bytes);
+
+	// bounds that are not keys, an excluded bound that is, a limit, reverse
+	int limit = 100;
+	printf("range [bin, s]:\n");
+	kv_rbtree_range(KV_STR("bin"), KV_STR("s"), 0, print_some, &limit);
+	printf("range (bin, +):\n");
+	kv_rbtree_range(KV_STR("bin"), NULL, 0, KVS_OP_START_EXCL, print_some, &limit);
+	limit = 2;
+	printf("range [-, +) limit 2:\n");
+	kv_rbtree_range(KV_STR(""), NULL, 0, 0, print_some, &limit);
+	limit = 100;
+	printf("reverse [request, status code):\n");
+	kv_rbtree_range(KV_STR("request"), KV_STR("status code"),
+		KVS_OP_REVERSE | KVS_OP_END_EXCL, print_some, &limit);
+
+	// lock free gets against inserts, deletes and modifies rotating the tree
+	char key[32];
+	int i = 0, round = 0;
+	for (i = 0; i < 1000; i ++) {
+		int len = snprintf(key, sizeof(key), "stable%d", i);
+		kv_rbtree_set(key, len, key, len);
+	}
+	shared = tree;
+	pthread_t readers[3];
+	for (i = 0; i < 3; i ++) pthread_create(&readers[i], NULL, reader, NULL);
+	for (round = 0; round < 20; round ++) {
+		for (i = 0; i < 2000; i ++) {
+			int len = snprintf(key, sizeof(key), "churn%d", i);
+			kv_rbtree_set(key, len, key, len);
+		}
+		for (i = 0; i < 1000; i ++) {
+			int len = snprintf(key, sizeof(key), "stable%d", i);
+			kv_rbtree_modify(key, len, key, len);
+		}
+		for (i = 0; i < 2000; i ++) {
+			int len = snprintf(key, sizeof(key), "churn%d", i);
+			kv_rbtree_delete(key, len);
+		}
+		kv_rbtree_tick();
+	}
+	atomic_store(&stop, 1);
+	long missing = 0;
+	for (i = 0; i < 3; i ++) {
+		void *ret = NULL;
+		pthread_join(readers[i], &ret);
+		missing += (long)ret;
+	}
+	printf("concurrent gets: %ld missing\n", missing);
+	for (i = 0; i < 1000; i ++) {
+		int len = snprintf(key, sizeof(key), "stable%d", i);
+		kv_rbtree_delete(key, len);
+	}
 
     kv_rbtree_destroy();
 	return 0;
@@ -576,7 +1064,6 @@ int main() {
 		
 	}
 
-	rbtree_traversal(T, T->root);
 	printf("----------------------------------------\n");
 
 	for (i = 0;i < 20;i ++) {
@@ -585,7 +1072,6 @@ int main() {
 		rbtree_node *cur = rbtree_delete(T, node);
 		myfree(cur);
 
-		rbtree_traversal(T, T->root);
 		printf("----------------------------------------\n");
 	}
 #endif
@@ -0,0 +1,654 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "../kvstore.h"
+#include "../mm/mymalloc.h"
+#include "../mm/epoch.h"
+
+/*
+ * a lock free skiplist. a node is one allocation: the header, its tower of
+ * next pointers and its key. searches take no lock and write nothing, sets
+ * link a node with a CAS on each level from the bottom up, deletes mark the
+ * node's next pointers from the top down and the mark on level 0 is what
+ * removes it. marked nodes are unlinked by whichever search passes them
+ * next, in the style of Fraser and Harris.
+ *
+ * unlinked nodes and replaced values are retired to the epoch. a node is
+ * only retired once both its insert has stopped linking levels and its
+ * delete has unlinked it, whichever of the two finishes last retires it.
+ */
+#define SL_MAX_LEVEL        16
+#define SL_MARK             ((uintptr_t)1)
+
+// a node is retired once both are set
+#define SL_BUILT            0x1
+#define SL_DELETED          0x2
+
+typedef struct sl_node_s {
+    kv_key_t *key;                  // right behind the tower, NULL for the head
+    _Atomic(kv_value_t *) value;
+    _Atomic int state;
+    int height;
+    _Atomic uintptr_t next[];       // bit 0 marks the node deleted on that level
+} sl_node_t;
+
+typedef struct skiplist_s {
+    sl_node_t *head;                // SL_MAX_LEVEL high
+    _Atomic int height;             // of the highest node linked so far
+
+    _Atomic size_t count;
+    _Atomic size_t bytes;
+} skiplist_t;
+
+// one instance per reactor thread
+__thread skiplist_t *skiplist = NULL;
+
+static __thread uint64_t sl_rand;
+
+static inline sl_node_t *_ptr(uintptr_t next) {
+    return (sl_node_t *)(next & ~SL_MARK);
+}
+
+static inline int _marked(uintptr_t next) {
+    return (next & SL_MARK) != 0;
+}
+
+static inline uintptr_t _next(sl_node_t *node, int level) {
+    return atomic_load_explicit(&node->next[level], memory_order_acquire);
+}
+
+// a node reaches each further level with probability 1/4
+static int _random_height(void) {
+    if(!sl_rand) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        sl_rand = kv_hash64((const char *)&ts, sizeof(ts), (uintptr_t)&sl_rand) | 1;
+    }
+    sl_rand ^= sl_rand << 13;
+    sl_rand ^= sl_rand >> 7;
+    sl_rand ^= sl_rand << 17;
+
+    uint64_t r = sl_rand;
+    int height = 1;
+    while(height < SL_MAX_LEVEL && (r & 3) == 0) {
+        height ++;
+        r >>= 2;
+    }
+    return height;
+}
+
+static sl_node_t *_node_create(int height, const char *key, size_t klen,
+    const char *value, size_t vlen) {
+
+    size_t tower = height * sizeof(uintptr_t);
+    sl_node_t *node = (sl_node_t *)mymalloc(sizeof(sl_node_t) + tower + sizeof(kv_key_t) + klen + 1);
+    if(!node) return NULL;
+
+    kv_value_t *vcopy = NULL;
+    if(value) {
+        vcopy = kv_value_create(value, vlen);
+        if(!vcopy) {
+            myfree(node);
+            return NULL;
+        }
+    }
+
+    node->height = height;
+    atomic_init(&node->value, vcopy);
+    atomic_init(&node->state, 0);
+
+    if(key) {
+        node->key = (kv_key_t *)((char *)node->next + tower);
+        node->key->prefix = kv_key_prefix(key, klen);
+        node->key->len = klen;
+        memcpy(node->key->data, key, klen);
+        node->key->data[klen] = '\0';
+    } else {
+        node->key = NULL;
+    }
+
+    int i = 0;
+    for(i = 0; i < height; i ++) {
+        atomic_init(&node->next[i], 0);
+    }
+    return node;
+}
+
+static void _node_free(void *ptr) {
+    sl_node_t *node = ptr;
+    kv_value_t *value = atomic_load_explicit(&node->value, memory_order_relaxed);
+    if(value) kv_value_put(value);
+    myfree(node);
+}
+
+static void _put_value(void *ptr) {
+    kv_value_put(ptr);
+}
+
+/*
+ * preds and succs of key on every level, unlinking the marked nodes met on
+ * the way. returns the node holding key or NULL, -1 in *retry when an
+ * unlink lost a race and the search has to start over.
+ */
+static sl_node_t *_find_once(const char *key, size_t klen, uint64_t prefix,
+    sl_node_t **preds, sl_node_t **succs, int *retry) {
+
+    sl_node_t *pred = skiplist->head;
+    sl_node_t *curr = NULL;
+    int level = 0, ret = 1;
+
+    *retry = 0;
+    for(level = SL_MAX_LEVEL - 1; level >= 0; level --) {
+        curr = _ptr(_next(pred, level));
+        while(curr) {
+            uintptr_t succ = _next(curr, level);
+            if(_marked(succ)) {
+                uintptr_t expected = (uintptr_t)curr;
+                if(!atomic_compare_exchange_strong(&pred->next[level], &expected, succ & ~SL_MARK)) {
+                    *retry = 1;
+                    return NULL;
+                }
+                curr = _ptr(succ);
+                continue;
+            }
+
+            ret = kv_key_compare(key, klen, prefix, curr->key);
+            if(ret <= 0) break;
+            pred = curr;
+            curr = _ptr(succ);
+        }
+        if(preds) {
+            preds[level] = pred;
+            succs[level] = curr;
+        }
+    }
+    return curr && ret == 0 ? curr : NULL;
+}
+
+static sl_node_t *_find(const char *key, size_t klen, uint64_t prefix,
+    sl_node_t **preds, sl_node_t **succs) {
+
+    int retry = 0;
+    sl_node_t *node = NULL;
+    do {
+        node = _find_once(key, klen, prefix, preds, succs, &retry);
+    } while(retry);
+    return node;
+}
+
+/*
+ * the first node not below key, above it with excl, stepping over marked
+ * nodes without unlinking them. readers write nothing.
+ */
+static sl_node_t *_lower_bound(const char *key, size_t klen, uint64_t prefix, int excl) {
+    sl_node_t *pred = skiplist->head;
+    sl_node_t *curr = NULL;
+    int level = atomic_load_explicit(&skiplist->height, memory_order_acquire) - 1;
+
+    for(; level >= 0; level --) {
+        curr = _ptr(_next(pred, level));
+        while(curr) {
+            uintptr_t succ = _next(curr, level);
+            if(!_marked(succ)) {
+                int ret = kv_key_compare(key, klen, prefix, curr->key);
+                if(ret < 0 || (ret == 0 && !excl)) break;
+                pred = curr;
+            }
+            curr = _ptr(succ);
+        }
+    }
+    return curr;
+}
+
+// the last node below key, not above it with incl, the last of all for key NULL
+static sl_node_t *_upper_bound(const char *key, size_t klen, uint64_t prefix, int incl) {
+    sl_node_t *pred = skiplist->head;
+    int level = atomic_load_explicit(&skiplist->height, memory_order_acquire) - 1;
+
+    for(; level >= 0; level --) {
+        sl_node_t *curr = _ptr(_next(pred, level));
+        while(curr) {
+            uintptr_t succ = _next(curr, level);
+            if(!_marked(succ)) {
+                int ret = key ? kv_key_compare(key, klen, prefix, curr->key) : 1;
+                if(ret < 0 || (ret == 0 && !incl)) break;
+                pred = curr;
+            }
+            curr = _ptr(succ);
+        }
+    }
+    return pred == skiplist->head ? NULL : pred;
+}
+
+static sl_node_t *_search(const char *key, size_t klen) {
+    uint64_t prefix = kv_key_prefix(key, klen);
+    sl_node_t *node = _lower_bound(key, klen, prefix, 0);
+
+    if(!node || kv_key_compare(key, klen, prefix, node->key) != 0) return NULL;
+    if(_marked(_next(node, 0))) return NULL;
+    return node;
+}
+
+// whichever of insert and delete gets here second unlinks and retires the node
+static void _node_release(sl_node_t *node, int done) {
+    int other = done == SL_BUILT ? SL_DELETED : SL_BUILT;
+    if(!(atomic_fetch_or(&node->state, done) & other)) return;
+
+    _find(node->key->data, node->key->len, node->key->prefix, NULL, NULL);
+    epoch_retire(_node_free, node);
+}
+
+// link the levels above 0 of a node that is already in the list
+static void _link_tower(sl_node_t *node, sl_node_t **preds, sl_node_t **succs) {
+    int level = 1;
+
+    while(level < node->height) {
+        uintptr_t next = _next(node, level);
+        // only a delete changes the node's own pointers once it is linked
+        if(_marked(next)) break;
+        if(_ptr(next) != succs[level] && !atomic_compare_exchange_strong(&node->next[level],
+            &next, (uintptr_t)succs[level])) break;
+
+        uintptr_t expected = (uintptr_t)succs[level];
+        if(atomic_compare_exchange_strong(&preds[level]->next[level], &expected, (uintptr_t)node)) {
+            level ++;
+            continue;
+        }
+
+        // the neighbourhood moved, look again, the node may be gone by now
+        _find(node->key->data, node->key->len, node->key->prefix, preds, succs);
+        if(succs[0] != node) break;
+    }
+
+    _node_release(node, SL_BUILT);
+}
+
+int kv_skiplist_init(void) {
+
+    skiplist = (skiplist_t *)mymalloc(sizeof(skiplist_t));
+    if(!skiplist) return -1;
+
+    skiplist->head = _node_create(SL_MAX_LEVEL, NULL, 0, NULL, 0);
+    if(!skiplist->head) {
+        myfree(skiplist);
+        skiplist = NULL;
+        return -1;
+    }
+    atomic_init(&skiplist->height, 1);
+    atomic_init(&skiplist->count, 0);
+    atomic_init(&skiplist->bytes, 0);
+
+    return 0;
+}
+
+// no reader or writer may be left
+void kv_skiplist_destroy(void) {
+    if(!skiplist) return;
+
+    sl_node_t *node = skiplist->head;
+    while(node) {
+        sl_node_t *next = _ptr(_next(node, 0));
+        _node_free(node);
+        node = next;
+    }
+
+    myfree(skiplist);
+    skiplist = NULL;
+}
+
+/*
+ * nothing to lock, a batch of ops runs in one epoch section and every op
+ * opens its own as well.
+ */
+void kv_skiplist_lock(void) {
+    epoch_enter();
+}
+
+void kv_skiplist_unlock(void) {
+    epoch_exit();
+}
+
+int kv_skiplist_set(const char *key, size_t klen, const char *value, size_t vlen) {
+    if(!skiplist || !key || !value) return -1;
+
+    uint64_t prefix = kv_key_prefix(key, klen);
+    sl_node_t *preds[SL_MAX_LEVEL], *succs[SL_MAX_LEVEL];
+    sl_node_t *node = NULL;
+    int ret = 0;
+
+    epoch_enter();
+    while(1) {
+        // an existing key is left as it is
+        if(_find(key, klen, prefix, preds, succs)) break;
+
+        if(!node) {
+            node = _node_create(_random_height(), key, klen, value, vlen);
+            if(!node) {
+                fprintf(stderr, "node malloc failed\n");
+                ret = -1;
+                break;
+            }
+        }
+
+        int i = 0;
+        for(i = 0; i < node->height; i ++) {
+            atomic_store_explicit(&node->next[i], (uintptr_t)succs[i], memory_order_relaxed);
+        }
+
+        // linked on level 0 is in the list
+        uintptr_t expected = (uintptr_t)succs[0];
+        if(!atomic_compare_exchange_strong(&preds[0]->next[0], &expected, (uintptr_t)node)) continue;
+
+        atomic_fetch_add_explicit(&skiplist->count, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&skiplist->bytes, klen + vlen, memory_order_relaxed);
+
+        int height = atomic_load_explicit(&skiplist->height, memory_order_relaxed);
+        while(height < node->height && !atomic_compare_exchange_weak(&skiplist->height,
+            &height, node->height));
+
+        _link_tower(node, preds, succs);
+        node = NULL;
+        break;
+    }
+    epoch_exit();
+
+    // built for an insert that did not happen
+    if(node) _node_free(node);
+
+    return ret;
+}
+
+// the caller owns a reference to the returned value
+kv_value_t *kv_skiplist_get(const char *key, size_t klen) {
+    if(!skiplist || !key) return NULL;
+
+    kv_value_t *value = NULL;
+    epoch_enter();
+    sl_node_t *node = _search(key, klen);
+    if(node) {
+        // a replaced value keeps its reference until the section ends
+        value = kv_value_get(atomic_load_explicit(&node->value, memory_order_acquire));
+    }
+    epoch_exit();
+
+    return value;
+}
+
+int kv_skiplist_delete(const char *key, size_t klen) {
+    if(!skiplist || !key) return -1;
+
+    uint64_t prefix = kv_key_prefix(key, klen);
+    epoch_enter();
+
+    sl_node_t *node = _find(key, klen, prefix, NULL, NULL);
+    if(!node) {
+        epoch_exit();
+        return -1;
+    }
+
+    int level = 0;
+    for(level = node->height - 1; level > 0; level --) {
+        atomic_fetch_or_explicit(&node->next[level], SL_MARK, memory_order_acq_rel);
+    }
+    uintptr_t next = atomic_fetch_or_explicit(&node->next[0], SL_MARK, memory_order_acq_rel);
+    if(_marked(next)) {
+        // a concurrent delete got there first
+        epoch_exit();
+        return -1;
+    }
+
+    kv_value_t *value = atomic_load_explicit(&node->value, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&skiplist->count, 1, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&skiplist->bytes, klen + value->len, memory_order_relaxed);
+
+    _find(key, klen, prefix, NULL, NULL);
+    _node_release(node, SL_DELETED);
+
+    epoch_exit();
+    return 0;
+}
+
+int kv_skiplist_modify(const char *key, size_t klen, const char *value, size_t vlen) {
+    if(!skiplist || !key || !value) return -1;
+
+    kv_value_t *vcopy = kv_value_create(value, vlen);
+    if(!vcopy) {
+        fprintf(stderr, "vcopy malloc failed\n");
+        return -1;
+    }
+
+    epoch_enter();
+    sl_node_t *node = _search(key, klen);
+    if(!node) {
+        epoch_exit();
+        kv_value_put(vcopy);
+        return -1;
+    }
+
+    kv_value_t *old = atomic_exchange_explicit(&node->value, vcopy, memory_order_acq_rel);
+    atomic_fetch_add_explicit(&skiplist->bytes, vlen - old->len, memory_order_relaxed);
+    epoch_retire(_put_value, old);
+    epoch_exit();
+
+    return 0;
+}
+
+int kv_skiplist_tick(void) {
+    if(!skiplist) return 0;
+    return (int)epoch_reclaim();
+}
+
+// visit every pair in key order until fn returns non zero, lock free
+int kv_skiplist_scan(kvs_scan_fn fn, void *arg) {
+    if(!skiplist || !fn) return -1;
+
+    int ret = 0;
+    epoch_enter();
+    sl_node_t *node = _ptr(_next(skiplist->head, 0));
+    while(node && !ret) {
+        uintptr_t next = _next(node, 0);
+        if(!_marked(next)) {
+            ret = fn(node->key, atomic_load_explicit(&node->value, memory_order_acquire), arg);
+        }
+        node = _ptr(next);
+    }
+    epoch_exit();
+    return ret;
+}
+
+/*
+ * walk the pairs between start and end, see kvs_engine_t. forward walks
+ * follow level 0, the list has no back links, so a reverse walk searches
+ * for the predecessor of every key it emits.
+ */
+int kv_skiplist_range(const char *start, size_t slen, const char *end, size_t elen,
+    int flags, kvs_scan_fn fn, void *arg) {
+    if(!skiplist || !fn) return -1;
+
+    int reverse = flags & KVS_OP_REVERSE;
+    int start_excl = (flags & KVS_OP_START_EXCL) != 0;
+    int end_excl = (flags & KVS_OP_END_EXCL) != 0;
+    uint64_t sprefix = kv_key_prefix(start, slen);
+    uint64_t eprefix = end ? kv_key_prefix(end, elen) : 0;
+    int ret = 0;
+
+    epoch_enter();
+    sl_node_t *node = reverse ? _upper_bound(end, elen, eprefix, !end_excl) :
+        _lower_bound(start, slen, sprefix, start_excl);
+
+    while(node && !ret) {
+        uintptr_t next = _next(node, 0);
+        int cmp;
+        if(!reverse && end) {
+            cmp = kv_key_compare(end, elen, eprefix, node->key);
+            if(cmp < 0 || (cmp == 0 && end_excl)) break;
+        } else if(reverse) {
+            cmp = kv_key_compare(start, slen, sprefix, node->key);
+            if(cmp > 0 || (cmp == 0 && start_excl)) break;
+        }
+
+        if(!_marked(next)) {
+            ret = fn(node->key, atomic_load_explicit(&node->value, memory_order_acquire), arg);
+        }
+        node = reverse ? _upper_bound(node->key->data, node->key->len, node->key->prefix, 0) :
+            _ptr(next);
+    }
+    epoch_exit();
+    return ret;
+}
+
+void kv_skiplist_stats(kvs_engine_stats_t *stats) {
+    if(!skiplist) return;
+    stats->count = atomic_load_explicit(&skiplist->count, memory_order_relaxed);
+    stats->bytes = atomic_load_explicit(&skiplist->bytes, memory_order_relaxed);
+}
+
+const kvs_engine_t kv_skiplist_engine = {
+    .name = "skiplist",
+    .init = kv_skiplist_init,
+    .destroy = kv_skiplist_destroy,
+    .lock = kv_skiplist_lock,
+    .unlock = kv_skiplist_unlock,
+    .set = kv_skiplist_set,
+    .get = kv_skiplist_get,
+    .del = kv_skiplist_delete,
+    .mod = kv_skiplist_modify,
+    .scan = kv_skiplist_scan,
+    .range = kv_skiplist_range,
+    .stats = kv_skiplist_stats,
+    .tick = kv_skiplist_tick,
+};
+
+
+#ifdef KV_SKIPLIST_DEBUG
+static int print_pair(const kv_key_t *key, kv_value_t *value, void *arg) {
+    printf("%s => %s\n", key->data, value->data);
+    return 0;
+}
+
+// stop after *arg pairs
+static int print_some(const kv_key_t *key, kv_value_t *value, void *arg) {
+    printf("  %s => %s\n", key->data, value->data);
+    return -- *(int *)arg == 0;
+}
+
+/*
+ * writers share one list. each owns the keys i with i % 4 == id and
+ * inserts, modifies and deletes them while all of them fight over the
+ * same neighbourhoods, every thread also reads the keys of the others.
+ */
+#define SL_THREADS      4
+#define SL_KEYS         20000
+
+static skiplist_t *shared;
+
+static void *writer(void *arg) {
+    long id = (long)arg, wrong = 0;
+    char key[32];
+    int i = 0, round = 0;
+
+    skiplist = shared;
+    for(round = 0; round < 4; round ++) {
+        for(i = id; i < SL_KEYS; i += SL_THREADS) {
+            int len = snprintf(key, sizeof(key), "key%05d", i);
+            if(kv_skiplist_set(key, len, key, len)) wrong ++;
+            kv_skiplist_modify(key, len, key, len);
+        }
+        for(i = (id + 1) % SL_THREADS; i < SL_KEYS; i += SL_THREADS) {
+            int len = snprintf(key, sizeof(key), "key%05d", i);
+            kv_value_t *value = kv_skiplist_get(key, len);
+            if(value && strcmp(value->data, key)) wrong ++;
+            if(value) kv_value_put(value);
+        }
+        // the last round keeps every third key
+        for(i = id; i < SL_KEYS; i += SL_THREADS) {
+            int len = snprintf(key, sizeof(key), "key%05d", i);
+            if(round == 3 && i % 3 == 0) continue;
+            if(kv_skiplist_delete(key, len)) wrong ++;
+        }
+        kv_skiplist_tick();
+    }
+    return (void *)wrong;
+}
+
+static int check_order(const kv_key_t *key, kv_value_t *value, void *arg) {
+    long *state = arg;
+    int i = atoi(key->data + 3);
+    if(i <= state[0] || i % 3) state[1] ++;
+    state[0] = i;
+    state[2] ++;
+    return 0;
+}
+
+int main() {
+
+    kv_skiplist_init();
+
+    kv_skiplist_set(KV_STR("city"), KV_STR("sz"));
+    kv_skiplist_set(KV_STR("server"), KV_STR("nginx"));
+    kv_skiplist_set(KV_STR("request url"), KV_STR("https://jjc.com"));
+    kv_skiplist_set(KV_STR("status code"), KV_STR("200"));
+    kv_skiplist_set(KV_STR("request method"), KV_STR("GET"));
+
+    kv_value_t *result = kv_skiplist_get(KV_STR("city"));
+    printf("result fot city %s\n", result->data);
+    kv_value_put(result);
+
+    kv_skiplist_modify(KV_STR("city"), KV_STR("shenzhen"));
+    result = kv_skiplist_get(KV_STR("city"));
+    printf("result fot city %s\n", result->data);
+    kv_value_put(result);
+
+    // keys and values may hold any byte, "bin\0key" sorts after "bin"
+    kv_skiplist_set(KV_STR("bin"), KV_STR("short"));
+    kv_skiplist_set(KV_STR("bin\0key"), KV_STR("a\0b"));
+    result = kv_skiplist_get(KV_STR("bin\0key"));
+    printf("result fot bin key %u bytes\n", result->len);
+    kv_value_put(result);
+
+    kv_skiplist_delete(KV_STR("city"));
+    result = kv_skiplist_get(KV_STR("city"));
+    printf("result fot city %s\n", result ? result->data : NULL);
+
+    kv_skiplist_engine.scan(print_pair, NULL);
+
+    int limit = 100;
+    printf("range [bin, s]:\n");
+    kv_skiplist_range(KV_STR("bin"), KV_STR("s"), 0, print_some, &limit);
+    printf("reverse [request, status code):\n");
+    kv_skiplist_range(KV_STR("request"), KV_STR("status code"),
+        KVS_OP_REVERSE | KVS_OP_END_EXCL, print_some, &limit);
+
+    kvs_engine_stats_t stats = {0};
+    kv_skiplist_engine.stats(&stats);
+    printf("%zu pairs, %zu bytes\n", stats.count, stats.bytes);
+    kv_skiplist_destroy();
+
+    kv_skiplist_init();
+    shared = skiplist;
+    pthread_t threads[SL_THREADS];
+    long i = 0, wrong = 0;
+    for(i = 0; i < SL_THREADS; i ++) {
+        pthread_create(&threads[i], NULL, writer, (void *)i);
+    }
+    for(i = 0; i < SL_THREADS; i ++) {
+        void *ret = NULL;
+        pthread_join(threads[i], &ret);
+        wrong += (long)ret;
+    }
+
+    long state[3] = {-1, 0, 0};
+    kv_skiplist_scan(check_order, state);
+    kv_skiplist_engine.stats(&stats);
+    printf("concurrent: %ld wrong, %ld out of order, %ld left, %zu counted\n",
+        wrong, state[1], state[2], stats.count);
+
+    kv_skiplist_destroy();
+
+    return 0;
+}
+#endif
@@ -0,0 +1,436 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <time.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "../kvstore.h"
+#include "../mm/mymalloc.h"
+
+/*
+ * open addressing in the style of a swiss table. every slot has a one byte
+ * tag in a separate control array: the low 7 bits of the key hash when the
+ * slot is full, EMPTY or DELETED otherwise. slots are probed a group at a
+ * time, the tags of a whole group are compared against the key's tag in one
+ * SIMD compare and only slots whose tag matches have their key looked at,
+ * so most lookups read one control line and one slot.
+ *
+ * groups are aligned and probed quadratically, a lookup ends at the first
+ * group that has an EMPTY tag.
+ */
+#if defined(__AVX2__)
+#define SWISS_GROUP         32
+#else
+#define SWISS_GROUP         16
+#endif
+
+#define SWISS_INIT_GROUPS   64          // a power of two
+#define SWISS_EMPTY         ((int8_t)-128)
+#define SWISS_DELETED       ((int8_t)-2)
+
+typedef uint32_t swiss_mask_t;          // bit i set for slot i of a group
+
+typedef struct swiss_slot_s {
+    kv_key_t *key;
+    kv_value_t *value;
+} swiss_slot_t;
+
+typedef struct swiss_s {
+    int8_t *ctrl;           // one tag per slot
+    swiss_slot_t *slots;
+
+    size_t mask;            // groups - 1
+    size_t count;
+    size_t growth_left;     // inserts into EMPTY slots before a rebuild
+    size_t bytes;
+
+    uint64_t seed;
+
+    pthread_mutex_t lock;
+} swiss_t;
+
+// one instance per reactor thread
+__thread swiss_t *swiss = NULL;
+
+static inline swiss_mask_t _match(const int8_t *ctrl, int8_t tag) {
+#if defined(__AVX2__)
+    __m256i group = _mm256_loadu_si256((const __m256i *)ctrl);
+    return (swiss_mask_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(group, _mm256_set1_epi8(tag)));
+#elif defined(__SSE2__)
+    __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+    return (swiss_mask_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(tag)));
+#else
+    swiss_mask_t mask = 0;
+    int i = 0;
+    for(i = 0; i < SWISS_GROUP; i ++) {
+        mask |= (swiss_mask_t)(ctrl[i] == tag) << i;
+    }
+    return mask;
+#endif
+}
+
+// EMPTY and DELETED are the only negative tags
+static inline swiss_mask_t _match_free(const int8_t *ctrl) {
+#if defined(__AVX2__)
+    return (swiss_mask_t)_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)ctrl));
+#elif defined(__SSE2__)
+    return (swiss_mask_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)ctrl));
+#else
+    swiss_mask_t mask = 0;
+    int i = 0;
+    for(i = 0; i < SWISS_GROUP; i ++) {
+        mask |= (swiss_mask_t)(ctrl[i] < 0) << i;
+    }
+    return mask;
+#endif
+}
+
+static inline int8_t _tag(uint64_t h) {
+    return (int8_t)(h & 0x7f);
+}
+
+static inline size_t _capacity(size_t mask) {
+    return (mask + 1) * SWISS_GROUP;
+}
+
+// keep an eighth of the slots EMPTY so probes stay short
+static inline size_t _max_load(size_t mask) {
+    return _capacity(mask) - _capacity(mask) / 8;
+}
+
+static int _alloc(swiss_t *t, size_t groups) {
+    size_t cap = groups * SWISS_GROUP;
+    int8_t *ctrl = (int8_t *)mymalloc(cap);
+    swiss_slot_t *slots = (swiss_slot_t *)mymalloc(cap * sizeof(swiss_slot_t));
+    if(!ctrl || !slots) {
+        if(ctrl) myfree(ctrl);
+        if(slots) myfree(slots);
+        return -1;
+    }
+    memset(ctrl, SWISS_EMPTY, cap);
+
+    t->ctrl = ctrl;
+    t->slots = slots;
+    t->mask = groups - 1;
+    t->growth_left = _max_load(t->mask);
+    return 0;
+}
+
+// slot of key, -1 if it is not stored
+static long _find(const char *key, size_t klen, uint64_t h) {
+    uint64_t prefix = kv_key_prefix(key, klen);
+    int8_t tag = _tag(h);
+    size_t g = (h >> 7) & swiss->mask;
+    size_t step = 0;
+
+    for(;;) {
+        const int8_t *ctrl = swiss->ctrl + g * SWISS_GROUP;
+        swiss_mask_t match = _match(ctrl, tag);
+        while(match) {
+            size_t i = g * SWISS_GROUP + __builtin_ctz(match);
+            if(kv_key_equal(key, klen, prefix, swiss->slots[i].key)) {
+                return (long)i;
+            }
+            match &= match - 1;
+        }
+        if(_match(ctrl, SWISS_EMPTY)) return -1;
+
+        step ++;
+        g = (g + step) & swiss->mask;
+    }
+}
+
+// first EMPTY or DELETED slot on the probe sequence of h
+static size_t _find_free(uint64_t h) {
+    size_t g = (h >> 7) & swiss->mask;
+    size_t step = 0;
+
+    for(;;) {
+        swiss_mask_t avail = _match_free(swiss->ctrl + g * SWISS_GROUP);
+        if(avail) return g * SWISS_GROUP + __builtin_ctz(avail);
+
+        step ++;
+        g = (g + step) & swiss->mask;
+    }
+}
+
+/*
+ * rebuild into groups, doubling when the table is really full and in place
+ * when most of the load was tombstones.
+ */
+static int _rehash(size_t groups) {
+    int8_t *old_ctrl = swiss->ctrl;
+    swiss_slot_t *old_slots = swiss->slots;
+    size_t old_cap = _capacity(swiss->mask);
+
+    if(_alloc(swiss, groups)) return -1;
+
+    size_t i = 0;
+    for(i = 0; i < old_cap; i ++) {
+        if(old_ctrl[i] < 0) continue;
+        kv_key_t *key = old_slots[i].key;
+        uint64_t h = kv_hash64(key->data, key->len, swiss->seed);
+        size_t j = _find_free(h);
+        swiss->ctrl[j] = _tag(h);
+        swiss->slots[j] = old_slots[i];
+    }
+    swiss->growth_left -= swiss->count;
+
+    myfree(old_ctrl);
+    myfree(old_slots);
+    return 0;
+}
+
+int kv_swiss_init(void) {
+
+    swiss = (swiss_t *)mymalloc(sizeof(swiss_t));
+    if(!swiss) return -1;
+
+    if(_alloc(swiss, SWISS_INIT_GROUPS)) {
+        myfree(swiss);
+        swiss = NULL;
+        return -1;
+    }
+    swiss->count = 0;
+    swiss->bytes = 0;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    swiss->seed = kv_hash64((const char *)&ts, sizeof(ts), (uintptr_t)swiss);
+
+    pthread_mutex_init(&swiss->lock, NULL);
+
+    return 0;
+}
+
+void kv_swiss_destroy(void) {
+    if(!swiss) return;
+
+    pthread_mutex_lock(&swiss->lock);
+    size_t i = 0;
+    for(i = 0; i < _capacity(swiss->mask); i ++) {
+        if(swiss->ctrl[i] < 0) continue;
+        kv_key_free(swiss->slots[i].key);
+        kv_value_put(swiss->slots[i].value);
+    }
+    myfree(swiss->ctrl);
+    myfree(swiss->slots);
+    pthread_mutex_unlock(&swiss->lock);
+    pthread_mutex_destroy(&swiss->lock);
+
+    myfree(swiss);
+    swiss = NULL;
+}
+
+/*
+ * set/get/delete/modify expect the caller to hold the table lock, a batch
+ * of ops takes it once for all of them.
+ */
+void kv_swiss_lock(void) {
+    pthread_mutex_lock(&swiss->lock);
+}
+
+void kv_swiss_unlock(void) {
+    pthread_mutex_unlock(&swiss->lock);
+}
+
+int kv_swiss_set(const char *key, size_t klen, const char *value, size_t vlen) {
+    if(!swiss || !key || !value) return -1;
+
+    uint64_t h = kv_hash64(key, klen, swiss->seed);
+    if(_find(key, klen, h) >= 0) {
+        return 0;
+    }
+
+    if(swiss->growth_left == 0) {
+        size_t groups = swiss->mask + 1;
+        if(swiss->count >= _max_load(swiss->mask) / 2) groups <<= 1;
+        if(_rehash(groups)) return -1;
+    }
+
+    kv_key_t *kcopy = kv_key_create(key, klen);
+    if(!kcopy) {
+        fprintf(stderr, "kcopy malloc failed\n");
+        return -1;
+    }
+
+    kv_value_t *vcopy = kv_value_create(value, vlen);
+    if(!vcopy) {
+        kv_key_free(kcopy);
+        fprintf(stderr, "vcopy malloc failed\n");
+        return -1;
+    }
+
+    size_t i = _find_free(h);
+    if(swiss->ctrl[i] == SWISS_EMPTY) swiss->growth_left --;
+    swiss->ctrl[i] = _tag(h);
+    swiss->slots[i].key = kcopy;
+    swiss->slots[i].value = vcopy;
+
+    swiss->count ++;
+    swiss->bytes += klen + vlen;
+
+    return 0;
+}
+
+// the caller owns a reference to the returned value
+kv_value_t *kv_swiss_get(const char *key, size_t klen) {
+    if(!swiss || !key) return NULL;
+
+    long i = _find(key, klen, kv_hash64(key, klen, swiss->seed));
+    if(i < 0) return NULL;
+
+    return kv_value_get(swiss->slots[i].value);
+}
+
+int kv_swiss_delete(const char *key, size_t klen) {
+    if(!swiss || !key) return -1;
+
+    long i = _find(key, klen, kv_hash64(key, klen, swiss->seed));
+    if(i < 0) return -1;
+
+    swiss->count --;
+    swiss->bytes -= swiss->slots[i].key->len + swiss->slots[i].value->len;
+    kv_key_free(swiss->slots[i].key);
+    kv_value_put(swiss->slots[i].value);
+
+    // no probe went past a group that still has an EMPTY slot
+    int8_t *group = swiss->ctrl + (i & ~(long)(SWISS_GROUP - 1));
+    if(_match(group, SWISS_EMPTY)) {
+        swiss->ctrl[i] = SWISS_EMPTY;
+        swiss->growth_left ++;
+    } else {
+        swiss->ctrl[i] = SWISS_DELETED;
+    }
+
+    return 0;
+}
+
+int kv_swiss_modify(const char *key, size_t klen, const char *value, size_t vlen) {
+    if(!swiss || !key || !value) return -1;
+
+    long i = _find(key, klen, kv_hash64(key, klen, swiss->seed));
+    if(i < 0) return -1;
+
+    kv_value_t *vcopy = kv_value_create(value, vlen);
+    if(!vcopy) {
+        fprintf(stderr, "vcopy malloc failed\n");
+        return -1;
+    }
+
+    swiss->bytes += vlen - swiss->slots[i].value->len;
+    kv_value_put(swiss->slots[i].value);
+    swiss->slots[i].value = vcopy;
+
+    return 0;
+}
+
+// visit every pair in slot order until fn returns non zero, takes the lock
+int kv_swiss_scan(kvs_scan_fn fn, void *arg) {
+    if(!swiss || !fn) return -1;
+
+    int ret = 0;
+    size_t i = 0;
+    pthread_mutex_lock(&swiss->lock);
+    for(i = 0; i < _capacity(swiss->mask) && !ret; i ++) {
+        if(swiss->ctrl[i] < 0) continue;
+        ret = fn(swiss->slots[i].key, swiss->slots[i].value, arg);
+    }
+    pthread_mutex_unlock(&swiss->lock);
+    return ret;
+}
+
+void kv_swiss_stats(kvs_engine_stats_t *stats) {
+    if(!swiss) return;
+    stats->count = swiss->count;
+    stats->bytes = swiss->bytes;
+}
+
+const kvs_engine_t kv_swiss_engine = {
+    .name = "swiss",
+    .init = kv_swiss_init,
+    .destroy = kv_swiss_destroy,
+    .lock = kv_swiss_lock,
+    .unlock = kv_swiss_unlock,
+    .set = kv_swiss_set,
+    .get = kv_swiss_get,
+    .del = kv_swiss_delete,
+    .mod = kv_swiss_modify,
+    .scan = kv_swiss_scan,
+    .stats = kv_swiss_stats,
+};
+
+
+#ifdef KV_SWISS_DEBUG
+static int print_pair(const kv_key_t *key, kv_value_t *value, void *arg) {
+    printf("%s => %s\n", key->data, value->data);
+    return 0;
+}
+
+int main() {
+
+    kv_swiss_init();
+
+    kv_swiss_set(KV_STR("city"), KV_STR("sz"));
+    kv_swiss_set(KV_STR("server"), KV_STR("nginx"));
+    kv_swiss_set(KV_STR("request url"), KV_STR("https://jjc.com"));
+    kv_swiss_set(KV_STR("status code"), KV_STR("200"));
+    kv_swiss_set(KV_STR("request method"), KV_STR("GET"));
+
+    kv_value_t *result = kv_swiss_get(KV_STR("city"));
+    printf("result fot city %s\n", result->data);
+    kv_value_put(result);
+
+    kv_swiss_modify(KV_STR("city"), KV_STR("shenzhen"));
+    result = kv_swiss_get(KV_STR("city"));
+    printf("result fot city %s\n", result->data);
+    kv_value_put(result);
+
+    // keys and values may hold any byte
+    kv_swiss_set(KV_STR("bin\0key"), KV_STR("a\0b"));
+    result = kv_swiss_get(KV_STR("bin\0key"));
+    printf("result fot bin key %u bytes\n", result->len);
+    kv_value_put(result);
+
+    kv_swiss_delete(KV_STR("city"));
+    result = kv_swiss_get(KV_STR("city"));
+    printf("result fot city %s\n", result ? result->data : NULL);
+
+    kvs_engine_stats_t stats = {0};
+    kv_swiss_engine.scan(print_pair, NULL);
+
+    // grow past the initial groups, then churn to leave tombstones behind
+    char key[32];
+    int i = 0, missing = 0;
+    for(i = 0; i < 20000; i ++) {
+        int len = snprintf(key, sizeof(key), "grow%d", i);
+        kv_swiss_set(key, len, key, len);
+    }
+    for(i = 0; i < 20000; i += 2) {
+        int len = snprintf(key, sizeof(key), "grow%d", i);
+        kv_swiss_delete(key, len);
+    }
+    for(i = 0; i < 20000; i ++) {
+        int len = snprintf(key, sizeof(key), "grow%d", i);
+        kv_value_t *value = kv_swiss_get(key, len);
+        if(!value != !(i & 1)) missing ++;
+        if(value) kv_value_put(value);
+    }
+    printf("%zu slots, %d wrong\n", _capacity(swiss->mask), missing);
+    for(i = 1; i < 20000; i += 2) {
+        int len = snprintf(key, sizeof(key), "grow%d", i);
+        kv_swiss_delete(key, len);
+    }
+
+    kv_swiss_engine.stats(&stats);
+    printf("%zu pairs, %zu bytes\n", stats.count, stats.bytes);
+
+    kv_swiss_destroy();
+
+    return 0;
+}
+#endif
@@ -0,0 +1,231 @@
+#ifndef __KV_VALUE_H__
+#define __KV_VALUE_H__
+
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "../mm/mymalloc.h"
+
+/*
+ * stored values are reference counted. the engine holds one reference and
+ * every GET takes another, so a MOD or DEL only drops the engine's share
+ * and a reply that is still being sent keeps the bytes alive.
+ */
+typedef struct kv_value_s {
+    atomic_int refcnt;
+    uint32_t len;
+    uint32_t off;       // from the start of the allocation, see kv_entry_create()
+    char data[];        // len bytes and a terminating NUL
+} kv_value_t;
+
+static inline kv_value_t *kv_value_create(const char *data, size_t len) {
+    kv_value_t *value = (kv_value_t *)mymalloc(sizeof(kv_value_t) + len + 1);
+    if(!value) return NULL;
+
+    atomic_init(&value->refcnt, 1);
+    value->len = len;
+    value->off = 0;
+    memcpy(value->data, data, len);
+    value->data[len] = '\0';
+
+    return value;
+}
+
+static inline kv_value_t *kv_value_get(kv_value_t *value) {
+    atomic_fetch_add_explicit(&value->refcnt, 1, memory_order_relaxed);
+    return value;
+}
+
+static inline void kv_value_put(kv_value_t *value) {
+    if(atomic_fetch_sub_explicit(&value->refcnt, 1, memory_order_acq_rel) == 1) {
+        myfree((char *)value - value->off);
+    }
+}
+
+/*
+ * stored keys carry their length and their first 8 bytes as a big endian
+ * integer, so most probes are settled on the length or the prefix and the
+ * remaining bytes are only compared when both agree. keys and values are
+ * binary, the trailing NUL is for printing only.
+ */
+typedef struct kv_key_s {
+    uint64_t prefix;
+    uint32_t len;
+    char data[];
+} kv_key_t;
+
+// a string literal as (pointer, length)
+#define KV_STR(s)   (s), (sizeof(s) - 1)
+
+static inline uint64_t kv_key_prefix(const char *data, size_t len) {
+    uint64_t prefix = 0;
+    memcpy(&prefix, data, len < sizeof(prefix) ? len : sizeof(prefix));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    prefix = __builtin_bswap64(prefix);
+#endif
+    return prefix;
+}
+
+static inline kv_key_t *kv_key_create(const char *data, size_t len) {
+    kv_key_t *key = (kv_key_t *)mymalloc(sizeof(kv_key_t) + len + 1);
+    if(!key) return NULL;
+
+    key->prefix = kv_key_prefix(data, len);
+    key->len = len;
+    memcpy(key->data, data, len);
+    key->data[len] = '\0';
+
+    return key;
+}
+
+static inline void kv_key_free(kv_key_t *key) {
+    myfree(key);
+}
+
+static inline int kv_key_equal(const char *data, size_t len, uint64_t prefix, const kv_key_t *key) {
+    if(len != key->len || prefix != key->prefix) return 0;
+    return len <= sizeof(prefix) || memcmp(data + sizeof(prefix), key->data + sizeof(prefix), len - sizeof(prefix)) == 0;
+}
+
+// orders (data, len) against key like memcmp, a shorter common prefix sorts first
+static inline int kv_key_compare(const char *data, size_t len, uint64_t prefix, const kv_key_t *key) {
+    if(prefix != key->prefix) return prefix < key->prefix ? -1 : 1;
+
+    // equal prefixes mean the first min(len, 8) bytes are equal
+    size_t n = len < key->len ? len : key->len;
+    if(n > sizeof(prefix)) {
+        int ret = memcmp(data + sizeof(prefix), key->data + sizeof(prefix), n - sizeof(prefix));
+        if(ret) return ret;
+    }
+    return (len > key->len) - (len < key->len);
+}
+
+/*
+ * an engine's node, its key and a small value in one allocation. the
+ * allocation ends in an anchor value whose count keeps it alive: the node
+ * holds one for as long as it exists and a GET of an inline value takes
+ * another, so the bytes outlive a DEL until the reply is sent. values over
+ * KV_VALUE_INLINE_MAX bytes get an allocation of their own and leave the
+ * anchor empty, and so does every value a MOD stores.
+ */
+#define KV_VALUE_INLINE_MAX     64
+
+#define KV_ALIGN8(n)            (((n) + 7) & ~(size_t)7)
+
+static inline kv_value_t *kv_entry_anchor(const kv_key_t *key) {
+    return (kv_value_t *)((char *)key + KV_ALIGN8(sizeof(kv_key_t) + key->len + 1));
+}
+
+static inline int kv_entry_inline(const kv_key_t *key, const kv_value_t *value) {
+    return value == kv_entry_anchor(key);
+}
+
+/*
+ * returns the node of size bytes with *kout and *vout pointing behind it.
+ * value NULL moves *vout, a value of a retired entry, into the new one.
+ */
+static inline void *kv_entry_create(size_t size, const char *key, size_t klen,
+    const char *value, size_t vlen, kv_key_t **kout, kv_value_t **vout) {
+
+    int inline_value = value && vlen <= KV_VALUE_INLINE_MAX;
+    size_t koff = KV_ALIGN8(size);
+    size_t aoff = koff + KV_ALIGN8(sizeof(kv_key_t) + klen + 1);
+    size_t alen = inline_value ? vlen : 0;
+
+    kv_value_t *outside = NULL;
+    if(value && !inline_value) {
+        outside = kv_value_create(value, vlen);
+        if(!outside) return NULL;
+    }
+
+    char *node = (char *)mymalloc(aoff + sizeof(kv_value_t) + alen + 1);
+    if(!node) {
+        if(outside) kv_value_put(outside);
+        return NULL;
+    }
+
+    kv_key_t *kcopy = (kv_key_t *)(node + koff);
+    kcopy->prefix = kv_key_prefix(key, klen);
+    kcopy->len = klen;
+    memcpy(kcopy->data, key, klen);
+    kcopy->data[klen] = '\0';
+
+    kv_value_t *anchor = (kv_value_t *)(node + aoff);
+    atomic_init(&anchor->refcnt, 1);
+    anchor->len = alen;
+    anchor->off = aoff;
+    if(alen) memcpy(anchor->data, value, alen);
+    anchor->data[alen] = '\0';
+
+    *kout = kcopy;
+    if(inline_value) *vout = anchor;
+    else if(value) *vout = outside;
+    return node;
+}
+
+// a copy of an entry, the value is moved over and copied only if inline
+static inline void *kv_entry_copy(size_t size, const kv_key_t *key, kv_value_t *value,
+    kv_key_t **kout, kv_value_t **vout) {
+
+    if(kv_entry_inline(key, value)) {
+        return kv_entry_create(size, key->data, key->len, value->data, value->len, kout, vout);
+    }
+    *vout = value;
+    return kv_entry_create(size, key->data, key->len, NULL, 0, kout, vout);
+}
+
+// drop an entry's value unless it lives in the entry
+static inline void kv_entry_value_put(const kv_key_t *key, kv_value_t *value) {
+    if(!kv_entry_inline(key, value)) kv_value_put(value);
+}
+
+// the node's count, the allocation goes once no GET holds the inline value
+static inline void kv_entry_release(const kv_key_t *key) {
+    kv_value_put(kv_entry_anchor(key));
+}
+
+static inline void kv_entry_free(const kv_key_t *key, kv_value_t *value) {
+    kv_entry_value_put(key, value);
+    kv_entry_release(key);
+}
+
+/*
+ * seeded 64 bit key hash for engine tables, in the style of wyhash: 16
+ * bytes per 128 bit multiply and fold, the tail read as overlapping words.
+ * distinct from kvs_hash_key(), which picks the shard, so a table's bucket
+ * bits do not repeat its shard.
+ */
+static inline uint64_t kv_hash_mix(uint64_t a, uint64_t b) {
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static inline uint64_t kv_hash_read(const char *p, size_t n) {
+    uint64_t v = 0;
+    memcpy(&v, p, n);
+    return v;
+}
+
+static inline uint64_t kv_hash64(const char *data, size_t len, uint64_t seed) {
+    const uint64_t p0 = 0xa0761d6478bd642fULL, p1 = 0xe7037ed1a0b428dbULL;
+    uint64_t h = seed ^ p0;
+    size_t n = len;
+    uint64_t a = 0, b = 0;
+
+    for(; n > 16; n -= 16, data += 16) {
+        h = kv_hash_mix(kv_hash_read(data, 8) ^ p1, kv_hash_read(data + 8, 8) ^ h);
+    }
+    if(n >= 8) {
+        a = kv_hash_read(data, 8);
+        b = kv_hash_read(data + n - 8, 8);
+    } else if(n >= 4) {
+        a = kv_hash_read(data, 4);
+        b = kv_hash_read(data + n - 4, 4);
+    } else if(n > 0) {
+        a = ((uint64_t)(uint8_t)data[0] << 16) | ((uint64_t)(uint8_t)data[n >> 1] << 8) | (uint8_t)data[n - 1];
+    }
+    return kv_hash_mix(p1 ^ len, kv_hash_mix(a ^ p1, b ^ h));
+}
+
+#endif
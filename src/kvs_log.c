@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+
+#include "kvs_log.h"
+
+#define KVS_LOG_RING_SIZE	4096		// records per thread, a power of two
+#define KVS_LOG_OUT_SIZE	(64 * 1024)
+
+_Static_assert(sizeof(kvs_log_rec_t) == 128, "log records are two cache lines");
+
+/*
+ * single producer single consumer ring. the owning thread is the only
+ * producer, kvs_log_flush() the only consumer. rings are never freed, a
+ * thread that exits leaves its ring to be drained.
+ */
+typedef struct kvs_log_ring_s {
+	_Atomic uint64_t head;		// next record to write, owner only
+	char pad0[64 - sizeof(uint64_t)];
+	_Atomic uint64_t tail;		// next record to read, consumer only
+	char pad1[64 - sizeof(uint64_t)];
+
+	_Atomic uint64_t dropped;	// records lost to a full ring
+	uint64_t reported;
+
+	struct kvs_log_ring_s *next;
+	kvs_log_rec_t recs[KVS_LOG_RING_SIZE];
+} kvs_log_ring_t;
+
+static __thread kvs_log_ring_t *t_ring;
+
+static _Atomic(kvs_log_ring_t *) g_rings;
+static pthread_mutex_t g_flush_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *kvs_log_names[] = {
+	[KVS_LOG_ERROR] = "ERROR",
+	[KVS_LOG_WARN] = "WARN",
+	[KVS_LOG_INFO] = "INFO",
+	[KVS_LOG_DEBUG] = "DEBUG",
+};
+
+static kvs_log_ring_t *kvs_log_ring(void) {
+	kvs_log_ring_t *ring = calloc(1, sizeof(kvs_log_ring_t));
+	if(!ring) return NULL;
+
+	// push onto the list the consumer walks
+	ring->next = atomic_load_explicit(&g_rings, memory_order_relaxed);
+	while(!atomic_compare_exchange_weak_explicit(&g_rings, &ring->next, ring,
+		memory_order_release, memory_order_relaxed));
+
+	t_ring = ring;
+	return ring;
+}
+
+kvs_log_rec_t *kvs_log_begin(int level, const char *file, int line, const char *fmt) {
+	kvs_log_ring_t *ring = t_ring ? t_ring : kvs_log_ring();
+	if(!ring) return NULL;
+
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	if(head - tail == KVS_LOG_RING_SIZE) {
+		atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+		return NULL;
+	}
+
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+
+	kvs_log_rec_t *rec = &ring->recs[head & (KVS_LOG_RING_SIZE - 1)];
+	rec->ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	rec->fmt = fmt;
+	rec->file = file;
+	rec->line = line;
+	rec->level = level;
+	rec->nargs = 0;
+	rec->slen = 0;
+	return rec;
+}
+
+// publishes the record the last kvs_log_begin of this thread returned
+void kvs_log_commit(void) {
+	kvs_log_ring_t *ring = t_ring;
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+
+// format one conversion spec, as rewritten by kvs_log_spec()
+static int kvs_log_format_arg(char *out, size_t cap, const char *spec, size_t speclen,
+	const kvs_log_rec_t *rec, uint64_t arg) {
+
+	char conv = spec[speclen - 1];
+	int wide = speclen >= 3 && spec[speclen - 2] == 'l';
+
+	switch(conv) {
+		case 'd': case 'i':
+			if(wide) return snprintf(out, cap, spec, (long long)arg);
+			return snprintf(out, cap, spec, (int)arg);
+		case 'u': case 'x': case 'X': case 'o':
+			if(wide) return snprintf(out, cap, spec, (unsigned long long)arg);
+			return snprintf(out, cap, spec, (unsigned int)arg);
+		case 'c':
+			return snprintf(out, cap, spec, (int)arg);
+		case 'p':
+			return snprintf(out, cap, spec, (void *)(uintptr_t)arg);
+		case 's':
+			return snprintf(out, cap, spec, rec->str + (arg < KVS_LOG_STR_MAX ? arg : KVS_LOG_STR_MAX - 1));
+		default:
+			return snprintf(out, cap, "%s", spec);
+	}
+}
+
+// widen every length modifier to ll, so one argument type covers each family
+static size_t kvs_log_spec(const char *fmt, char *spec, size_t cap) {
+	size_t i = 1, n = 1;
+	spec[0] = '%';
+
+	while(fmt[i] && strchr("-+ #0123456789.", fmt[i]) && n < cap - 4) {
+		spec[n ++] = fmt[i ++];
+	}
+
+	int wide = 0;
+	while(fmt[i] && strchr("hljzt", fmt[i])) {
+		wide |= fmt[i] != 'h';
+		i ++;
+	}
+	if(wide) {
+		spec[n ++] = 'l';
+		spec[n ++] = 'l';
+	}
+	if(fmt[i]) spec[n ++] = fmt[i ++];
+	spec[n] = '\0';
+	return i;
+}
+
+static size_t kvs_log_format(char *out, size_t cap, const kvs_log_rec_t *rec) {
+	time_t sec = rec->ns / 1000000000ULL;
+	struct tm tm;
+	localtime_r(&sec, &tm);
+
+	const char *file = strrchr(rec->file, '/');
+	file = file ? file + 1 : rec->file;
+
+	size_t len = strftime(out, cap, "[%Y-%m-%d %H:%M:%S", &tm);
+	int n = snprintf(out + len, cap - len, ".%06llu] %s:%u: %s: ",
+		(unsigned long long)(rec->ns % 1000000000ULL / 1000), file, rec->line,
+		kvs_log_names[rec->level]);
+	if(n > 0) len += n;
+
+	const char *p = rec->fmt;
+	int argi = 0;
+	while(*p && len < cap - 1) {
+		if(*p != '%') {
+			out[len ++] = *p ++;
+			continue;
+		}
+		if(p[1] == '%') {
+			out[len ++] = '%';
+			p += 2;
+			continue;
+		}
+
+		char spec[24];
+		p += kvs_log_spec(p, spec, sizeof(spec));
+		size_t speclen = strlen(spec);
+		if(argi < rec->nargs) {
+			n = kvs_log_format_arg(out + len, cap - len, spec, speclen, rec, rec->args[argi ++]);
+		} else {
+			n = snprintf(out + len, cap - len, "%s", spec);
+		}
+		if(n > 0) len += (size_t)n < cap - len ? (size_t)n : cap - len - 1;
+	}
+
+	if(len > cap - 1) len = cap - 1;
+	if(len == 0 || out[len - 1] != '\n') out[len ++] = '\n';
+	return len;
+}
+
+static void kvs_log_write(const char *buf, size_t len) {
+	while(len > 0) {
+		ssize_t n = write(STDERR_FILENO, buf, len);
+		if(n <= 0) return;
+		buf += n;
+		len -= n;
+	}
+}
+
+/*
+ * drain every ring. returns the number of records written. called from a
+ * poller, and once more at exit for whatever is left.
+ */
+int kvs_log_flush(void) {
+	static char out[KVS_LOG_OUT_SIZE];
+	size_t len = 0;
+	int count = 0;
+
+	if(pthread_mutex_trylock(&g_flush_lock)) return 0;
+
+	kvs_log_ring_t *ring = atomic_load_explicit(&g_rings, memory_order_acquire);
+	for(; ring; ring = ring->next) {
+		uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+		uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+		for(; tail != head; tail ++) {
+			if(KVS_LOG_OUT_SIZE - len < 1024) {
+				kvs_log_write(out, len);
+				len = 0;
+			}
+			len += kvs_log_format(out + len, KVS_LOG_OUT_SIZE - len,
+				&ring->recs[tail & (KVS_LOG_RING_SIZE - 1)]);
+			count ++;
+		}
+		atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+		uint64_t dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+		if(dropped != ring->reported) {
+			int n = snprintf(out + len, KVS_LOG_OUT_SIZE - len,
+				"%llu log records dropped\n", (unsigned long long)(dropped - ring->reported));
+			if(n > 0) len += n;
+			ring->reported = dropped;
+		}
+	}
+
+	if(len) kvs_log_write(out, len);
+	pthread_mutex_unlock(&g_flush_lock);
+	return count;
+}
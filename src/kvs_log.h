@@ -0,0 +1,103 @@
+#ifndef __KVS_LOG_H__
+#define __KVS_LOG_H__
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * asynchronous logging. a call packs its arguments into a fixed size record
+ * on the calling thread's own ring, the rings are drained, formatted and
+ * written out by kvs_log_flush() from a poller. nothing on the request path
+ * takes a lock or touches stdio.
+ *
+ * arguments may be integers, pointers and strings. strings are copied into
+ * the record (truncated to what fits), everything else is kept as 64 bits
+ * and converted by its conversion spec when the record is formatted.
+ */
+typedef enum {
+	KVS_LOG_ERROR = 0,
+	KVS_LOG_WARN,
+	KVS_LOG_INFO,
+	KVS_LOG_DEBUG,
+} kvs_log_level_t;
+
+// levels above this are compiled out, debug records only exist in DEBUG builds
+#ifndef KVS_LOG_LEVEL
+#ifdef DEBUG
+#define KVS_LOG_LEVEL		KVS_LOG_DEBUG
+#else
+#define KVS_LOG_LEVEL		KVS_LOG_INFO
+#endif
+#endif
+
+#define KVS_LOG_MAX_ARGS	6
+#define KVS_LOG_STR_MAX		48
+
+typedef struct kvs_log_rec_s {
+	uint64_t ns;
+	const char *fmt;		// must be a literal, it is read when formatting
+	const char *file;
+	uint32_t line;
+	uint8_t level;
+	uint8_t nargs;
+	uint16_t slen;
+	uint64_t args[KVS_LOG_MAX_ARGS];	// strings: offset into str
+	char str[KVS_LOG_STR_MAX];
+} kvs_log_rec_t;
+
+kvs_log_rec_t *kvs_log_begin(int level, const char *file, int line, const char *fmt);
+void kvs_log_commit(void);
+int kvs_log_flush(void);
+
+static inline void kvs_log_int(kvs_log_rec_t *rec, uint64_t arg) {
+	if(rec->nargs < KVS_LOG_MAX_ARGS) rec->args[rec->nargs ++] = arg;
+}
+
+// strings share str, once it is full they are cut to what is left
+static inline void kvs_log_str(kvs_log_rec_t *rec, const char *str) {
+	if(rec->nargs == KVS_LOG_MAX_ARGS) return;
+	if(!str) str = "(null)";
+
+	size_t room = KVS_LOG_STR_MAX - 1 - rec->slen;
+	size_t len = strnlen(str, room);
+	memcpy(rec->str + rec->slen, str, len);
+	rec->str[rec->slen + len] = '\0';
+
+	rec->args[rec->nargs ++] = rec->slen;
+	rec->slen += len + (len < room);
+}
+
+#define KVS_LOG_ARG(rec, a) _Generic((a), \
+	char *: kvs_log_str((rec), (const char *)(uintptr_t)(a)), \
+	const char *: kvs_log_str((rec), (const char *)(uintptr_t)(a)), \
+	default: kvs_log_int((rec), (uint64_t)(uintptr_t)(a)))
+
+#define KVS_LOG_NARGS(...)		KVS_LOG_NARGS_(_, ##__VA_ARGS__, 6, 5, 4, 3, 2, 1, 0)
+#define KVS_LOG_NARGS_(_, a1, a2, a3, a4, a5, a6, n, ...)	n
+#define KVS_LOG_CAT(a, b)		KVS_LOG_CAT_(a, b)
+#define KVS_LOG_CAT_(a, b)		a##b
+
+#define KVS_LOG_PACK_0(r)
+#define KVS_LOG_PACK_1(r, a)		KVS_LOG_ARG(r, a)
+#define KVS_LOG_PACK_2(r, a, ...)	KVS_LOG_ARG(r, a); KVS_LOG_PACK_1(r, __VA_ARGS__)
+#define KVS_LOG_PACK_3(r, a, ...)	KVS_LOG_ARG(r, a); KVS_LOG_PACK_2(r, __VA_ARGS__)
+#define KVS_LOG_PACK_4(r, a, ...)	KVS_LOG_ARG(r, a); KVS_LOG_PACK_3(r, __VA_ARGS__)
+#define KVS_LOG_PACK_5(r, a, ...)	KVS_LOG_ARG(r, a); KVS_LOG_PACK_4(r, __VA_ARGS__)
+#define KVS_LOG_PACK_6(r, a, ...)	KVS_LOG_ARG(r, a); KVS_LOG_PACK_5(r, __VA_ARGS__)
+
+#define KVS_LOG(level, fmt, ...) do { \
+	if((level) <= KVS_LOG_LEVEL) { \
+		kvs_log_rec_t *_rec = kvs_log_begin((level), __FILE__, __LINE__, (fmt)); \
+		if(_rec) { \
+			KVS_LOG_CAT(KVS_LOG_PACK_, KVS_LOG_NARGS(__VA_ARGS__))(_rec, ##__VA_ARGS__); \
+			kvs_log_commit(); \
+		} \
+	} \
+} while(0)
+
+#define KVS_ERRLOG(fmt, ...)		KVS_LOG(KVS_LOG_ERROR, fmt, ##__VA_ARGS__)
+#define KVS_WARNLOG(fmt, ...)		KVS_LOG(KVS_LOG_WARN, fmt, ##__VA_ARGS__)
+#define KVS_INFOLOG(fmt, ...)		KVS_LOG(KVS_LOG_INFO, fmt, ##__VA_ARGS__)
+#define KVS_DEBUGLOG(fmt, ...)		KVS_LOG(KVS_LOG_DEBUG, fmt, ##__VA_ARGS__)
+
+#endif
@@ -0,0 +1,456 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "kvstore.h"
+
+/*
+ * RSCAN, RRANGE, RREVRANGE and RPREFIX. keys are spread over the shards by hash, so
+ * no shard holds a contiguous run of them. a request has one op per shard,
+ * each op collects up to limit pairs of its shard in key order and the
+ * encoder merges the lists, emitting the first limit pairs. the cursor is
+ * the last key emitted in hex, passing it back resumes right after that
+ * key. "0" starts at the beginning and is returned when nothing is left.
+ * a prefix is the range from the prefix up to the first key above all the
+ * keys that start with it.
+ */
+
+static int kvs_range_shards = 1;
+
+// number of shards a range request fans out to, set once at startup
+void kvstore_set_shards(int n) {
+	kvs_range_shards = n > 0 ? n : 1;
+}
+
+// the scan commands take no bounds, the reverse ones walk down from end
+static inline int kvs_range_is_scan(int cmd) {
+	return cmd == KVS_CMD_RSCAN || cmd == KVS_CMD_BSCAN || cmd == KVS_CMD_LSCAN ||
+		cmd == KVS_CMD_ASCAN;
+}
+
+static inline int kvs_range_is_reverse(int cmd) {
+	return cmd == KVS_CMD_RREVRANGE || cmd == KVS_CMD_BREVRANGE ||
+		cmd == KVS_CMD_LREVRANGE || cmd == KVS_CMD_AREVRANGE;
+}
+
+static inline int kvs_range_is_prefix(int cmd) {
+	return cmd == KVS_CMD_RPREFIX || cmd == KVS_CMD_BPREFIX ||
+		cmd == KVS_CMD_LPREFIX || cmd == KVS_CMD_APREFIX;
+}
+
+typedef struct kvs_range_pair_s {
+	size_t off;		// key bytes in keys
+	size_t len;
+	kv_value_t *value;	// referenced
+} kvs_range_pair_t;
+
+struct kvs_range_s {
+	int count;
+	int limit;
+	int pos;		// next pair to merge
+	kvs_buf_t keys;
+	kvs_range_pair_t pairs[];
+};
+
+static int kvs_range_hexval(char c) {
+	if(c >= '0' && c <= '9') return c - '0';
+	if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+// decode a cursor into dst, returns the key length, 0 for none, -1 if invalid
+static int kvs_range_cursor(char *dst, const char *cursor, size_t clen) {
+	if(!cursor || clen == 0 || (clen == 1 && cursor[0] == '0')) return 0;
+	if(clen % 2 || clen > 2 * KVS_MAX_KEY_LEN) return -1;
+
+	size_t i = 0;
+	for(i = 0; i < clen; i += 2) {
+		int hi = kvs_range_hexval(cursor[i]);
+		int lo = kvs_range_hexval(cursor[i + 1]);
+		if(hi < 0 || lo < 0) return -1;
+		dst[i / 2] = hi << 4 | lo;
+	}
+	return clen / 2;
+}
+
+// the first key above every key that starts with prefix, 0 if there is none
+static size_t kvs_range_prefix_end(char *dst, const char *prefix, size_t plen) {
+	while(plen > 0 && (uint8_t)prefix[plen - 1] == 0xff) plen --;
+	if(plen == 0) return 0;
+
+	memcpy(dst, prefix, plen);
+	dst[plen - 1] ++;
+	return plen;
+}
+
+/*
+ * one op per shard, all sharing the bounds copied into the request. start
+ * NULL and end NULL are open. a request without ops is answered as failed.
+ */
+static kvs_request_t *kvs_range_request(int proto, int verb, int cmd, int engine,
+	const char *start, size_t slen, const char *end, size_t elen, long limit,
+	const char *cursor, size_t clen) {
+
+	char last[KVS_MAX_KEY_LEN], upper[KVS_MAX_KEY_LEN];
+	int flags = kvs_range_is_reverse(cmd) ? KVS_OP_REVERSE : 0;
+	int llen = kvs_range_cursor(last, cursor, clen);
+
+	int nops = kvs_range_shards;
+	if(llen < 0 || slen > KVS_MAX_KEY_LEN || elen > KVS_MAX_KEY_LEN || limit <= 0) nops = 0;
+	if(limit > KVS_RANGE_MAX) limit = KVS_RANGE_MAX;
+
+	if(kvs_range_is_prefix(cmd) && nops) {
+		elen = kvs_range_prefix_end(upper, start, slen);
+		end = elen ? upper : NULL;
+		flags |= KVS_OP_END_EXCL;
+	}
+
+	if(llen > 0 && (flags & KVS_OP_REVERSE)) {
+		end = last;
+		elen = llen;
+		flags |= KVS_OP_END_EXCL;
+	} else if(llen > 0) {
+		start = last;
+		slen = llen;
+		flags |= KVS_OP_START_EXCL;
+	}
+	if(!start) slen = 0;
+
+	kvs_request_t *req = kvstore_request_alloc(proto, verb, nops, nops ? slen + elen + 2 : 0);
+	if(!req || !nops) return req;
+
+	char *skey = kvstore_request_copy(req, start ? start : "", slen);
+	char *ekey = end ? kvstore_request_copy(req, end, elen) : NULL;
+
+	int i = 0;
+	for(i = 0; i < nops; i ++) {
+		kvs_op_t *op = &req->ops[i];
+		op->engine = engine;
+		op->verb = KVS_VERB_RANGE;
+		op->flags = flags | KVS_OP_PINNED;
+		op->shard = i;
+		op->key = skey;
+		op->klen = slen;
+		op->value = ekey;
+		op->vlen = ekey ? elen : 0;
+		op->limit = limit;
+	}
+	return req;
+}
+
+static int kvs_range_limit(const char *arg, long *limit) {
+	char *endp = NULL;
+	*limit = strtol(arg, &endp, 10);
+	return *arg && !*endp ? 0 : -1;
+}
+
+/*
+ * the arguments after the command name, argl NULL for NUL terminated ones:
+ *
+ *   RSCAN cursor [limit]
+ *   RRANGE start end [limit [cursor]]
+ *   RREVRANGE start end [limit [cursor]]
+ *   RPREFIX prefix [limit [cursor]]
+ *
+ * and the same with a B for the bptree engine, an L for the skiplist one and
+ * an A for the art one.
+ *
+ * "-" as start and "+" as end leave that side open.
+ */
+kvs_request_t *kvstore_range_parse(int proto, int verb, int cmd, int engine,
+	char **args, size_t *argl, int argc) {
+
+	const char *start = NULL, *end = NULL, *cursor = NULL;
+	size_t slen = 0, elen = 0, clen = 0;
+	long limit = KVS_RANGE_DEFAULT;
+	int ok = 0;
+
+	if(kvs_range_is_scan(cmd) && argc >= 1 && argc <= 2) {
+		cursor = args[0];
+		clen = argl ? argl[0] : strlen(args[0]);
+		ok = argc < 2 || kvs_range_limit(args[1], &limit) == 0;
+	} else if(kvs_range_is_prefix(cmd) && argc >= 1 && argc <= 3) {
+		start = args[0];
+		slen = argl ? argl[0] : strlen(args[0]);
+		ok = argc < 2 || kvs_range_limit(args[1], &limit) == 0;
+		if(argc == 3) {
+			cursor = args[2];
+			clen = argl ? argl[2] : strlen(args[2]);
+		}
+	} else if(!kvs_range_is_scan(cmd) && argc >= 2 && argc <= 4) {
+		slen = argl ? argl[0] : strlen(args[0]);
+		elen = argl ? argl[1] : strlen(args[1]);
+		if(slen != 1 || args[0][0] != '-') start = args[0];
+		if(elen != 1 || args[1][0] != '+') end = args[1];
+		ok = argc < 3 || kvs_range_limit(args[2], &limit) == 0;
+		if(argc == 4) {
+			cursor = args[3];
+			clen = argl ? argl[3] : strlen(args[3]);
+		}
+	}
+	if(!ok) limit = 0;
+
+	return kvs_range_request(proto, verb, cmd, engine, start, slen, end, elen,
+		limit, cursor, clen);
+}
+
+// a frame of one of the range opcodes, see kvstore.h
+kvs_request_t *kvstore_range_binary(int cmd, int engine, char *kptr, size_t klen,
+	char *vptr, size_t vlen) {
+
+	const char *start = NULL, *end = NULL;
+	uint16_t slen = 0, elen = 0;
+	uint32_t limit = 0;
+
+	if(kvs_range_is_prefix(cmd)) {
+		start = kptr;
+		slen = klen;
+	} else if(!kvs_range_is_scan(cmd) && klen >= 2 * sizeof(uint16_t)) {
+		memcpy(&slen, kptr, sizeof(slen));
+		slen = ntohs(slen);
+		if(klen - 2 * sizeof(uint16_t) >= slen) {
+			memcpy(&elen, kptr + sizeof(slen) + slen, sizeof(elen));
+			elen = ntohs(elen);
+		}
+		if(2 * sizeof(uint16_t) + slen + elen != klen) vlen = 0;
+		if(slen) start = kptr + sizeof(slen);
+		if(elen) end = kptr + 2 * sizeof(uint16_t) + slen;
+	} else if(klen) {
+		vlen = 0;
+	}
+
+	if(vlen >= sizeof(limit)) {
+		memcpy(&limit, vptr, sizeof(limit));
+		limit = ntohl(limit);
+	}
+	if(limit > KVS_RANGE_MAX) limit = KVS_RANGE_MAX;
+
+	return kvs_range_request(KVS_PROTO_BINARY, cmd, cmd, engine, start, slen, end, elen,
+		limit, vptr + sizeof(limit), vlen >= sizeof(limit) ? vlen - sizeof(limit) : 0);
+}
+
+// copy the key and take a reference on the value
+static int kvs_range_collect(const kv_key_t *key, kv_value_t *value, void *arg) {
+	kvs_range_t *range = arg;
+	kvs_range_pair_t *pair = &range->pairs[range->count];
+
+	pair->off = range->keys.len;
+	pair->len = key->len;
+	if(kvs_buf_append(&range->keys, key->data, key->len)) return -1;
+	pair->value = kv_value_get(value);
+
+	return ++ range->count == range->limit;
+}
+
+// the RANGE handler, runs on the op's shard under the engine lock
+int kvstore_range_execute(const kvs_engine_t *engine, kvs_op_t *op) {
+	if(!engine->range || op->limit <= 0) return -1;
+
+	kvs_range_t *range = kvstore_malloc(sizeof(kvs_range_t) + op->limit * sizeof(kvs_range_pair_t));
+	if(!range) return -1;
+	memset(range, 0, sizeof(kvs_range_t));
+	range->limit = op->limit;
+	op->range = range;
+
+	int ret = engine->range(op->key, op->klen, op->value, op->vlen, op->flags,
+		kvs_range_collect, range);
+	return ret < 0 ? -1 : 0;
+}
+
+void kvstore_range_free(kvs_range_t *range) {
+	int i = 0;
+	for(i = 0; i < range->count; i ++) {
+		kv_value_put(range->pairs[i].value);
+	}
+	kvs_buf_free(&range->keys);
+	kvstore_free(range);
+}
+
+static int kvs_range_cmp(const kvs_range_t *a, const kvs_range_t *b) {
+	const kvs_range_pair_t *pa = &a->pairs[a->pos];
+	const kvs_range_pair_t *pb = &b->pairs[b->pos];
+	size_t n = pa->len < pb->len ? pa->len : pb->len;
+
+	int ret = memcmp(a->keys.data + pa->off, b->keys.data + pb->off, n);
+	if(ret) return ret;
+	return (pa->len > pb->len) - (pa->len < pb->len);
+}
+
+// the shard list holding the next pair in reply order, NULL when all are drained
+static kvs_range_t *kvs_range_next(kvs_request_t *req, int reverse) {
+	kvs_range_t *best = NULL;
+	int i = 0;
+	for(i = 0; i < req->nops; i ++) {
+		kvs_range_t *range = req->ops[i].range;
+		if(!range || range->pos == range->count) continue;
+		if(!best) {
+			best = range;
+			continue;
+		}
+		int ret = kvs_range_cmp(range, best);
+		if(reverse ? ret > 0 : ret < 0) best = range;
+	}
+	return best;
+}
+
+typedef struct kvs_range_item_s {
+	const char *key;
+	size_t klen;
+	kv_value_t *value;
+} kvs_range_item_t;
+
+static int kvs_range_encode_text(kvs_out_t *out, const char *cursor,
+	kvs_range_item_t *items, int n) {
+
+	if(kvs_out_append(out, cursor, strlen(cursor))) return -1;
+
+	int i = 0;
+	for(i = 0; i < n; i ++) {
+		if(kvs_out_append(out, " ", 1)) return -1;
+		if(kvs_out_append(out, items[i].key, items[i].klen)) return -1;
+		if(kvs_out_append(out, " ", 1)) return -1;
+		if(kvs_out_value(out, items[i].value, items[i].value->len)) return -1;
+	}
+	return kvs_out_append(out, "", 1);
+}
+
+static int kvs_range_bulk(kvs_out_t *out, const char *data, size_t len, kv_value_t *value) {
+	char line[32];
+	int hlen = snprintf(line, sizeof(line), "$%zu\r\n", len);
+	if(kvs_out_append(out, line, hlen)) return -1;
+	if(value ? kvs_out_value(out, value, len) : kvs_out_append(out, data, len)) return -1;
+	return kvs_out_append(out, "\r\n", 2);
+}
+
+// *2 of the cursor and a flat array of keys and values, like redis SCAN
+static int kvs_range_encode_resp(kvs_out_t *out, const char *cursor,
+	kvs_range_item_t *items, int n) {
+
+	char line[32];
+	int len = snprintf(line, sizeof(line), "*2\r\n");
+	if(kvs_out_append(out, line, len)) return -1;
+	if(kvs_range_bulk(out, cursor, strlen(cursor), NULL)) return -1;
+
+	len = snprintf(line, sizeof(line), "*%d\r\n", 2 * n);
+	if(kvs_out_append(out, line, len)) return -1;
+
+	int i = 0;
+	for(i = 0; i < n; i ++) {
+		if(kvs_range_bulk(out, items[i].key, items[i].klen, NULL)) return -1;
+		if(kvs_range_bulk(out, NULL, items[i].value->len, items[i].value)) return -1;
+	}
+	return 0;
+}
+
+static int kvs_range_encode_bin(kvs_out_t *out, int opcode, const char *cursor,
+	kvs_range_item_t *items, int n) {
+
+	uint16_t clen = strlen(cursor);
+	uint32_t total = sizeof(clen) + clen;
+	int i = 0;
+	for(i = 0; i < n; i ++) {
+		total += sizeof(uint16_t) + items[i].klen + sizeof(uint32_t) + items[i].value->len;
+	}
+
+	kvs_bin_res_t res = {
+		.magic = KVS_BIN_MAGIC_RES,
+		.opcode = opcode,
+		.status = htons(KVS_BIN_OK),
+		.vlen = htonl(total),
+	};
+	if(kvs_out_append(out, &res, sizeof(res))) return -1;
+
+	uint16_t nclen = htons(clen);
+	if(kvs_out_append(out, &nclen, sizeof(nclen))) return -1;
+	if(kvs_out_append(out, cursor, clen)) return -1;
+
+	for(i = 0; i < n; i ++) {
+		uint16_t klen = htons(items[i].klen);
+		uint32_t vlen = htonl(items[i].value->len);
+		if(kvs_out_append(out, &klen, sizeof(klen))) return -1;
+		if(kvs_out_append(out, items[i].key, items[i].klen)) return -1;
+		if(kvs_out_append(out, &vlen, sizeof(vlen))) return -1;
+		if(items[i].value->len && kvs_out_value(out, items[i].value, items[i].value->len)) return -1;
+	}
+	return 0;
+}
+
+static int kvs_range_encode_failed(kvs_request_t *req, const char *name, kvs_out_t *out) {
+	char msg[64];
+	int len = 0;
+
+	switch(req->proto) {
+		case KVS_PROTO_BINARY: {
+			kvs_bin_res_t res = {
+				.magic = KVS_BIN_MAGIC_RES,
+				.opcode = req->verb,
+				.status = htons(req->nops ? KVS_BIN_FAILED : KVS_BIN_EINVAL),
+				.vlen = 0,
+			};
+			return kvs_out_append(out, &res, sizeof(res));
+		}
+		case KVS_PROTO_RESP:
+			len = snprintf(msg, sizeof(msg), "-ERR %s\r\n", req->nops ?
+				"range is not supported by this db" : "bad range arguments");
+			return kvs_out_append(out, msg, len);
+		default:
+			len = snprintf(msg, sizeof(msg), "%s FAILED", name) + 1;
+			return kvs_out_append(out, msg, len);
+	}
+}
+
+/*
+ * merge the shards' pairs into the reply. name is the text protocol's
+ * status prefix. a cursor is returned when limit pairs went out and some
+ * shard may hold more.
+ */
+int kvstore_range_encode(kvs_request_t *req, const char *name, kvs_out_t *out) {
+	int i = 0;
+	for(i = 0; i < req->nops; i ++) {
+		if(req->ops[i].status || !req->ops[i].range) break;
+	}
+	if(req->nops == 0 || i < req->nops) return kvs_range_encode_failed(req, name, out);
+
+	kvs_range_item_t items[KVS_RANGE_MAX];
+	int limit = req->ops[0].limit;
+	int reverse = req->ops[0].flags & KVS_OP_REVERSE;
+	int n = 0;
+
+	kvs_range_t *range = NULL;
+	while(n < limit && (range = kvs_range_next(req, reverse)) != NULL) {
+		kvs_range_pair_t *pair = &range->pairs[range->pos ++];
+		items[n].key = range->keys.data + pair->off;
+		items[n].klen = pair->len;
+		items[n].value = pair->value;
+		n ++;
+	}
+
+	int more = 0;
+	for(i = 0; n == limit && i < req->nops; i ++) {
+		kvs_range_t *r = req->ops[i].range;
+		if(r->pos < r->count || r->count == r->limit) more = 1;
+	}
+
+	char cursor[2 * KVS_MAX_KEY_LEN + 1] = "0";
+	if(more) {
+		static const char hex[] = "0123456789abcdef";
+		size_t k = 0;
+		for(k = 0; k < items[n - 1].klen && k < KVS_MAX_KEY_LEN; k ++) {
+			uint8_t c = items[n - 1].key[k];
+			cursor[2 * k] = hex[c >> 4];
+			cursor[2 * k + 1] = hex[c & 0xf];
+		}
+		cursor[2 * k] = '\0';
+	}
+
+	switch(req->proto) {
+		case KVS_PROTO_BINARY:
+			return kvs_range_encode_bin(out, req->verb, cursor, items, n);
+		case KVS_PROTO_RESP:
+			return kvs_range_encode_resp(out, cursor, items, n);
+		default:
+			return kvs_range_encode_text(out, cursor, items, n);
+	}
+}
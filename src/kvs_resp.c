@@ -0,0 +1,396 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "kvstore.h"
+
+#define KVS_RESP_MAX_ARGS		(1 + 2 * KVS_MAX_BATCH)
+#define KVS_RESP_MAX_BULK		(512 * 1024 * 1024)
+
+// engine behind each SELECT index
+static const int resp_engines[KVS_RESP_DB_COUNT] = {
+	[KVS_RESP_DB_HASH] = KVS_ENGINE_HASH,
+	[KVS_RESP_DB_RBTREE] = KVS_ENGINE_RBTREE,
+	[KVS_RESP_DB_ARRAY] = KVS_ENGINE_ARRAY,
+	[KVS_RESP_DB_SWISS] = KVS_ENGINE_SWISS,
+	[KVS_RESP_DB_BPTREE] = KVS_ENGINE_BPTREE,
+	[KVS_RESP_DB_SKIPLIST] = KVS_ENGINE_SKIPLIST,
+	[KVS_RESP_DB_ART] = KVS_ENGINE_ART,
+};
+
+/*
+ * parse "<type><number>\r\n" at *pos.
+ * returns 1 and advances *pos when complete, 0 if more bytes are needed,
+ * -1 if the stream is malformed.
+ */
+static int resp_parse_len(char **pos, char *end, char type, long *num) {
+	char *p = *pos;
+	if(p >= end) return 0;
+	if(*p != type) return -1;
+	p ++;
+
+	int neg = 0;
+	if(p < end && *p == '-') {
+		neg = 1;
+		p ++;
+	}
+
+	long n = 0;
+	while(p < end && *p >= '0' && *p <= '9') {
+		n = n * 10 + (*p - '0');
+		if(n > KVS_RESP_MAX_BULK) return -1;
+		p ++;
+	}
+	if(end - p < 2) return 0;
+	if(p[0] != '\r' || p[1] != '\n') return -1;
+
+	*num = neg ? -n : n;
+	*pos = p + 2;
+	return 1;
+}
+
+typedef enum {
+	KVS_RESP_STATIC = 0,	// reply computed while parsing
+	KVS_RESP_GET,
+	KVS_RESP_SET,
+	KVS_RESP_DEL,
+	KVS_RESP_MGET,
+	KVS_RESP_MSET,
+	KVS_RESP_RANGE,
+} kvs_resp_verb_t;
+
+static int resp_status(kvs_out_t *out, const char *status) {
+	return kvs_out_append(out, status, strlen(status));
+}
+
+static int resp_integer(kvs_out_t *out, long n) {
+	char line[32];
+	int len = snprintf(line, sizeof(line), ":%ld\r\n", n);
+	return kvs_out_append(out, line, len);
+}
+
+static int resp_bulk_len(kvs_out_t *out, size_t vlen) {
+	char line[32];
+	int len = snprintf(line, sizeof(line), "$%zu\r\n", vlen);
+	return kvs_out_append(out, line, len);
+}
+
+// the value itself is sent from the engine's storage
+static int resp_bulk(kvs_out_t *out, kv_value_t *value) {
+	if(!value) return resp_status(out, "$-1\r\n");
+
+	if(resp_bulk_len(out, value->len)) return -1;
+	if(kvs_out_value(out, value, value->len)) return -1;
+	return kvs_out_append(out, "\r\n", 2);
+}
+
+static int resp_bulk_str(kvs_out_t *out, const char *str) {
+	size_t vlen = strlen(str);
+	if(resp_bulk_len(out, vlen)) return -1;
+	if(kvs_out_append(out, str, vlen)) return -1;
+	return kvs_out_append(out, "\r\n", 2);
+}
+
+static int resp_error(kvs_out_t *out, const char *msg, const char *arg) {
+	char line[128];
+	int len = snprintf(line, sizeof(line), "-ERR %s '%.32s'\r\n", msg, arg);
+	if(len >= (int)sizeof(line)) len = sizeof(line) - 1;
+	return kvs_out_append(out, line, len);
+}
+
+// queue a request whose reply is already known
+static int resp_static(struct kvs_request_queue *queue, kvs_out_t *reply) {
+	kvs_request_t *req = kvstore_request_alloc(KVS_PROTO_RESP, KVS_RESP_STATIC, 0, reply->buf.len);
+	if(!req) {
+		kvs_out_free(reply);
+		return -1;
+	}
+	memcpy(req->data, reply->buf.data, reply->buf.len);
+	req->reply = req->data;
+	req->reply_len = reply->buf.len;
+	kvs_out_free(reply);
+
+	TAILQ_INSERT_TAIL(queue, req, link);
+	return 0;
+}
+
+// a command over KVS_RESP_MAX_ARGS is answered with an error, none of it runs
+static int resp_too_many(struct kvs_request_queue *queue) {
+	kvs_out_t reply = {0};
+	resp_status(&reply, "-ERR too many arguments\r\n");
+	return resp_static(queue, &reply);
+}
+
+/*
+ * one op per key. stride 1 takes bare keys, stride 2 key value pairs.
+ */
+static int resp_keys(struct kvs_request_queue *queue, int verb, int engine, int op_verb, int flags,
+	int nops, int stride, char **args, size_t *argl) {
+
+	size_t bytes = 0;
+	int i = 0;
+	for(i = 0; i < nops * stride; i ++) {
+		bytes += argl[i] + 1;
+	}
+
+	for(i = 0; i < nops * stride; i += stride) {
+		if(argl[i] <= KVS_MAX_KEY_LEN) continue;
+
+		kvs_out_t reply = {0};
+		resp_error(&reply, "key is too long", args[i]);
+		return resp_static(queue, &reply);
+	}
+
+	kvs_request_t *req = kvstore_request_alloc(KVS_PROTO_RESP, verb, nops, bytes);
+	if(!req) return -1;
+
+	for(i = 0; i < nops; i ++) {
+		kvs_op_t *op = &req->ops[i];
+		int k = i * stride;
+
+		op->engine = engine;
+		op->verb = op_verb;
+		op->flags = flags;
+		op->key = kvstore_request_copy(req, args[k], argl[k]);
+		op->klen = argl[k];
+		if(stride == 2) {
+			op->value = kvstore_request_copy(req, args[k + 1], argl[k + 1]);
+			op->vlen = argl[k + 1];
+		}
+	}
+
+	TAILQ_INSERT_TAIL(queue, req, link);
+	return 0;
+}
+
+static int resp_dispatch(int argc, char **argv, size_t *argl, int *db,
+	struct kvs_request_queue *queue) {
+
+	const char *name = argv[0];
+	int engine = resp_engines[*db];
+	kvs_out_t reply = {0};
+
+	if(strcasecmp(name, "GET") == 0 && argc == 2) {
+		return resp_keys(queue, KVS_RESP_GET, engine, KVS_VERB_GET, 0,
+			1, 1, &argv[1], &argl[1]);
+
+	} else if(strcasecmp(name, "SET") == 0 && argc >= 3) {
+		// redis SET overwrites, the engines only insert new keys
+		return resp_keys(queue, KVS_RESP_SET, engine, KVS_VERB_MOD, KVS_OP_UPSERT,
+			1, 2, &argv[1], &argl[1]);
+
+	} else if((strcasecmp(name, "DEL") == 0 || strcasecmp(name, "MDEL") == 0)
+		&& argc >= 2 && argc <= KVS_MAX_BATCH + 1) {
+		return resp_keys(queue, KVS_RESP_DEL, engine, KVS_VERB_DEL, 0,
+			argc - 1, 1, &argv[1], &argl[1]);
+
+	} else if(strcasecmp(name, "MGET") == 0 && argc >= 2 && argc <= KVS_MAX_BATCH + 1) {
+		return resp_keys(queue, KVS_RESP_MGET, engine, KVS_VERB_GET, 0,
+			argc - 1, 1, &argv[1], &argl[1]);
+
+	} else if(strcasecmp(name, "MSET") == 0 && argc >= 3 && argc % 2 == 1) {
+		return resp_keys(queue, KVS_RESP_MSET, engine, KVS_VERB_MOD, KVS_OP_UPSERT,
+			(argc - 1) / 2, 2, &argv[1], &argl[1]);
+
+	} else if(strcasecmp(name, "RSCAN") == 0 || strcasecmp(name, "RRANGE") == 0
+		|| strcasecmp(name, "RREVRANGE") == 0 || strcasecmp(name, "RPREFIX") == 0) {
+		// ordered engines only, the others answer with an error
+		int cmd = strcasecmp(name, "RSCAN") == 0 ? KVS_CMD_RSCAN :
+			strcasecmp(name, "RRANGE") == 0 ? KVS_CMD_RRANGE :
+			strcasecmp(name, "RPREFIX") == 0 ? KVS_CMD_RPREFIX : KVS_CMD_RREVRANGE;
+		kvs_request_t *req = kvstore_range_parse(KVS_PROTO_RESP, KVS_RESP_RANGE, cmd, engine,
+			&argv[1], &argl[1], argc - 1);
+		if(!req) return -1;
+		TAILQ_INSERT_TAIL(queue, req, link);
+		return 0;
+
+	} else if(strcasecmp(name, "PING") == 0) {
+		if(argc > 1) resp_bulk_str(&reply, argv[1]);
+		else resp_status(&reply, "+PONG\r\n");
+
+	} else if(strcasecmp(name, "SELECT") == 0 && argc == 2) {
+		// connection state, applies to everything parsed after it
+		char *endp = NULL;
+		long idx = strtol(argv[1], &endp, 10);
+		if(*endp || idx < 0 || idx >= KVS_RESP_DB_COUNT) {
+			resp_error(&reply, "DB index is out of range", argv[1]);
+		} else {
+			*db = idx;
+			resp_status(&reply, "+OK\r\n");
+		}
+
+	} else if(strcasecmp(name, "CONFIG") == 0 || strcasecmp(name, "COMMAND") == 0) {
+		// load tools probe these on connect, an empty answer keeps them going
+		resp_status(&reply, "*0\r\n");
+
+	} else if(strcasecmp(name, "QUIT") == 0) {
+		resp_status(&reply, "+OK\r\n");
+		if(resp_static(queue, &reply)) return -1;
+		TAILQ_LAST(queue, kvs_request_queue)->close = 1;
+		return 0;
+
+	} else {
+		resp_error(&reply, "unknown command or wrong number of arguments", name);
+	}
+
+	return resp_static(queue, &reply);
+}
+
+int kvstore_resp_encode(kvs_request_t *req, kvs_out_t *out) {
+	kvs_op_t *op = &req->ops[0];
+
+	switch(req->verb) {
+		case KVS_RESP_GET:
+			return resp_bulk(out, op->status ? NULL : op->result);
+		case KVS_RESP_SET:
+			if(op->status) return resp_error(out, "set failed for key", op->key);
+			return resp_status(out, "+OK\r\n");
+		case KVS_RESP_MGET: {
+			// one array, every value of it sent in place
+			char line[32];
+			int len = snprintf(line, sizeof(line), "*%d\r\n", req->nops);
+			if(kvs_out_append(out, line, len)) return -1;
+
+			int i = 0;
+			for(i = 0; i < req->nops; i ++) {
+				kvs_op_t *mop = &req->ops[i];
+				if(resp_bulk(out, mop->status ? NULL : mop->result)) return -1;
+			}
+			return 0;
+		}
+		case KVS_RESP_MSET: {
+			int i = 0;
+			for(i = 0; i < req->nops; i ++) {
+				if(req->ops[i].status) return resp_error(out, "set failed for key", req->ops[i].key);
+			}
+			return resp_status(out, "+OK\r\n");
+		}
+		case KVS_RESP_DEL: {
+			long deleted = 0;
+			int i = 0;
+			for(i = 0; i < req->nops; i ++) {
+				if(req->ops[i].status == 0) deleted ++;
+			}
+			return resp_integer(out, deleted);
+		}
+		case KVS_RESP_RANGE:
+			return kvstore_range_encode(req, NULL, out);
+		default:
+			return kvs_out_append(out, req->reply, req->reply_len);
+	}
+}
+
+/*
+ * an inline command, one line of space separated words as redis-cli and
+ * redis-benchmark send PING. returns 1 when a line was dispatched, 0 if the
+ * line is not complete yet, -1 on error.
+ */
+static int resp_parse_inline(char **pos, char *end, int *db, struct kvs_request_queue *queue) {
+	char *argv[KVS_RESP_MAX_ARGS];
+	size_t argl[KVS_RESP_MAX_ARGS];
+	char *p = *pos;
+
+	char *nl = memchr(p, '\n', end - p);
+	if(!nl) return 0;
+	char *line_end = nl > p && nl[-1] == '\r' ? nl - 1 : nl;
+	*line_end = '\0';
+
+	int argc = 0;
+	char *saveptr = NULL;
+	char *token = strtok_r(p, " ", &saveptr);
+	while(token) {
+		if(argc == KVS_RESP_MAX_ARGS) break;
+		argv[argc] = token;
+		argl[argc ++] = strlen(token);
+		token = strtok_r(NULL, " ", &saveptr);
+	}
+
+	*pos = nl + 1;
+	if(token) return resp_too_many(queue) ? -1 : 1;
+	if(argc && resp_dispatch(argc, argv, argl, db, queue)) return -1;
+	return 1;
+}
+
+// commands only RESP has, a connection opening with one of them inline speaks RESP
+int kvstore_resp_detect(const char *msg, size_t len) {
+	static const char *inline_cmds[] = { "PING", "SELECT", "QUIT", "COMMAND", "CONFIG" };
+
+	if(len && msg[0] == '*') return 1;
+
+	size_t n = 0;
+	while(n < len && msg[n] != ' ' && msg[n] != '\r' && msg[n] != '\n') n ++;
+
+	size_t i = 0;
+	for(i = 0; i < sizeof(inline_cmds) / sizeof(inline_cmds[0]); i ++) {
+		if(strlen(inline_cmds[i]) == n && strncasecmp(msg, inline_cmds[i], n) == 0) return 1;
+	}
+	return 0;
+}
+
+/*
+ * queue a request for every complete RESP array or inline command in msg. *db is the
+ * connection's SELECT index. returns the number of bytes consumed, a
+ * trailing partial command is left, -1 on protocol error.
+ */
+ssize_t kvstore_resp_parse(char *msg, size_t len, int *db, struct kvs_request_queue *queue) {
+	char *argv[KVS_RESP_MAX_ARGS];
+	size_t argl[KVS_RESP_MAX_ARGS];
+	char *pos = msg;
+	char *end = msg + len;
+
+	while(pos < end) {
+		char *p = pos;
+		long argc = 0;
+
+		if(*p != '*') {
+			int rc = resp_parse_inline(&p, end, db, queue);
+			if(rc < 0) return -1;
+			if(rc == 0) break;
+			pos = p;
+			continue;
+		}
+
+		int rc = resp_parse_len(&p, end, '*', &argc);
+		if(rc == 0) break;
+		if(rc < 0 || argc < 1) return -1;
+
+		int i = 0;
+		for(i = 0; i < argc; i ++) {
+			long blen = 0;
+			rc = resp_parse_len(&p, end, '$', &blen);
+			if(rc <= 0) break;
+			if(blen < 0 || blen > KVS_MAX_FRAME) return -1;
+			if(end - p < blen + 2) {
+				rc = 0;
+				break;
+			}
+			if(p[blen] != '\r' || p[blen + 1] != '\n') return -1;
+
+			// the arguments past the limit are only skipped
+			if(i < KVS_RESP_MAX_ARGS) {
+				argv[i] = p;
+				argl[i] = blen;
+			}
+			p += blen + 2;
+		}
+		if(rc < 0) return -1;
+		if(rc == 0) break;
+
+		if(argc > KVS_RESP_MAX_ARGS) {
+			if(resp_too_many(queue)) return -1;
+			pos = p;
+			continue;
+		}
+
+		// the command is complete, terminate the arguments over their CRLF
+		for(i = 0; i < argc; i ++) {
+			argv[i][argl[i]] = '\0';
+		}
+		if(resp_dispatch(argc, argv, argl, db, queue)) return -1;
+
+		pos = p;
+	}
+
+	return pos - msg;
+}
@@ -1,189 +1,860 @@
-#include <stdio.h>
+ #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
 
 #include "kvstore.h"
+#include "mm/mymalloc.h"
 
 #define BUFFER_SIZE			1024
-static const char *commands[] = {
-	"SET", "GET", "DEL", "MOD", 
-	"HSET", "HGET", "HDEL", "HMOD", 
-	"RSET", "RGET", "RDEL", "RMOD", 
+
+// every engine requests can name, indexed by kvs_engine_id_t
+static const kvs_engine_t *kvs_engines[KVS_ENGINE_COUNT] = {
+	[KVS_ENGINE_ARRAY] = &kv_array_engine,
+	[KVS_ENGINE_HASH] = &kv_hash_engine,
+	[KVS_ENGINE_RBTREE] = &kv_rbtree_engine,
+	[KVS_ENGINE_SWISS] = &kv_swiss_engine,
+	[KVS_ENGINE_BPTREE] = &kv_bptree_engine,
+	[KVS_ENGINE_SKIPLIST] = &kv_skiplist_engine,
+	[KVS_ENGINE_ART] = &kv_art_engine,
+};
+
+typedef struct kvs_cmd_def_s {
+	const char *name;
+	const char *reply;	// status line prefix, the rbtree engine answers like the array one
+	int engine;
+	int verb;
+	int batch;		// takes up to KVS_MAX_BATCH keys, one op per key
+} kvs_cmd_def_t;
+
+// indexed by opcode
+static const kvs_cmd_def_t kvs_cmds[KVS_CMD_COUNT] = {
+	[KVS_CMD_SET] = {"SET", "SET", KVS_ENGINE_ARRAY, KVS_VERB_SET},
+	[KVS_CMD_GET] = {"GET", "GET", KVS_ENGINE_ARRAY, KVS_VERB_GET},
+	[KVS_CMD_DEL] = {"DEL", "DEL", KVS_ENGINE_ARRAY, KVS_VERB_DEL},
+	[KVS_CMD_MOD] = {"MOD", "MOD", KVS_ENGINE_ARRAY, KVS_VERB_MOD},
+	[KVS_CMD_HSET] = {"HSET", "HSET", KVS_ENGINE_HASH, KVS_VERB_SET},
+	[KVS_CMD_HGET] = {"HGET", "HGET", KVS_ENGINE_HASH, KVS_VERB_GET},
+	[KVS_CMD_HDEL] = {"HDEL", "HDEL", KVS_ENGINE_HASH, KVS_VERB_DEL},
+	[KVS_CMD_HMOD] = {"HMOD", "HMOD", KVS_ENGINE_HASH, KVS_VERB_MOD},
+	[KVS_CMD_RSET] = {"RSET", "SET", KVS_ENGINE_RBTREE, KVS_VERB_SET},
+	[KVS_CMD_RGET] = {"RGET", "GET", KVS_ENGINE_RBTREE, KVS_VERB_GET},
+	[KVS_CMD_RDEL] = {"RDEL", "DEL", KVS_ENGINE_RBTREE, KVS_VERB_DEL},
+	[KVS_CMD_RMOD] = {"RMOD", "MOD", KVS_ENGINE_RBTREE, KVS_VERB_MOD},
+	[KVS_CMD_MGET] = {"MGET", "MGET", KVS_ENGINE_ARRAY, KVS_VERB_GET, 1},
+	[KVS_CMD_MSET] = {"MSET", "MSET", KVS_ENGINE_ARRAY, KVS_VERB_SET, 1},
+	[KVS_CMD_MDEL] = {"MDEL", "MDEL", KVS_ENGINE_ARRAY, KVS_VERB_DEL, 1},
+	[KVS_CMD_HMGET] = {"HMGET", "HMGET", KVS_ENGINE_HASH, KVS_VERB_GET, 1},
+	[KVS_CMD_HMSET] = {"HMSET", "HMSET", KVS_ENGINE_HASH, KVS_VERB_SET, 1},
+	[KVS_CMD_HMDEL] = {"HMDEL", "HMDEL", KVS_ENGINE_HASH, KVS_VERB_DEL, 1},
+	[KVS_CMD_RMGET] = {"RMGET", "MGET", KVS_ENGINE_RBTREE, KVS_VERB_GET, 1},
+	[KVS_CMD_RMSET] = {"RMSET", "MSET", KVS_ENGINE_RBTREE, KVS_VERB_SET, 1},
+	[KVS_CMD_RMDEL] = {"RMDEL", "MDEL", KVS_ENGINE_RBTREE, KVS_VERB_DEL, 1},
+	[KVS_CMD_SSET] = {"SSET", "SSET", KVS_ENGINE_SWISS, KVS_VERB_SET},
+	[KVS_CMD_SGET] = {"SGET", "SGET", KVS_ENGINE_SWISS, KVS_VERB_GET},
+	[KVS_CMD_SDEL] = {"SDEL", "SDEL", KVS_ENGINE_SWISS, KVS_VERB_DEL},
+	[KVS_CMD_SMOD] = {"SMOD", "SMOD", KVS_ENGINE_SWISS, KVS_VERB_MOD},
+	[KVS_CMD_SMGET] = {"SMGET", "SMGET", KVS_ENGINE_SWISS, KVS_VERB_GET, 1},
+	[KVS_CMD_SMSET] = {"SMSET", "SMSET", KVS_ENGINE_SWISS, KVS_VERB_SET, 1},
+	[KVS_CMD_SMDEL] = {"SMDEL", "SMDEL", KVS_ENGINE_SWISS, KVS_VERB_DEL, 1},
+	[KVS_CMD_RSCAN] = {"RSCAN", "RSCAN", KVS_ENGINE_RBTREE, KVS_VERB_RANGE},
+	[KVS_CMD_RRANGE] = {"RRANGE", "RRANGE", KVS_ENGINE_RBTREE, KVS_VERB_RANGE},
+	[KVS_CMD_RREVRANGE] = {"RREVRANGE", "RREVRANGE", KVS_ENGINE_RBTREE, KVS_VERB_RANGE},
+	[KVS_CMD_BSET] = {"BSET", "BSET", KVS_ENGINE_BPTREE, KVS_VERB_SET},
+	[KVS_CMD_BGET] = {"BGET", "BGET", KVS_ENGINE_BPTREE, KVS_VERB_GET},
+	[KVS_CMD_BDEL] = {"BDEL", "BDEL", KVS_ENGINE_BPTREE, KVS_VERB_DEL},
+	[KVS_CMD_BMOD] = {"BMOD", "BMOD", KVS_ENGINE_BPTREE, KVS_VERB_MOD},
+	[KVS_CMD_BMGET] = {"BMGET", "BMGET", KVS_ENGINE_BPTREE, KVS_VERB_GET, 1},
+	[KVS_CMD_BMSET] = {"BMSET", "BMSET", KVS_ENGINE_BPTREE, KVS_VERB_SET, 1},
+	[KVS_CMD_BMDEL] = {"BMDEL", "BMDEL", KVS_ENGINE_BPTREE, KVS_VERB_DEL, 1},
+	[KVS_CMD_BSCAN] = {"BSCAN", "BSCAN", KVS_ENGINE_BPTREE, KVS_VERB_RANGE},
+	[KVS_CMD_BRANGE] = {"BRANGE", "BRANGE", KVS_ENGINE_BPTREE, KVS_VERB_RANGE},
+	[KVS_CMD_BREVRANGE] = {"BREVRANGE", "BREVRANGE", KVS_ENGINE_BPTREE, KVS_VERB_RANGE},
+	[KVS_CMD_LSET] = {"LSET", "LSET", KVS_ENGINE_SKIPLIST, KVS_VERB_SET},
+	[KVS_CMD_LGET] = {"LGET", "LGET", KVS_ENGINE_SKIPLIST, KVS_VERB_GET},
+	[KVS_CMD_LDEL] = {"LDEL", "LDEL", KVS_ENGINE_SKIPLIST, KVS_VERB_DEL},
+	[KVS_CMD_LMOD] = {"LMOD", "LMOD", KVS_ENGINE_SKIPLIST, KVS_VERB_MOD},
+	[KVS_CMD_LMGET] = {"LMGET", "LMGET", KVS_ENGINE_SKIPLIST, KVS_VERB_GET, 1},
+	[KVS_CMD_LMSET] = {"LMSET", "LMSET", KVS_ENGINE_SKIPLIST, KVS_VERB_SET, 1},
+	[KVS_CMD_LMDEL] = {"LMDEL", "LMDEL", KVS_ENGINE_SKIPLIST, KVS_VERB_DEL, 1},
+	[KVS_CMD_LSCAN] = {"LSCAN", "LSCAN", KVS_ENGINE_SKIPLIST, KVS_VERB_RANGE},
+	[KVS_CMD_LRANGE] = {"LRANGE", "LRANGE", KVS_ENGINE_SKIPLIST, KVS_VERB_RANGE},
+	[KVS_CMD_LREVRANGE] = {"LREVRANGE", "LREVRANGE", KVS_ENGINE_SKIPLIST, KVS_VERB_RANGE},
+	[KVS_CMD_RPREFIX] = {"RPREFIX", "RPREFIX", KVS_ENGINE_RBTREE, KVS_VERB_RANGE},
+	[KVS_CMD_BPREFIX] = {"BPREFIX", "BPREFIX", KVS_ENGINE_BPTREE, KVS_VERB_RANGE},
+	[KVS_CMD_LPREFIX] = {"LPREFIX", "LPREFIX", KVS_ENGINE_SKIPLIST, KVS_VERB_RANGE},
+	[KVS_CMD_ASET] = {"ASET", "ASET", KVS_ENGINE_ART, KVS_VERB_SET},
+	[KVS_CMD_AGET] = {"AGET", "AGET", KVS_ENGINE_ART, KVS_VERB_GET},
+	[KVS_CMD_ADEL] = {"ADEL", "ADEL", KVS_ENGINE_ART, KVS_VERB_DEL},
+	[KVS_CMD_AMOD] = {"AMOD", "AMOD", KVS_ENGINE_ART, KVS_VERB_MOD},
+	[KVS_CMD_AMGET] = {"AMGET", "AMGET", KVS_ENGINE_ART, KVS_VERB_GET, 1},
+	[KVS_CMD_AMSET] = {"AMSET", "AMSET", KVS_ENGINE_ART, KVS_VERB_SET, 1},
+	[KVS_CMD_AMDEL] = {"AMDEL", "AMDEL", KVS_ENGINE_ART, KVS_VERB_DEL, 1},
+	[KVS_CMD_ASCAN] = {"ASCAN", "ASCAN", KVS_ENGINE_ART, KVS_VERB_RANGE},
+	[KVS_CMD_ARANGE] = {"ARANGE", "ARANGE", KVS_ENGINE_ART, KVS_VERB_RANGE},
+	[KVS_CMD_AREVRANGE] = {"AREVRANGE", "AREVRANGE", KVS_ENGINE_ART, KVS_VERB_RANGE},
+	[KVS_CMD_APREFIX] = {"APREFIX", "APREFIX", KVS_ENGINE_ART, KVS_VERB_RANGE},
 };
 
+/*
+ * command names are found with a perfect hash: the seed is searched once
+ * at startup so that every name owns a slot, a lookup is then one hash and
+ * one compare.
+ */
+#define KVS_CMD_SLOTS		256
+#define KVS_CMD_SEEDS		(1 << 20)
+
+static int kvs_cmd_ready;
+static uint32_t kvs_cmd_seed;
+static uint8_t kvs_cmd_slots[KVS_CMD_SLOTS];	// opcode + 1, 0 is empty
+static pthread_once_t kvs_cmd_once = PTHREAD_ONCE_INIT;
+
+static inline uint32_t kvs_cmd_hash(uint32_t seed, const char *name, size_t len) {
+	uint32_t h = seed ^ 0x811c9dc5;
+	while(len --) {
+		h ^= (uint8_t)*name ++;
+		h *= 0x01000193;
+	}
+	return (h ^ (h >> 16)) & (KVS_CMD_SLOTS - 1);
+}
+
+static void kvs_cmd_build(void) {
+	uint32_t seed = 0;
+	for(seed = 0; seed < KVS_CMD_SEEDS; seed ++) {
+		memset(kvs_cmd_slots, 0, sizeof(kvs_cmd_slots));
+
+		int cmd = 0;
+		for(cmd = 0; cmd < KVS_CMD_COUNT; cmd ++) {
+			const char *name = kvs_cmds[cmd].name;
+			uint32_t slot = kvs_cmd_hash(seed, name, strlen(name));
+			if(kvs_cmd_slots[slot]) break;
+			kvs_cmd_slots[slot] = cmd + 1;
+		}
+		if(cmd == KVS_CMD_COUNT) {
+			kvs_cmd_seed = seed;
+			kvs_cmd_ready = 1;
+			return;
+		}
+	}
+	memset(kvs_cmd_slots, 0, sizeof(kvs_cmd_slots));
+}
+
+// opcode of a command name, KVS_CMD_COUNT if there is none
+static int kvs_cmd_lookup(const char *name, size_t len) {
+	int cmd = kvs_cmd_slots[kvs_cmd_hash(kvs_cmd_seed, name, len)] - 1;
+	if(cmd < 0) return KVS_CMD_COUNT;
+	if(strncmp(kvs_cmds[cmd].name, name, len) || kvs_cmds[cmd].name[len]) return KVS_CMD_COUNT;
+	return cmd;
+}
+
 int spdk_entry(int argc, char *argv[]);
 
+// returns MAX_TOKENS + 1 when the line holds more tokens than fit
 static int kvs_split_tokens(char **tokens, char *msg) {
-	
+
 	int count = 0;
-	char *token = token = strtok(msg, " ");
+	char *saveptr = NULL;
+	char *token = strtok_r(msg, " ", &saveptr);
 	while(token) {
+		if(count == MAX_TOKENS) return count + 1;
 		 tokens[count ++] = token;
-		 token = strtok(NULL, " ");
+		 token = strtok_r(NULL, " ", &saveptr);
 	};
-	
+
 	return count;
 }
 
-static int kvs_proto_parser(char *msg, char **tokens, int count) {
-	if(!msg || !tokens || count <= 0) return -1;
+/*
+ * engines are per thread, every reactor initializes its own set and only
+ * executes ops for the keys it owns.
+ */
+int kvstore_init(void) {
+	pthread_once(&kvs_cmd_once, kvs_cmd_build);
+	if(!kvs_cmd_ready) {
+		KVS_ERRLOG("Failed building the command table\n");
+		return -1;
+	}
 
-	int cmd = 0;
+	int i = 0;
+	for(i = 0; i < KVS_ENGINE_COUNT; i ++) {
+		if(kvs_engines[i]->init()) {
+			KVS_ERRLOG("Failed initial %s\n", kvs_engines[i]->name);
+			return -1;
+		}
+	}
+	return 0;
+}
 
-	for(cmd = 0; cmd < KVS_CMD_COUNT; cmd ++) {
-		if(strcmp(tokens[0], commands[cmd]) == 0) break;
+void kvstore_destroy(void) {
+	int i = 0;
+	for(i = 0; i < KVS_ENGINE_COUNT; i ++) {
+		kvs_engines[i]->destroy();
 	}
+}
 
-	int res = 0;
-	char *value = NULL;
-	switch(cmd) {
-		case KVS_CMD_SET:
-			res = kv_array_set(tokens[1], tokens[2]);
-			if(res) {
-				snprintf(msg, BUFFER_SIZE, "SET FAILED");
-			} else {
-				snprintf(msg, BUFFER_SIZE, "SET SUCCESS");
-			}
-			return 11 + (res == 0);
-		case KVS_CMD_GET:
-			value = kv_array_get(tokens[1]);
-			if(!value) {
-				snprintf(msg, BUFFER_SIZE, "GET FAILED");
-				return 12;
-			} else {
-				snprintf(msg, BUFFER_SIZE, "%s", value);
-				return strlen(value) + 1;
-			}
-			assert(0);
-			break;
-		case KVS_CMD_DEL:
-			res = kv_array_delete(tokens[1]);
-			if(res) {
-				snprintf(msg, BUFFER_SIZE, "DEL FAILED");
-			} else {
-				snprintf(msg, BUFFER_SIZE, "DEL SUCCESS");
-			}
-			return 11 + (res == 0);
-		case KVS_CMD_MOD:
-			res = kv_array_modify(tokens[1], tokens[2]);
-			if(res) {
-				snprintf(msg, BUFFER_SIZE, "MOD FAILED");	
-			} else {
-				snprintf(msg, BUFFER_SIZE, "MOD SUCCESS");
-			}
-			return 11 + (res == 0);
-		case KVS_CMD_HSET:
-			res = kv_hash_set(tokens[1], tokens[2]);
-			if(res) {
-				snprintf(msg, BUFFER_SIZE, "HSET FAILED");
-			} else {
-				snprintf(msg, BUFFER_SIZE, "HSET SUCCESS");
-			}
-			return 12 + (res == 0);
-		case KVS_CMD_HGET:
-			value = kv_hash_get(tokens[1]);
-			if(!value) {
-				snprintf(msg, BUFFER_SIZE, "HGET FAILED");
-				return 13;
-			} else {
-				snprintf(msg, BUFFER_SIZE, "%s", value);
-				return strlen(value) + 1;
-			}
-			assert(0);
-			break;
-		case KVS_CMD_HDEL:
-			res = kv_hash_delete(tokens[1]);
-			if(res) {
-				snprintf(msg, BUFFER_SIZE, "HDEL FAILED");
-			} else {
-				snprintf(msg, BUFFER_SIZE, "HDEL SUCCESS");
-			}
-			return 12 + (res == 0);
-		case KVS_CMD_HMOD:
-			res = kv_hash_modify(tokens[1], tokens[2]);
-			if(res) {
-				snprintf(msg, BUFFER_SIZE, "HMOD FAILED");	
-			} else {
-				snprintf(msg, BUFFER_SIZE, "HMOD SUCCESS");
-			}
-			return 12 + (res == 0);
-			break;
-		case KVS_CMD_RSET:
-			res = kv_rbtree_set(tokens[1], tokens[2]);
-			if(res) {
-				snprintf(msg, BUFFER_SIZE, "SET FAILED");
-			} else {
-				snprintf(msg, BUFFER_SIZE, "SET SUCCESS");
-			}
-			return 11 + (res == 0);
-		case KVS_CMD_RGET:
-			value = kv_rbtree_get(tokens[1]);
-			if(!value) {
-				snprintf(msg, BUFFER_SIZE, "GET FAILED");
-				return 12;
-			} else {
-				snprintf(msg, BUFFER_SIZE, "%s", value);
-				return strlen(value) + 1;
-			}
-			assert(0);
-			break;
-		case KVS_CMD_RDEL:
-			res = kv_rbtree_delete(tokens[1]);
-			if(res) {
-				snprintf(msg, BUFFER_SIZE, "DEL FAILED");
-			} else {
-				snprintf(msg, BUFFER_SIZE, "DEL SUCCESS");
+// give the engines of this thread their background work, returns work done
+int kvstore_tick(void) {
+	int work = 0;
+	int i = 0;
+	for(i = 0; i < KVS_ENGINE_COUNT; i ++) {
+		if(kvs_engines[i]->tick) work += kvs_engines[i]->tick();
+	}
+	return work;
+}
+
+/* one handler per verb, the engine is whatever the op names */
+typedef int (*kvs_handler_fn)(const kvs_engine_t *engine, kvs_op_t *op);
+
+static int kvs_handle_set(const kvs_engine_t *engine, kvs_op_t *op) {
+	return engine->set(op->key, op->klen, op->value, op->vlen);
+}
+
+static int kvs_handle_get(const kvs_engine_t *engine, kvs_op_t *op) {
+	kv_value_t *found = engine->get(op->key, op->klen);
+	if(!found) return -1;
+	op->result = found;
+	return 0;
+}
+
+static int kvs_handle_del(const kvs_engine_t *engine, kvs_op_t *op) {
+	return engine->del(op->key, op->klen);
+}
+
+static int kvs_handle_mod(const kvs_engine_t *engine, kvs_op_t *op) {
+	int ret = engine->mod(op->key, op->klen, op->value, op->vlen);
+	if(ret && (op->flags & KVS_OP_UPSERT)) {
+		ret = engine->set(op->key, op->klen, op->value, op->vlen);
+	}
+	return ret;
+}
+
+static const kvs_handler_fn kvs_handlers[KVS_VERB_COUNT] = {
+	[KVS_VERB_SET] = kvs_handle_set,
+	[KVS_VERB_GET] = kvs_handle_get,
+	[KVS_VERB_DEL] = kvs_handle_del,
+	[KVS_VERB_MOD] = kvs_handle_mod,
+	[KVS_VERB_RANGE] = kvstore_range_execute,
+};
+
+/*
+ * hand a run of consecutive GETs to the engine's group lookup, returns the
+ * number of ops consumed. ops[0] always starts the run, so it is filled in
+ * before the loop and the arrays are never passed empty.
+ */
+#define KVS_OP_GROUP		64
+
+static int kvs_execute_gets(const kvs_engine_t *e, kvs_op_t **ops, int nops) {
+	const char *keys[KVS_OP_GROUP];
+	size_t klens[KVS_OP_GROUP];
+	kv_value_t *values[KVS_OP_GROUP];
+
+	keys[0] = ops[0]->key;
+	klens[0] = ops[0]->klen;
+
+	int n = 1;
+	for(; n < nops && n < KVS_OP_GROUP; n ++) {
+		if(ops[n]->engine != ops[0]->engine || ops[n]->verb != KVS_VERB_GET) break;
+		keys[n] = ops[n]->key;
+		klens[n] = ops[n]->klen;
+	}
+
+	e->mget(keys, klens, values, n);
+
+	int i = 0;
+	for(i = 0; i < n; i ++) {
+		ops[i]->result = values[i];
+		ops[i]->status = values[i] ? 0 : -1;
+	}
+	return n;
+}
+
+// the same for a run of consecutive SETs and the engine's bulk insert
+static int kvs_execute_sets(const kvs_engine_t *e, kvs_op_t **ops, int nops) {
+	const char *keys[KVS_OP_GROUP];
+	size_t klens[KVS_OP_GROUP];
+	const char *values[KVS_OP_GROUP];
+	size_t vlens[KVS_OP_GROUP];
+	int status[KVS_OP_GROUP];
+
+	keys[0] = ops[0]->key;
+	klens[0] = ops[0]->klen;
+	values[0] = ops[0]->value;
+	vlens[0] = ops[0]->vlen;
+
+	int n = 1;
+	for(; n < nops && n < KVS_OP_GROUP; n ++) {
+		if(ops[n]->engine != ops[0]->engine || ops[n]->verb != KVS_VERB_SET) break;
+		keys[n] = ops[n]->key;
+		klens[n] = ops[n]->klen;
+		values[n] = ops[n]->value;
+		vlens[n] = ops[n]->vlen;
+	}
+
+	e->mset(keys, klens, values, vlens, status, n);
+
+	int i = 0;
+	for(i = 0; i < n; i ++) {
+		ops[i]->status = status[i];
+	}
+	return n;
+}
+
+/*
+ * run ops against this thread's engines. must be called on the shard owning
+ * their keys. consecutive ops on one engine share a single acquisition of
+ * its lock, so a batch command, or a pipeline of single key commands, pays
+ * for one lock round trip per engine rather than one per key. a found value
+ * comes back referenced, so the owner may replace it while the reply is
+ * still being sent. runs of GETs and SETs go to the engine's group lookup
+ * and bulk insert when it has them.
+ */
+void kvstore_execute_ops(kvs_op_t **ops, int nops) {
+	int i = 0;
+	while(i < nops) {
+		int engine = ops[i]->engine;
+		if(engine < 0 || engine >= KVS_ENGINE_COUNT) {
+			ops[i ++]->status = -1;
+			continue;
+		}
+
+		const kvs_engine_t *e = kvs_engines[engine];
+		if(e->lock) e->lock();
+		while(i < nops && ops[i]->engine == engine) {
+			kvs_op_t *op = ops[i];
+			if(e->mget && op->verb == KVS_VERB_GET) {
+				i += kvs_execute_gets(e, ops + i, nops - i);
+				continue;
 			}
-			return 11 + (res == 0);
-		case KVS_CMD_RMOD:
-			res = kv_rbtree_modify(tokens[1], tokens[2]);
-			if(res) {
-				snprintf(msg, BUFFER_SIZE, "MOD FAILED");	
-			} else {
-				snprintf(msg, BUFFER_SIZE, "MOD SUCCESS");
+			if(e->mset && op->verb == KVS_VERB_SET) {
+				i += kvs_execute_sets(e, ops + i, nops - i);
+				continue;
 			}
-			return 11 + (res == 0);
-			break;
+
+			op->status = -1;
+			i ++;
+			if(!op->key || op->verb < 0 || op->verb >= KVS_VERB_COUNT) continue;
+			op->status = kvs_handlers[op->verb](e, op);
+		}
+		if(e->unlock) e->unlock();
 	}
-	return 0;
+}
+
+void kvstore_execute_op(kvs_op_t *op) {
+	kvstore_execute_ops(&op, 1);
+}
+
+// point op at the engine and verb of a wire opcode
+static void kvs_op_command(kvs_op_t *op, int cmd) {
+	op->engine = kvs_cmds[cmd].engine;
+	op->verb = kvs_cmds[cmd].verb;
+}
+
+
+kvs_request_t *kvstore_request_alloc(int proto, int verb, int nops, size_t bytes) {
+	size_t head = sizeof(kvs_request_t) + nops * sizeof(kvs_op_t);
+	kvs_request_t *req = kvstore_malloc(head + bytes);
+	if(!req) return NULL;
+
+	memset(req, 0, head);
+	req->proto = proto;
+	req->verb = verb;
+	req->nops = nops;
+	req->pending = nops;
+	req->data = (char *)req + head;
+
+	int i = 0;
+	for(i = 0; i < nops; i ++) {
+		req->ops[i].req = req;
+	}
+	return req;
+}
+
+// copy len bytes into the request's own storage and terminate them
+char *kvstore_request_copy(kvs_request_t *req, const char *src, size_t len) {
+	char *dst = req->data + req->data_len;
+	memcpy(dst, src, len);
+	dst[len] = '\0';
+	req->data_len += len + 1;
+	return dst;
+}
+
+void kvstore_request_free(kvs_request_t *req) {
+	int i = 0;
+	for(i = 0; i < req->nops; i ++) {
+		if(req->ops[i].result) kv_value_put(req->ops[i].result);
+		if(req->ops[i].range) kvstore_range_free(req->ops[i].range);
+	}
+	kvstore_free(req);
 }
 
 
-int kvstore_request(char *msg, ssize_t len) {
-	
+static int kvs_text_parse_line(char *msg, struct kvs_request_queue *queue) {
+
 	char *tokens[MAX_TOKENS] = {0};
-	
+
 	int count = kvs_split_tokens(tokens, msg);
+	int more = count > MAX_TOKENS;
+	if(more) count = MAX_TOKENS;
 	int i = 0;
 	for(i = 0; i < count; i ++) {
-		printf("token %d : %s\n", i, tokens[i]);
+		KVS_DEBUGLOG("token %d : %s\n", i, tokens[i]);
+	}
+
+	int cmd = KVS_CMD_COUNT;
+	if(count > 0) {
+		cmd = kvs_cmd_lookup(tokens[0], strlen(tokens[0]));
+	}
+
+	// unknown commands get no answer, a batch with a bad argument count fails
+	const kvs_cmd_def_t *def = cmd < KVS_CMD_COUNT ? &kvs_cmds[cmd] : NULL;
+	if(def && def->verb == KVS_VERB_RANGE) {
+		kvs_request_t *req = kvstore_range_parse(KVS_PROTO_TEXT, cmd, cmd, def->engine,
+			tokens + 1, NULL, count - 1);
+		if(!req) return -1;
+		TAILQ_INSERT_TAIL(queue, req, link);
+		return 0;
+	}
+	int stride = def && def->verb == KVS_VERB_SET ? 2 : 1;
+	int nops = 0;
+	if(def && def->batch) {
+		if(count > 1 && (count - 1) % stride == 0) nops = (count - 1) / stride;
+	} else if(def) {
+		nops = 1;
+	}
+	// a batch over KVS_MAX_BATCH keys fails whole, none of it runs
+	if(more) nops = 0;
+	// keys longer than the binary protocol and range cursors can carry fail the command
+	for(i = 0; i < nops; i ++) {
+		char *key = def->batch ? tokens[1 + i * stride] : tokens[1];
+		if(key && strlen(key) > KVS_MAX_KEY_LEN) nops = 0;
+	}
+
+	size_t bytes = 0;
+	for(i = 1; i < count; i ++) {
+		bytes += strlen(tokens[i]) + 1;
+	}
+
+	kvs_request_t *req = kvstore_request_alloc(KVS_PROTO_TEXT, cmd, nops, bytes);
+	if(!req) return -1;
+
+	for(i = 0; i < nops; i ++) {
+		kvs_op_t *op = &req->ops[i];
+		char *key = def->batch ? tokens[1 + i * stride] : tokens[1];
+		char *value = def->batch ? (stride == 2 ? tokens[2 + i * 2] : NULL) : tokens[2];
+
+		kvs_op_command(op, cmd);
+		if(key) {
+			op->klen = strlen(key);
+			op->key = kvstore_request_copy(req, key, op->klen);
+		}
+		if(value) {
+			op->vlen = strlen(value);
+			op->value = kvstore_request_copy(req, value, op->vlen);
+		}
+	}
+	TAILQ_INSERT_TAIL(queue, req, link);
+
+	return 0;
+}
+
+/*
+ * one command per line, a trailing CR is dropped. returns the bytes of the
+ * complete lines, a partial line is left for the next receive.
+ */
+static ssize_t kvs_text_parse(char *msg, size_t len, struct kvs_request_queue *queue) {
+	char *pos = msg;
+	char *end = msg + len;
+
+	while(pos < end) {
+		char *nl = memchr(pos, '\n', end - pos);
+		if(!nl) break;
+
+		char *line_end = nl > pos && nl[-1] == '\r' ? nl - 1 : nl;
+		*line_end = '\0';
+		if(line_end > pos && kvs_text_parse_line(pos, queue)) return -1;
+
+		pos = nl + 1;
+	}
+
+	return pos - msg;
+}
+
+/*
+ * MGET answers the values separated by spaces, (nil) for a missing key.
+ * MSET succeeds when every key was stored, MDEL answers the deleted count.
+ */
+static int kvs_text_encode_batch(kvs_request_t *req, kvs_out_t *out) {
+	const kvs_cmd_def_t *def = &kvs_cmds[req->verb];
+	int i = 0, ok = 0;
+
+	if(def->verb == KVS_VERB_GET && req->nops) {
+		for(i = 0; i < req->nops; i ++) {
+			kvs_op_t *op = &req->ops[i];
+			if(i && kvs_out_append(out, " ", 1)) return -1;
+			if(op->status == 0 && op->result) {
+				if(kvs_out_value(out, op->result, op->result->len)) return -1;
+			} else if(kvs_out_append(out, "(nil)", 5)) {
+				return -1;
+			}
+		}
+		return kvs_out_append(out, "", 1);
+	}
+
+	for(i = 0; i < req->nops; i ++) {
+		ok += req->ops[i].status == 0;
+	}
+
+	char msg[BUFFER_SIZE];
+	int len = 0;
+	if(def->verb == KVS_VERB_DEL && req->nops) {
+		len = snprintf(msg, BUFFER_SIZE, "%s %d", def->reply, ok) + 1;
+	} else {
+		len = snprintf(msg, BUFFER_SIZE, "%s %s", def->reply,
+			req->nops && ok == req->nops ? "SUCCESS" : "FAILED") + 1;
 	}
-	return kvs_proto_parser(msg, tokens, count); 
+	return kvs_out_append(out, msg, len);
 }
 
+static int kvs_text_encode(kvs_request_t *req, kvs_out_t *out) {
+	if(req->verb >= KVS_CMD_COUNT) return 0;
+	if(kvs_cmds[req->verb].batch) return kvs_text_encode_batch(req, out);
+	if(kvs_cmds[req->verb].verb == KVS_VERB_RANGE) {
+		return kvstore_range_encode(req, kvs_cmds[req->verb].reply, out);
+	}
+
+	// a command the parser rejected carries no op
+	kvs_op_t *op = req->nops ? &req->ops[0] : NULL;
+	if(op && op->status == 0 && op->result) {
+		// the stored terminator goes out too
+		return kvs_out_value(out, op->result, op->result->len + 1);
+	}
+
+	char msg[BUFFER_SIZE];
+	int len = snprintf(msg, BUFFER_SIZE, "%s %s", kvs_cmds[req->verb].reply,
+		!op || op->status ? "FAILED" : "SUCCESS") + 1;
+	return kvs_out_append(out, msg, len);
+}
+
+
+// make room for len more bytes after buf->len
+int kvs_buf_reserve(kvs_buf_t *buf, size_t len) {
+	if(buf->len + len <= buf->cap) return 0;
 
-static int kvstore_response(void) {
-    return 0;
+	if(buf->pos) {
+		memmove(buf->data, buf->data + buf->pos, buf->len - buf->pos);
+		buf->len -= buf->pos;
+		buf->pos = 0;
+		if(buf->len + len <= buf->cap) return 0;
+	}
+
+	size_t cap = buf->cap ? buf->cap : BUFFER_SIZE;
+	while(cap < buf->len + len) cap <<= 1;
+
+	char *data_new = kvstore_malloc(cap);
+	if(!data_new) return -1;
+	if(buf->data) {
+		memcpy(data_new, buf->data, buf->len);
+		kvstore_free(buf->data);
+	}
+	buf->data = data_new;
+	buf->cap = cap;
+	return 0;
+}
+
+int kvs_buf_append(kvs_buf_t *buf, const void *data, size_t len) {
+	if(kvs_buf_reserve(buf, len)) return -1;
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+	return 0;
+}
+
+void kvs_buf_consume(kvs_buf_t *buf, size_t len) {
+	buf->pos += len;
+	if(buf->pos >= buf->len) {
+		buf->pos = buf->len = 0;
+	}
+}
+
+void kvs_buf_free(kvs_buf_t *buf) {
+	if(buf->data) kvstore_free(buf->data);
+	buf->data = NULL;
+	buf->pos = buf->len = buf->cap = 0;
+}
+
+
+static kvs_seg_t *kvs_out_seg(kvs_out_t *out) {
+	if(out->nsegs == out->max_segs) {
+		int max_segs = out->max_segs ? out->max_segs * 2 : 16;
+		kvs_seg_t *segs = kvstore_malloc(max_segs * sizeof(kvs_seg_t));
+		if(!segs) return NULL;
+		if(out->segs) {
+			memcpy(segs, out->segs, out->nsegs * sizeof(kvs_seg_t));
+			kvstore_free(out->segs);
+		}
+		out->segs = segs;
+		out->max_segs = max_segs;
+	}
+	return &out->segs[out->nsegs ++];
+}
+
+int kvs_out_append(kvs_out_t *out, const void *data, size_t len) {
+	size_t off = out->buf.len;
+	if(kvs_buf_append(&out->buf, data, len)) return -1;
+	out->bytes += len;
+
+	// extend the previous segment if it ends where these bytes start
+	kvs_seg_t *last = out->nsegs ? &out->segs[out->nsegs - 1] : NULL;
+	if(last && !last->value && last->off + last->len == off) {
+		last->len += len;
+		return 0;
+	}
+
+	kvs_seg_t *seg = kvs_out_seg(out);
+	if(!seg) return -1;
+	seg->value = NULL;
+	seg->off = off;
+	seg->len = len;
+	return 0;
+}
+
+// send len bytes of value from where it is stored, holding a reference
+int kvs_out_value(kvs_out_t *out, kv_value_t *value, size_t len) {
+	if(len <= KVS_OUT_COPY_MAX) {
+		return kvs_out_append(out, value->data, len);
+	}
+
+	kvs_seg_t *seg = kvs_out_seg(out);
+	if(!seg) return -1;
+	seg->value = kv_value_get(value);
+	seg->off = 0;
+	seg->len = len;
+	out->bytes += len;
+	return 0;
+}
+
+void kvs_out_free(kvs_out_t *out) {
+	int i = 0;
+	for(i = 0; i < out->nsegs; i ++) {
+		if(out->segs[i].value) kv_value_put(out->segs[i].value);
+	}
+	if(out->segs) kvstore_free(out->segs);
+	kvs_buf_free(&out->buf);
+	out->segs = NULL;
+	out->nsegs = out->max_segs = 0;
+	out->bytes = 0;
+}
+
+
+static int kvs_bin_encode_batch(kvs_request_t *req, kvs_out_t *out) {
+	uint32_t total = 0;
+	int i = 0;
+	for(i = 0; i < req->nops; i ++) {
+		kvs_op_t *op = &req->ops[i];
+		total += sizeof(kvs_bin_entry_t) + (op->status == 0 && op->result ? op->result->len : 0);
+	}
+
+	kvs_bin_res_t res = {
+		.magic = KVS_BIN_MAGIC_RES,
+		.opcode = req->verb,
+		.status = htons(req->nops ? KVS_BIN_OK : KVS_BIN_EINVAL),
+		.vlen = htonl(total),
+	};
+	if(kvs_out_append(out, &res, sizeof(res))) return -1;
+
+	for(i = 0; i < req->nops; i ++) {
+		kvs_op_t *op = &req->ops[i];
+		kv_value_t *value = op->status == 0 ? op->result : NULL;
+		kvs_bin_entry_t entry = {
+			.status = htons(op->status ? KVS_BIN_FAILED : KVS_BIN_OK),
+			.vlen = htonl(value ? value->len : 0),
+		};
+		if(kvs_out_append(out, &entry, sizeof(entry))) return -1;
+		if(value && value->len && kvs_out_value(out, value, value->len)) return -1;
+	}
+	return 0;
+}
+
+static int kvs_bin_encode(kvs_request_t *req, kvs_out_t *out) {
+	if(req->verb < KVS_CMD_COUNT && kvs_cmds[req->verb].batch) {
+		return kvs_bin_encode_batch(req, out);
+	}
+	if(req->verb < KVS_CMD_COUNT && kvs_cmds[req->verb].verb == KVS_VERB_RANGE) {
+		return kvstore_range_encode(req, NULL, out);
+	}
+
+	int status = KVS_BIN_EINVAL;
+	kv_value_t *value = NULL;
+	if(req->nops) {
+		status = req->ops[0].status ? KVS_BIN_FAILED : KVS_BIN_OK;
+		value = req->ops[0].result;
+	}
+
+	uint32_t vlen = value ? value->len : 0;
+	kvs_bin_res_t res = {
+		.magic = KVS_BIN_MAGIC_RES,
+		.opcode = req->verb,
+		.status = htons(status),
+		.vlen = htonl(vlen),
+	};
+	if(kvs_out_append(out, &res, sizeof(res))) return -1;
+	if(vlen && kvs_out_value(out, value, vlen)) return -1;
+	return 0;
+}
+
+// count the | klen (2) | key | entries of a key section, -1 if they do not tile it
+static int kvs_bin_batch_keys(const char *ptr, size_t len) {
+	size_t off = 0;
+	int n = 0;
+	while(off < len) {
+		uint16_t klen = 0;
+		if(len - off < sizeof(klen) || n == KVS_MAX_BATCH) return -1;
+		memcpy(&klen, ptr + off, sizeof(klen));
+		klen = ntohs(klen);
+		if(klen > KVS_MAX_KEY_LEN || len - off - sizeof(klen) < klen) return -1;
+		off += sizeof(klen) + klen;
+		n ++;
+	}
+	return n;
+}
+
+// check that n | vlen (4) | value | entries tile a value section
+static int kvs_bin_batch_values(const char *ptr, size_t len, int n) {
+	size_t off = 0;
+	int i = 0;
+	for(i = 0; i < n; i ++) {
+		uint32_t vlen = 0;
+		if(len - off < sizeof(vlen)) return -1;
+		memcpy(&vlen, ptr + off, sizeof(vlen));
+		vlen = ntohl(vlen);
+		if(len - off - sizeof(vlen) < vlen) return -1;
+		off += sizeof(vlen) + vlen;
+	}
+	return off == len ? 0 : -1;
+}
+
+// one op per key of a batch frame, none if the frame is malformed
+static kvs_request_t *kvs_bin_batch(int opcode, char *kptr, size_t klen, char *vptr, size_t vlen) {
+	int values = kvs_cmds[opcode].verb == KVS_VERB_SET;
+	int n = kvs_bin_batch_keys(kptr, klen);
+	if(n <= 0 || (values ? kvs_bin_batch_values(vptr, vlen, n) : vlen != 0)) n = 0;
+
+	// each 2 or 4 byte length header leaves room for a terminator
+	kvs_request_t *req = kvstore_request_alloc(KVS_PROTO_BINARY, opcode, n, n ? klen + vlen : 0);
+	if(!req) return NULL;
+
+	int i = 0;
+	for(i = 0; i < n; i ++) {
+		kvs_op_t *op = &req->ops[i];
+		uint16_t kl = 0;
+		memcpy(&kl, kptr, sizeof(kl));
+		op->klen = ntohs(kl);
+		op->key = kvstore_request_copy(req, kptr + sizeof(kl), op->klen);
+		kptr += sizeof(kl) + op->klen;
+
+		if(values) {
+			uint32_t vl = 0;
+			memcpy(&vl, vptr, sizeof(vl));
+			op->vlen = ntohl(vl);
+			op->value = kvstore_request_copy(req, vptr + sizeof(vl), op->vlen);
+			vptr += sizeof(vl) + op->vlen;
+		}
+		kvs_op_command(op, opcode);
+	}
+	return req;
+}
+
+/*
+ * queue a request for every complete frame in msg.
+ * returns the number of bytes consumed, a trailing partial frame is left.
+ */
+ssize_t kvstore_binary_parse(char *msg, size_t len, struct kvs_request_queue *queue) {
+	size_t off = 0;
+
+	while(len - off >= sizeof(kvs_bin_req_t)) {
+		kvs_bin_req_t *hdr = (kvs_bin_req_t *)(msg + off);
+		if(hdr->magic != KVS_BIN_MAGIC_REQ) return -1;
+
+		size_t klen = ntohs(hdr->klen);
+		size_t vlen = ntohl(hdr->vlen);
+		size_t frame = sizeof(kvs_bin_req_t) + klen + vlen;
+		// checked on the header alone, before any of the body is buffered
+		if(frame > KVS_MAX_FRAME) return -1;
+		if(len - off < frame) break;
+
+		char *kptr = msg + off + sizeof(kvs_bin_req_t);
+		char *vptr = kptr + klen;
+
+		if(hdr->opcode < KVS_CMD_COUNT && (kvs_cmds[hdr->opcode].batch
+			|| kvs_cmds[hdr->opcode].verb == KVS_VERB_RANGE)) {
+			kvs_request_t *req = kvs_cmds[hdr->opcode].batch ?
+				kvs_bin_batch(hdr->opcode, kptr, klen, vptr, vlen) :
+				kvstore_range_binary(hdr->opcode, kvs_cmds[hdr->opcode].engine,
+					kptr, klen, vptr, vlen);
+			if(!req) return -1;
+			TAILQ_INSERT_TAIL(queue, req, link);
+			off += frame;
+			continue;
+		}
+
+		// invalid frames get an EINVAL reply without ops
+		int nops = hdr->opcode < KVS_CMD_COUNT && klen <= KVS_MAX_KEY_LEN;
+		kvs_request_t *req = kvstore_request_alloc(KVS_PROTO_BINARY, hdr->opcode, nops,
+			nops ? klen + vlen + 2 : 0);
+		if(!req) return -1;
+
+		if(nops) {
+			kvs_op_command(&req->ops[0], hdr->opcode);
+			req->ops[0].key = kvstore_request_copy(req, kptr, klen);
+			req->ops[0].value = kvstore_request_copy(req, vptr, vlen);
+			req->ops[0].klen = klen;
+			req->ops[0].vlen = vlen;
+		}
+		TAILQ_INSERT_TAIL(queue, req, link);
+
+		off += frame;
+	}
+	return off;
+}
+
+
+/*
+ * split msg into requests for the connection's protocol and append them to
+ * queue. returns the bytes consumed or -1 on a protocol error.
+ */
+ssize_t kvstore_parse(int proto, char *msg, size_t len, int *db, struct kvs_request_queue *queue) {
+	switch(proto) {
+		case KVS_PROTO_BINARY:
+			return kvstore_binary_parse(msg, len, queue);
+		case KVS_PROTO_RESP:
+			return kvstore_resp_parse(msg, len, db, queue);
+		default:
+			return kvs_text_parse(msg, len, queue);
+	}
+}
+
+int kvstore_encode(kvs_request_t *req, kvs_out_t *out) {
+	switch(req->proto) {
+		case KVS_PROTO_BINARY:
+			return kvs_bin_encode(req, out);
+		case KVS_PROTO_RESP:
+			return kvstore_resp_encode(req, out);
+		default:
+			return kvs_text_encode(req, out);
+	}
+}
+
+
+void *kvstore_malloc(size_t size) {
+	return mymalloc(size);
+}
+
+void kvstore_free(void *ptr) {
+	myfree(ptr);
 }
 
 
 int main(int argc, char *argv[]) {
-	int ret = 0;
-	ret = kv_array_init();
-	if(ret) {
-		fprintf(stderr, "Failed initial array\n");
-		return 1;
-	}
-	ret = kv_rbtree_init();
-	if(ret) {
-		fprintf(stderr, "Failed initial rbtree\n");
-		return 1;
-	}
-	ret = kv_hash_init();
-	if(ret) {
-		fprintf(stderr, "Failed initial hash\n");
-		return 1;
-	}
-    spdk_entry(argc, argv);
-}
\ No newline at end of file
+    return spdk_entry(argc, argv);
+}
@@ -3,9 +3,194 @@
 
 #include <unistd.h>
 #include <assert.h>
+#include <stdint.h>
+#include <sys/queue.h>
 
-#define MAX_TOKENS	16
+#include "kvs_log.h"
+#include "engine/kv_value.h"
 
+#define KVS_MAX_KEY_LEN		250
+#define KVS_MAX_BATCH		256		// keys of one MGET/MSET/MDEL
+#define KVS_MAX_FRAME		(64 * 1024 * 1024)	// largest request of any protocol
+
+#define MAX_TOKENS	(1 + 2 * KVS_MAX_BATCH)
+
+/*
+ * binary protocol, all header fields in network byte order
+ *
+ * request:  | magic 0x80 | opcode | klen (2) | vlen (4) | key | value |
+ * response: | magic 0x81 | opcode | status (2) | vlen (4) | value |
+ *
+ * opcode is a kvs_cmd_t. frames are back-to-back, so a client may pipeline
+ * any number of requests in one send and read the replies in order.
+ *
+ * the batch opcodes (MGET, MSET, MDEL and their engine variants) carry n
+ * keys. the key section is n times | klen (2) | key |, MSET's value section
+ * holds one | vlen (4) | value | per key in the same order. the reply value
+ * is n times | status (2) | vlen (4) | value |, one per key.
+ *
+ * the range opcodes (RSCAN, RRANGE, RREVRANGE and their B variants) carry | slen (2) | start |
+ * elen (2) | end | as key and | limit (4) | cursor | as value, an empty
+ * bound is open and RSCAN has neither. RPREFIX and its variants carry the
+ * bare prefix as key. the reply value is | clen (2) |
+ * cursor | followed by | klen (2) | key | vlen (4) | value | per pair.
+ */
+#define KVS_BIN_MAGIC_REQ	0x80
+#define KVS_BIN_MAGIC_RES	0x81
+
+typedef enum {
+	KVS_BIN_OK = 0,
+	KVS_BIN_FAILED,
+	KVS_BIN_EINVAL,
+} kvs_bin_status_t;
+
+typedef struct kvs_bin_req_s {
+	uint8_t magic;
+	uint8_t opcode;
+	uint16_t klen;
+	uint32_t vlen;
+} __attribute__((packed)) kvs_bin_req_t;
+
+typedef struct kvs_bin_res_s {
+	uint8_t magic;
+	uint8_t opcode;
+	uint16_t status;
+	uint32_t vlen;
+} __attribute__((packed)) kvs_bin_res_t;
+
+// one key of a batch reply
+typedef struct kvs_bin_entry_s {
+	uint16_t status;
+	uint32_t vlen;
+} __attribute__((packed)) kvs_bin_entry_t;
+
+typedef enum {
+	KVS_PROTO_UNKNOWN = 0,
+	KVS_PROTO_TEXT,
+	KVS_PROTO_BINARY,
+	KVS_PROTO_RESP,
+} kvs_proto_t;
+
+/* RESP2 (redis protocol), SELECT picks the engine behind SET/GET/DEL */
+typedef enum {
+	KVS_RESP_DB_HASH = 0,
+	KVS_RESP_DB_RBTREE,
+	KVS_RESP_DB_ARRAY,
+	KVS_RESP_DB_SWISS,
+	KVS_RESP_DB_BPTREE,
+	KVS_RESP_DB_SKIPLIST,
+	KVS_RESP_DB_ART,
+	KVS_RESP_DB_COUNT,
+} kvs_resp_db_t;
+
+/*
+ * growable byte buffer. bytes are appended at len and consumed from pos,
+ * the unconsumed tail is moved back to the front before the buffer grows.
+ */
+typedef struct kvs_buf_s {
+	char *data;
+	size_t pos;
+	size_t len;
+	size_t cap;
+} kvs_buf_t;
+
+/*
+ * an encoded reply as a list of segments. protocol bytes are copied into
+ * buf, large values are referenced in place and put when the write of the
+ * reply completes.
+ */
+#define KVS_OUT_COPY_MAX	64	// smaller values are cheaper to copy
+
+typedef struct kvs_seg_s {
+	kv_value_t *value;	// NULL for bytes of buf
+	size_t off;
+	size_t len;
+} kvs_seg_t;
+
+typedef struct kvs_out_s {
+	kvs_buf_t buf;
+	kvs_seg_t *segs;
+	int nsegs;
+	int max_segs;
+	size_t bytes;
+} kvs_out_t;
+
+/*
+ * storage engines. every engine registers one operations table in
+ * kvstore.c and is driven only through it, requests name an engine by id.
+ */
+typedef enum {
+	KVS_ENGINE_ARRAY = 0,
+	KVS_ENGINE_HASH,
+	KVS_ENGINE_RBTREE,
+	KVS_ENGINE_SWISS,
+	KVS_ENGINE_BPTREE,
+	KVS_ENGINE_SKIPLIST,
+	KVS_ENGINE_ART,
+	KVS_ENGINE_COUNT,
+} kvs_engine_id_t;
+
+typedef enum {
+	KVS_VERB_SET = 0,
+	KVS_VERB_GET,
+	KVS_VERB_DEL,
+	KVS_VERB_MOD,
+	KVS_VERB_RANGE,
+	KVS_VERB_COUNT,
+} kvs_verb_t;
+
+typedef struct kvs_engine_stats_s {
+	size_t count;
+	size_t bytes;		// key and value bytes
+} kvs_engine_stats_t;
+
+// scan callback, a non zero return stops the scan and is returned by it
+typedef int (*kvs_scan_fn)(const kv_key_t *key, kv_value_t *value, void *arg);
+
+typedef struct kvs_engine_s {
+	const char *name;
+
+	int (*init)(void);
+	void (*destroy)(void);
+
+	// set/get/del/mod run between lock and unlock, once per batch of ops
+	void (*lock)(void);
+	void (*unlock)(void);
+
+	int (*set)(const char *key, size_t klen, const char *value, size_t vlen);
+	kv_value_t *(*get)(const char *key, size_t klen);	// referenced
+	int (*del)(const char *key, size_t klen);
+	int (*mod)(const char *key, size_t klen, const char *value, size_t vlen);
+
+	// optional, n gets at once with their memory accesses interleaved
+	void (*mget)(const char **keys, const size_t *klens, kv_value_t **values, int n);
+	// optional, n sets at once, status of each as set would return it
+	void (*mset)(const char **keys, const size_t *klens, const char **values,
+		const size_t *vlens, int *status, int n);
+
+	int (*scan)(kvs_scan_fn fn, void *arg);
+	/*
+	 * optional, ordered engines. calls fn on the keys between start and end
+	 * in key order, descending with KVS_OP_REVERSE, until fn returns non
+	 * zero. end NULL is unbounded, the KVS_OP_*_EXCL flags drop a bound.
+	 */
+	int (*range)(const char *start, size_t slen, const char *end, size_t elen,
+		int flags, kvs_scan_fn fn, void *arg);
+	void (*stats)(kvs_engine_stats_t *stats);
+
+	// optional, background work run by the reactor poller, returns work done
+	int (*tick)(void);
+} kvs_engine_t;
+
+extern const kvs_engine_t kv_array_engine;
+extern const kvs_engine_t kv_hash_engine;
+extern const kvs_engine_t kv_rbtree_engine;
+extern const kvs_engine_t kv_swiss_engine;
+extern const kvs_engine_t kv_bptree_engine;
+extern const kvs_engine_t kv_skiplist_engine;
+extern const kvs_engine_t kv_art_engine;
+
+/* wire opcodes of the text and binary protocols, see kvs_cmds in kvstore.c */
 typedef enum {
 	KVS_CMD_START = 0,
 	KVS_CMD_SET = KVS_CMD_START,
@@ -20,36 +205,269 @@ typedef enum {
 	KVS_CMD_RGET,
 	KVS_CMD_RDEL,
 	KVS_CMD_RMOD,
+	KVS_CMD_MGET,
+	KVS_CMD_MSET,
+	KVS_CMD_MDEL,
+	KVS_CMD_HMGET,
+	KVS_CMD_HMSET,
+	KVS_CMD_HMDEL,
+	KVS_CMD_RMGET,
+	KVS_CMD_RMSET,
+	KVS_CMD_RMDEL,
+	KVS_CMD_SSET,
+	KVS_CMD_SGET,
+	KVS_CMD_SDEL,
+	KVS_CMD_SMOD,
+	KVS_CMD_SMGET,
+	KVS_CMD_SMSET,
+	KVS_CMD_SMDEL,
+	KVS_CMD_RSCAN,
+	KVS_CMD_RRANGE,
+	KVS_CMD_RREVRANGE,
+	KVS_CMD_BSET,
+	KVS_CMD_BGET,
+	KVS_CMD_BDEL,
+	KVS_CMD_BMOD,
+	KVS_CMD_BMGET,
+	KVS_CMD_BMSET,
+	KVS_CMD_BMDEL,
+	KVS_CMD_BSCAN,
+	KVS_CMD_BRANGE,
+	KVS_CMD_BREVRANGE,
+	KVS_CMD_LSET,
+	KVS_CMD_LGET,
+	KVS_CMD_LDEL,
+	KVS_CMD_LMOD,
+	KVS_CMD_LMGET,
+	KVS_CMD_LMSET,
+	KVS_CMD_LMDEL,
+	KVS_CMD_LSCAN,
+	KVS_CMD_LRANGE,
+	KVS_CMD_LREVRANGE,
+	KVS_CMD_RPREFIX,
+	KVS_CMD_BPREFIX,
+	KVS_CMD_LPREFIX,
+	KVS_CMD_ASET,
+	KVS_CMD_AGET,
+	KVS_CMD_ADEL,
+	KVS_CMD_AMOD,
+	KVS_CMD_AMGET,
+	KVS_CMD_AMSET,
+	KVS_CMD_AMDEL,
+	KVS_CMD_ASCAN,
+	KVS_CMD_ARANGE,
+	KVS_CMD_AREVRANGE,
+	KVS_CMD_APREFIX,
 	KVS_CMD_COUNT,
 } kvs_cmd_t;
 
 
+/* op flags */
+#define KVS_OP_UPSERT		0x1	/* MOD falling back to SET */
+#define KVS_OP_REVERSE		0x2	/* RANGE walks from end down to start */
+#define KVS_OP_START_EXCL	0x4	/* RANGE leaves out the start key */
+#define KVS_OP_END_EXCL		0x8	/* RANGE leaves out the end key */
+#define KVS_OP_PINNED		0x10	/* shard chosen by the parser, not by the key */
+
+/*
+ * range commands. every shard holds a hash slice of the keyspace, so a
+ * RANGE request has one op per shard and their ordered results are merged
+ * into the reply. see kvs_range.c.
+ */
+#define KVS_RANGE_MAX		1000	// pairs per reply
+#define KVS_RANGE_DEFAULT	10	// when no limit is given
+
+typedef struct kvs_range_s kvs_range_t;
+
+typedef struct kvs_request_s kvs_request_t;
+
+/*
+ * a single key operation. ops are executed on the shard that owns the key,
+ * which may not be the reactor that parsed them.
+ */
+typedef struct kvs_op_s {
+	int engine;
+	int verb;
+	int flags;
+	int status;
+	int shard;
+
+	char *key;		// klen bytes, values are binary
+	char *value;
+	size_t klen;
+	size_t vlen;
+	kv_value_t *result;	// GET family: referenced value, put with the request
+	int limit;		// RANGE: pairs to collect
+	kvs_range_t *range;	// RANGE: collected pairs, freed with the request
+
+	kvs_request_t *req;
+} kvs_op_t;
+
+/*
+ * one parsed client command. its reply is encoded once every op has
+ * completed, requests of a connection are answered in arrival order.
+ */
+struct kvs_request_s {
+	int proto;
+	int verb;
+	int nops;
+	int pending;
+	int close;		// the connection closes once this reply is sent
+
+	char *reply;		// precomputed reply for requests without ops
+	size_t reply_len;
+
+	char *data;
+	size_t data_len;
+
+	TAILQ_ENTRY(kvs_request_s) link;
+
+	kvs_op_t ops[];
+};
+
+TAILQ_HEAD(kvs_request_queue, kvs_request_s);
+
+/* FNV-1a, picks the shard that owns a key */
+static inline uint64_t kvs_hash_key(const char *key, size_t len) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+	while(len --) {
+		h ^= (uint8_t)*key ++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
 int spdk_entry(int argc, char *argv[]);
-int kvstore_request(char *msg, ssize_t len);
+
+int kvstore_init(void);
+void kvstore_destroy(void);
+int kvstore_tick(void);
+
+ssize_t kvstore_parse(int proto, char *msg, size_t len, int *db, struct kvs_request_queue *queue);
+ssize_t kvstore_binary_parse(char *msg, size_t len, struct kvs_request_queue *queue);
+ssize_t kvstore_resp_parse(char *msg, size_t len, int *db, struct kvs_request_queue *queue);
+int kvstore_resp_detect(const char *msg, size_t len);
+void kvstore_execute_op(kvs_op_t *op);
+void kvstore_execute_ops(kvs_op_t **ops, int nops);
+int kvstore_encode(kvs_request_t *req, kvs_out_t *out);
+int kvstore_resp_encode(kvs_request_t *req, kvs_out_t *out);
+
+void kvstore_set_shards(int n);
+kvs_request_t *kvstore_range_parse(int proto, int verb, int cmd, int engine,
+	char **args, size_t *argl, int argc);
+kvs_request_t *kvstore_range_binary(int cmd, int engine, char *kptr, size_t klen,
+	char *vptr, size_t vlen);
+int kvstore_range_execute(const kvs_engine_t *engine, kvs_op_t *op);
+int kvstore_range_encode(kvs_request_t *req, const char *name, kvs_out_t *out);
+void kvstore_range_free(kvs_range_t *range);
+
+kvs_request_t *kvstore_request_alloc(int proto, int verb, int nops, size_t bytes);
+char *kvstore_request_copy(kvs_request_t *req, const char *src, size_t len);
+void kvstore_request_free(kvs_request_t *req);
+
+int kvs_buf_reserve(kvs_buf_t *buf, size_t len);
+int kvs_buf_append(kvs_buf_t *buf, const void *data, size_t len);
+void kvs_buf_consume(kvs_buf_t *buf, size_t len);
+void kvs_buf_free(kvs_buf_t *buf);
+
+int kvs_out_append(kvs_out_t *out, const void *data, size_t len);
+int kvs_out_value(kvs_out_t *out, kv_value_t *value, size_t len);
+void kvs_out_free(kvs_out_t *out);
 
 void *kvstore_malloc(size_t size);
 void kvstore_free(void *ptr);
 
 int kv_array_init(void);
 void kv_array_destroy(void);
-int kv_array_set(const char* key, const char *value);
-char* kv_array_get(const char* key);
-int kv_array_delete(char *key);
-int kv_array_modify(char* key, char *value);
+void kv_array_lock(void);
+void kv_array_unlock(void);
+int kv_array_set(const char* key, size_t klen, const char *value, size_t vlen);
+void kv_array_mset(const char **keys, const size_t *klens, const char **values,
+	const size_t *vlens, int *status, int n);
+kv_value_t *kv_array_get(const char* key, size_t klen);
+int kv_array_delete(const char *key, size_t klen);
+int kv_array_modify(const char* key, size_t klen, const char *value, size_t vlen);
+int kv_array_scan(kvs_scan_fn fn, void *arg);
+void kv_array_stats(kvs_engine_stats_t *stats);
 
 int kv_rbtree_init(void);
 void kv_rbtree_destroy(void);
-int kv_rbtree_set(const char* key, const char *value);
-char* kv_rbtree_get(char* key);
-int kv_rbtree_delete(char *key);
-int kv_rbtree_modify(char* key, char *value);
+void kv_rbtree_lock(void);
+void kv_rbtree_unlock(void);
+int kv_rbtree_set(const char* key, size_t klen, const char *value, size_t vlen);
+kv_value_t *kv_rbtree_get(const char* key, size_t klen);
+void kv_rbtree_mget(const char **keys, const size_t *klens, kv_value_t **values, int n);
+int kv_rbtree_delete(const char *key, size_t klen);
+int kv_rbtree_modify(const char* key, size_t klen, const char *value, size_t vlen);
+int kv_rbtree_scan(kvs_scan_fn fn, void *arg);
+int kv_rbtree_tick(void);
+int kv_rbtree_range(const char *start, size_t slen, const char *end, size_t elen,
+	int flags, kvs_scan_fn fn, void *arg);
+void kv_rbtree_stats(kvs_engine_stats_t *stats);
 
 int kv_hash_init(void);
 void kv_hash_destroy(void);
-int kv_hash_set(const char* key, const char *value);
-char* kv_hash_get(const char* key);
-int kv_hash_delete(char *key);
-int kv_hash_modify(char* key, char *value); 
+void kv_hash_lock(void);
+void kv_hash_unlock(void);
+int kv_hash_set(const char* key, size_t klen, const char *value, size_t vlen);
+kv_value_t *kv_hash_get(const char* key, size_t klen);
+void kv_hash_mget(const char **keys, const size_t *klens, kv_value_t **values, int n);
+int kv_hash_delete(const char *key, size_t klen);
+int kv_hash_modify(const char* key, size_t klen, const char *value, size_t vlen);
+int kv_hash_scan(kvs_scan_fn fn, void *arg);
+int kv_hash_tick(void);
+void kv_hash_stats(kvs_engine_stats_t *stats);
+
+int kv_swiss_init(void);
+void kv_swiss_destroy(void);
+void kv_swiss_lock(void);
+void kv_swiss_unlock(void);
+int kv_swiss_set(const char *key, size_t klen, const char *value, size_t vlen);
+kv_value_t *kv_swiss_get(const char *key, size_t klen);
+int kv_swiss_delete(const char *key, size_t klen);
+int kv_swiss_modify(const char *key, size_t klen, const char *value, size_t vlen);
+int kv_swiss_scan(kvs_scan_fn fn, void *arg);
+void kv_swiss_stats(kvs_engine_stats_t *stats);
+
+int kv_bptree_init(void);
+void kv_bptree_destroy(void);
+void kv_bptree_lock(void);
+void kv_bptree_unlock(void);
+int kv_bptree_set(const char *key, size_t klen, const char *value, size_t vlen);
+kv_value_t *kv_bptree_get(const char *key, size_t klen);
+int kv_bptree_delete(const char *key, size_t klen);
+int kv_bptree_modify(const char *key, size_t klen, const char *value, size_t vlen);
+int kv_bptree_scan(kvs_scan_fn fn, void *arg);
+int kv_bptree_range(const char *start, size_t slen, const char *end, size_t elen,
+	int flags, kvs_scan_fn fn, void *arg);
+void kv_bptree_stats(kvs_engine_stats_t *stats);
+
+int kv_skiplist_init(void);
+void kv_skiplist_destroy(void);
+void kv_skiplist_lock(void);
+void kv_skiplist_unlock(void);
+int kv_skiplist_set(const char *key, size_t klen, const char *value, size_t vlen);
+kv_value_t *kv_skiplist_get(const char *key, size_t klen);
+int kv_skiplist_delete(const char *key, size_t klen);
+int kv_skiplist_modify(const char *key, size_t klen, const char *value, size_t vlen);
+int kv_skiplist_scan(kvs_scan_fn fn, void *arg);
+int kv_skiplist_tick(void);
+int kv_skiplist_range(const char *start, size_t slen, const char *end, size_t elen,
+	int flags, kvs_scan_fn fn, void *arg);
+void kv_skiplist_stats(kvs_engine_stats_t *stats);
+
+int kv_art_init(void);
+void kv_art_destroy(void);
+void kv_art_lock(void);
+void kv_art_unlock(void);
+int kv_art_set(const char *key, size_t klen, const char *value, size_t vlen);
+kv_value_t *kv_art_get(const char *key, size_t klen);
+int kv_art_delete(const char *key, size_t klen);
+int kv_art_modify(const char *key, size_t klen, const char *value, size_t vlen);
+int kv_art_scan(kvs_scan_fn fn, void *arg);
+int kv_art_range(const char *start, size_t slen, const char *end, size_t elen,
+	int flags, kvs_scan_fn fn, void *arg);
+void kv_art_stats(kvs_engine_stats_t *stats);
 
 #endif
  
\ No newline at end of file
@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include "epoch.h"
+
+#define EPOCH_MAX_THREADS   128
+#define EPOCH_BATCH         1024        // retired objects that trigger a reclaim
+
+typedef struct epoch_retired_s {
+    epoch_free_fn fn;
+    void *ptr;
+    uint64_t epoch;
+} epoch_retired_t;
+
+/*
+ * state is the global epoch seen on entry shifted left by one, with bit 0
+ * set while the thread is inside a section. the global epoch only advances
+ * when every thread inside a section has seen the current one, so an object
+ * retired in epoch e can no longer be reached by anyone once it is e + 2.
+ */
+typedef struct epoch_thread_s {
+    _Atomic uint64_t state;
+    char pad[64 - sizeof(uint64_t)];
+
+    // owner only
+    int depth;
+    epoch_retired_t *retired;   // oldest first
+    size_t head;
+    size_t tail;
+    size_t cap;
+} epoch_thread_t;
+
+static _Atomic uint64_t g_epoch = 1;
+static epoch_thread_t g_threads[EPOCH_MAX_THREADS];
+static _Atomic int g_thread_count;
+
+static __thread epoch_thread_t *t_epoch;
+
+static epoch_thread_t *epoch_register(void) {
+    int idx = atomic_fetch_add(&g_thread_count, 1);
+    if(idx >= EPOCH_MAX_THREADS) {
+        fprintf(stderr, "epoch: more than %d threads\n", EPOCH_MAX_THREADS);
+        abort();
+    }
+    t_epoch = &g_threads[idx];
+    return t_epoch;
+}
+
+void epoch_enter(void) {
+    epoch_thread_t *t = t_epoch ? t_epoch : epoch_register();
+    if(t->depth ++) return;
+
+    uint64_t epoch = atomic_load_explicit(&g_epoch, memory_order_relaxed);
+    // seq_cst: the reads of the section must not pass this store
+    atomic_store_explicit(&t->state, epoch << 1 | 1, memory_order_seq_cst);
+}
+
+void epoch_exit(void) {
+    epoch_thread_t *t = t_epoch;
+    if(-- t->depth) return;
+
+    atomic_store_explicit(&t->state, 0, memory_order_release);
+}
+
+// move the global epoch on if nobody inside a section lags behind it
+static uint64_t epoch_advance(void) {
+    uint64_t epoch = atomic_load_explicit(&g_epoch, memory_order_acquire);
+    int count = atomic_load_explicit(&g_thread_count, memory_order_acquire);
+    int i = 0;
+
+    if(count > EPOCH_MAX_THREADS) count = EPOCH_MAX_THREADS;
+    for(i = 0; i < count; i ++) {
+        uint64_t state = atomic_load_explicit(&g_threads[i].state, memory_order_acquire);
+        if((state & 1) && (state >> 1) != epoch) return epoch;
+    }
+
+    if(atomic_compare_exchange_strong(&g_epoch, &epoch, epoch + 1)) return epoch + 1;
+    return epoch;
+}
+
+size_t epoch_reclaim(void) {
+    epoch_thread_t *t = t_epoch;
+    if(!t || t->head == t->tail) return 0;
+
+    uint64_t epoch = epoch_advance();
+    size_t freed = 0;
+
+    while(t->head != t->tail && t->retired[t->head].epoch + 2 <= epoch) {
+        epoch_retired_t *r = &t->retired[t->head ++];
+        r->fn(r->ptr);
+        freed ++;
+    }
+    if(t->head == t->tail) t->head = t->tail = 0;
+    return freed;
+}
+
+void epoch_retire(epoch_free_fn fn, void *ptr) {
+    epoch_thread_t *t = t_epoch ? t_epoch : epoch_register();
+
+    if(t->tail - t->head >= EPOCH_BATCH) epoch_reclaim();
+
+    if(t->tail == t->cap) {
+        // slide the live entries down before growing the array
+        size_t live = t->tail - t->head;
+        if(t->head > 0) {
+            size_t i = 0;
+            for(i = 0; i < live; i ++) t->retired[i] = t->retired[t->head + i];
+            t->head = 0;
+            t->tail = live;
+        }
+        if(t->tail == t->cap) {
+            size_t cap = t->cap ? t->cap * 2 : EPOCH_BATCH;
+            epoch_retired_t *retired = realloc(t->retired, cap * sizeof(epoch_retired_t));
+            if(!retired) {
+                // leaked rather than freed under a reader
+                fprintf(stderr, "epoch: retired list realloc failed\n");
+                return;
+            }
+            t->retired = retired;
+            t->cap = cap;
+        }
+    }
+
+    epoch_retired_t *r = &t->retired[t->tail ++];
+    r->fn = fn;
+    r->ptr = ptr;
+    r->epoch = atomic_load_explicit(&g_epoch, memory_order_seq_cst);
+}
@@ -0,0 +1,24 @@
+#ifndef __EPOCH_H__
+#define __EPOCH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * epoch based reclamation. readers bracket their accesses to a shared
+ * structure with epoch_enter()/epoch_exit() and take no lock. a writer that
+ * unlinks an object hands it to epoch_retire() instead of freeing it, and
+ * it is freed once every thread that was inside a section at that time has
+ * left it. sections nest. retired objects are kept per thread and freed by
+ * the thread that retired them, from epoch_reclaim() or from a later
+ * epoch_retire() once enough have piled up.
+ */
+typedef void (*epoch_free_fn)(void *ptr);
+
+void epoch_enter(void);
+void epoch_exit(void);
+
+void epoch_retire(epoch_free_fn fn, void *ptr);
+size_t epoch_reclaim(void);     // returns the number of objects freed
+
+#endif
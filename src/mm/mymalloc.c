@@ -1,12 +1,12 @@
 #include "mymalloc.h"
+#include <pthread.h>
+#include <unistd.h>
 #include <sys/syscall.h>
-#ifdef DEBUG  
+#include <linux/mempolicy.h>
+#ifdef DEBUG
     #include <stdio.h>
     #include <assert.h>
 
-    #define DBG_PRINT_LOCK_STATE(lbl, blk) \
-        printf("%-15s: block=%p lock=%d\n", lbl, blk, blk->lock.status)
-        
     #define DBG_PRINT_LIST(lbl, list) \
         do { \
             printf("----- %s -----\n", lbl); \
@@ -18,20 +18,17 @@
         printf("----- %s -----\n", lbl); \
         printf_free_list(list); \
     } while(0)
-        
+
     #define DBG_PRINT(fmt, ...) \
         printf(fmt, ##__VA_ARGS__)
 #else
-    #define DBG_PRINT_LOCK_STATE(lbl, blk)
     #define DBG_PRINT_LIST(lbl, list)
     #define DBG_PRINT_FREELIST(lbl, list)
     #define DBG_PRINT(fmt, ...)
 #endif
 
-typedef short pid_t;
-
 #define PAGESIZE    0x1000
-#define MAX_THREADS 64
+#define HUGEPAGE    MYMALLOC_HUGEPAGE_SIZE
 
 // 每个 block 占据空间 block_meta + size
 /*
@@ -44,43 +41,54 @@ typedef short pid_t;
 typedef struct block {
     size_t capacity;           // 容量（不含元数据，头指针专属）
     size_t size;               // 可用内存大小（不含元数据）
-    spinlock_t lock;           // 局部锁
     int is_free;               // 是否空闲（0/1）
+    int source;                // chunk 的内存来源（头指针专属）
+    size_t stamp;              // chunk 变空时的 decay 轮次，0 表示不在缓存中（头指针专属）
     struct block *head;        // 指向链表头
     struct block *next;        // 指向下一个内存块
-    struct block *prev;        // 指向上一个内存块 
+    struct block *prev;        // 指向上一个内存块
     struct block *next_free;   // 指向下一个空闲块
-    int tfd;                   // 所属线程号标识符
+    struct block *prev_free;   // 指向上一个空闲块
+    struct block *next_remote; // 其他线程释放后挂在 arena 的 remote 链上
+    struct arena_s *arena;     // 所属线程的 arena
 } block;
 
-block* mem_blocks = NULL;
-size_t mem_blocks_size = PAGESIZE;
-
-struct ThreadEntry {
-    pid_t tid;
-    // block* mem;
-    block* first_free;
-};
-
-static struct ThreadEntry thread_table[MAX_THREADS];
-static int thread_count = 0;
-spinlock_t global_lock;
+#define BLOCK_MIN_SPLIT 64     // 拆分后剩余块至少能放下的字节数
+#define DECAY_TICKS     10                  // mymalloc_decay calls an empty chunk stays cached
+#define DIRTY_MAX       (64 * 1024 * 1024)  // cached bytes per arena before decay stops waiting
 
-static inline pid_t gettid(void) {
-    pid_t tid;
-    __asm__ volatile (
-        "syscall"
-        : "=a" (tid)
-        : "0" (SYS_gettid)
-        : "rcx", "r11", "memory"
-    );
-    return tid;
-}
+/*
+ * every thread owns an arena, found through a thread local pointer, and
+ * only the owner ever touches the block lists of its arena, so they need
+ * no locks. a block freed by another thread is pushed onto the owner's
+ * remote list with a compare and swap; the owner takes the whole list with
+ * one exchange on its next block allocation and frees the blocks itself.
+ * when a thread exits its arena is abandoned, and the next new thread
+ * adopts it together with whatever is still queued on it.
+ */
+typedef struct arena_s {
+    block *first_free;
+    _Atomic(block *) remote;    // freed by other threads, linked by next_remote
+    block *dirty;               // empty chunks still holding pages, heads linked by next_free
+    size_t dirty_bytes;
+    size_t decay_epoch;
+    int socket;                 // NUMA node chunks are placed on, -1 for any
+    char *slab_next;            // slabs left in the arena's current slab chunk
+    char *slab_end;
+    struct arena_s *next;       // abandoned list
+} arena_t;
+
+static __thread arena_t *thread_arena;
+
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+static pthread_key_t arena_key;
+static spinlock_t arena_lock;
+static arena_t *arena_abandoned;
 
 
 void *vmalloc(void *addr, size_t length) {
     // length must be aligned to page size (4096).
-    void *result = mmap(addr, length, PROT_READ | PROT_WRITE, 
+    void *result = mmap(addr, length, PROT_READ | PROT_WRITE,
                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
     if (result == MAP_FAILED) {
         return NULL;
@@ -92,6 +100,84 @@ void vmfree(void *addr, size_t length) {
     munmap(addr, length);
 }
 
+/*
+ * arenas map memory in chunks of whole 2MB hugepages, so a large dataset
+ * sits on a few thousand TLB entries instead of millions. the hugepage
+ * allocator set by mymalloc_set_hugepages is tried first; the server sets
+ * spdk_malloc there, which hands out the hugepages SPDK reserved at
+ * startup. without it, or once it runs dry, chunks come from the kernel's
+ * hugetlbfs pool with MAP_HUGETLB, and failing that from a 2MB aligned
+ * mapping advised for transparent hugepages, which the kernel backs with
+ * 4KB pages when it has no huge ones. an arena given a socket asks the
+ * hook for memory on that node, and binds kernel chunks to it with mbind
+ * before the first touch.
+ */
+enum {
+    CHUNK_HOOK,                 // mymalloc_set_hugepages, spdk_malloc under SPDK
+    CHUNK_HUGETLB,
+    CHUNK_THP,
+};
+
+static mymalloc_hugepage_alloc_t hugepage_alloc;
+static mymalloc_hugepage_free_t hugepage_free;
+
+void mymalloc_set_hugepages(mymalloc_hugepage_alloc_t alloc, mymalloc_hugepage_free_t free) {
+    hugepage_alloc = alloc;
+    hugepage_free = free;
+}
+
+static size_t chunk_size(size_t size) {
+    return (size + HUGEPAGE - 1) & ~(size_t)(HUGEPAGE - 1);
+}
+
+// preferred rather than strict, a node that runs out borrows from the others
+static void chunk_bind(void *addr, size_t length, int socket) {
+    if(socket < 0 || socket >= 64) return;
+
+    unsigned long mask = 1UL << socket;
+    syscall(SYS_mbind, addr, length, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0);
+}
+
+// length is a multiple of HUGEPAGE, and so is the address returned
+static void *chunk_map(size_t length, int socket, int *source) {
+    if(hugepage_alloc) {
+        void *addr = hugepage_alloc(length, HUGEPAGE, socket);
+        if(addr) {
+            *source = CHUNK_HOOK;
+            return addr;
+        }
+    }
+
+#ifdef MAP_HUGETLB
+    void *addr = mmap(NULL, length, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if(addr != MAP_FAILED) {
+        chunk_bind(addr, length, socket);
+        *source = CHUNK_HUGETLB;
+        return addr;
+    }
+#endif
+
+    // map one hugepage more than needed and trim it to an aligned range
+    char *base = vmalloc(NULL, length + HUGEPAGE);
+    if(!base) return NULL;
+
+    char *aligned = (char *)(((uintptr_t)base + HUGEPAGE - 1) & ~(uintptr_t)(HUGEPAGE - 1));
+    if(aligned > base) vmfree(base, aligned - base);
+    vmfree(aligned + length, base + HUGEPAGE - aligned);
+    chunk_bind(aligned, length, socket);
+#ifdef MADV_HUGEPAGE
+    madvise(aligned, length, MADV_HUGEPAGE);
+#endif
+    *source = CHUNK_THP;
+    return aligned;
+}
+
+static void chunk_unmap(void *addr, size_t length, int source) {
+    if(source != CHUNK_HOOK) vmfree(addr, length);
+    else if(hugepage_free) hugepage_free(addr);
+}
+
 #ifdef DEBUG
 static void printf_free_list(block *head) {
     printf("free_list: ");
@@ -113,130 +199,486 @@ static void printf_total_list(block *head) {
 #endif
 
 
-size_t aligned_size(size_t size) {
-    return (size + PAGESIZE - 1) / PAGESIZE * PAGESIZE;
+static void free_list_push(arena_t *arena, block *blk) {
+    blk->prev_free = NULL;
+    blk->next_free = arena->first_free;
+    if(arena->first_free) arena->first_free->prev_free = blk;
+    arena->first_free = blk;
 }
 
-block* allocate_page(int tfd, size_t size) {
-    block* dummy = (block *)vmalloc(NULL, size);
+static void free_list_remove(arena_t *arena, block *blk) {
+    if(blk->prev_free) blk->prev_free->next_free = blk->next_free;
+    else arena->first_free = blk->next_free;
+    if(blk->next_free) blk->next_free->prev_free = blk->prev_free;
+}
+
+// 头块 dummy 记录整个 chunk，后面跟一个覆盖剩余空间的空闲块
+block* allocate_page(arena_t *arena, size_t size) {
+    int source = 0;
+    block* dummy = (block *)chunk_map(size, arena->socket, &source);
     if(!dummy) return NULL;
 
     dummy->size = 0;
     dummy->capacity = size - sizeof(block);
     dummy->head = dummy;
+    dummy->source = source;
+    dummy->stamp = 0;
 
     block* mem = dummy + 1;
 
     dummy->next = mem;
     dummy->prev = NULL;
-    dummy->next_free = mem;
-    dummy->is_free = 1;
-    dummy->tfd = tfd;
-    
+    dummy->is_free = 0;        // 头块从不参与分配与合并
+    dummy->arena = arena;
+
     mem->size = size - 2 * sizeof(block);
     mem->capacity = 0;
     mem->head = dummy;
     mem->next = NULL;
     mem->prev = dummy;
-    mem->next_free = NULL;
     mem->is_free = 1;
-    mem->tfd = tfd;
+    mem->arena = arena;
+    free_list_push(arena, mem);
 
     return dummy;
 }
 
+/*
+ * a chunk whose blocks are all free is not unmapped on the free path: it
+ * stays on the free list for the next allocation and its head goes on the
+ * arena's dirty list. mymalloc_decay, run by the owner from a poller, gives
+ * back the pages of chunks that stayed empty for DECAY_TICKS calls, or of
+ * any once the arena caches more than DIRTY_MAX. a transparent hugepage
+ * chunk keeps its mapping and drops its pages with MADV_DONTNEED; hugetlb
+ * pages cannot be dropped piecemeal and SPDK memory is not the kernel's,
+ * so those chunks are released whole.
+ */
+static void chunk_retire(arena_t *arena, block *dummy) {
+    dummy->stamp = arena->decay_epoch;
+    dummy->prev_free = NULL;
+    dummy->next_free = arena->dirty;
+    if(arena->dirty) arena->dirty->prev_free = dummy;
+    arena->dirty = dummy;
+    arena->dirty_bytes += dummy->capacity + sizeof(block);
+}
 
-void *mymalloc(size_t size) {
-    pid_t tid = gettid();
-    int tfd = 0;
-    
-    for(tfd = 0; tfd < thread_count; tfd ++) {
-        if(tid != thread_table[tfd].tid) continue;
-        else break;
+static void chunk_reuse(arena_t *arena, block *dummy) {
+    if(!dummy->stamp) return;
+
+    if(dummy->prev_free) dummy->prev_free->next_free = dummy->next_free;
+    else arena->dirty = dummy->next_free;
+    if(dummy->next_free) dummy->next_free->prev_free = dummy->prev_free;
+    dummy->stamp = 0;
+    arena->dirty_bytes -= dummy->capacity + sizeof(block);
+}
+
+static void chunk_purge(arena_t *arena, block *dummy) {
+    size_t length = dummy->capacity + sizeof(block);
+    chunk_reuse(arena, dummy);
+
+    if(dummy->source == CHUNK_THP) {
+        // the first page holds the headers and stays
+        madvise((char *)dummy + PAGESIZE, length - PAGESIZE, MADV_DONTNEED);
+        return;
+    }
+
+    free_list_remove(arena, dummy->next);
+    chunk_unmap(dummy, length, dummy->source);
+}
+
+/*
+ * small objects come from size classes instead of the block lists. a slab
+ * is SLAB_SIZE bytes of one class, aligned to its size inside a hugepage
+ * chunk of the arena that carved it, on that arena's node. chunks holding slabs are marked in
+ * slab_map, one bit per hugepage of address space, so myfree tells a slab
+ * object from a block by its address and finds the class in the slab
+ * header without a header of its own. each thread keeps a free list per
+ * class: malloc pops, free pushes. a list that grows past two batches
+ * hands one batch to the class depot, where threads short of objects pick
+ * it up before carving a new slab. the block lists only see objects over
+ * SLAB_MAX_SIZE. depots are kept per node; an object freed by a thread on
+ * another node collects on a per node list and goes back to its own
+ * node's depot a batch at a time, so a thread only ever refills with
+ * local memory.
+ */
+#define SLAB_SIZE       (64 * 1024)
+#define SLAB_HEADER     64
+#define SLAB_MAX_SIZE   4096
+#define SLAB_CLASSES    28
+#define SLAB_BATCH      32
+#define SLAB_NODES      8
+#define SLAB_MAP_BITS   ((1ULL << 47) / HUGEPAGE)   // user address space on x86_64
+
+// 16 byte steps up to 128, then four classes per power of two
+static const uint32_t slab_sizes[SLAB_CLASSES] = {
+    16, 32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256, 320, 384, 448, 512,
+    640, 768, 896, 1024, 1280, 1536, 1792, 2048,
+    2560, 3072, 3584, 4096,
+};
+
+typedef struct slab_s {
+    uint32_t cls;
+    uint32_t size;
+    uint32_t node;
+} slab_t;
+
+typedef struct slab_cache_s {
+    void *free;                 // linked through the first word
+    int count;
+    char *bump;                 // the uncarved rest of this thread's slab
+    char *end;
+} slab_cache_t;
+
+// batches of SLAB_BATCH objects, the first one's second word links the batches.
+// shorter lists handed over by exiting threads gather on loose until they fill one
+typedef struct slab_depot_s {
+    spinlock_t lock;
+    void *batches;
+    void *loose;
+    int loose_count;
+    char pad[64 - sizeof(spinlock_t) - 2 * sizeof(void *) - sizeof(int)];
+} slab_depot_t;
+
+static _Atomic uint64_t slab_map[SLAB_MAP_BITS / 64];
+static slab_depot_t slab_depot[SLAB_NODES][SLAB_CLASSES];
+
+static __thread slab_cache_t slab_cache[SLAB_CLASSES];
+static __thread slab_cache_t slab_foreign[SLAB_NODES][SLAB_CLASSES];   // freed here, carved on another node
+static __thread uint32_t slab_node;
+
+static arena_t *arena_attach(void);
+
+static inline int slab_class(size_t size) {
+    if(size <= 128) return (size + 15) / 16 - 1;
+
+    int shift = 63 - __builtin_clzll(size - 1);
+    return 8 + (shift - 7) * 4 + (int)((size - 1) >> (shift - 2) & 3);
+}
+
+static inline uint32_t slab_node_of(int socket) {
+    return socket < 0 ? 0 : (uint32_t)socket % SLAB_NODES;
+}
+
+static inline int slab_owns(const void *ptr) {
+    uintptr_t unit = (uintptr_t)ptr / HUGEPAGE;
+    if(unit >= SLAB_MAP_BITS) return 0;
+    return atomic_load_explicit(&slab_map[unit / 64], memory_order_relaxed) >> (unit % 64) & 1;
+}
+
+// the exit of a thread holding slab objects hands them back, which needs its arena key set
+static inline void slab_hold(void) {
+    if(!thread_arena) arena_attach();
+}
+
+static char *slab_new(int cls) {
+    arena_t *arena = thread_arena;
+    if(!arena) {
+        arena = arena_attach();
+        if(!arena) return NULL;
+    }
+
+    if(arena->slab_next == arena->slab_end) {
+        int source = 0;
+        char *chunk = chunk_map(HUGEPAGE, arena->socket, &source);
+        if(!chunk) return NULL;
+
+        uintptr_t unit = (uintptr_t)chunk / HUGEPAGE;
+        atomic_fetch_or_explicit(&slab_map[unit / 64], 1ULL << (unit % 64), memory_order_relaxed);
+        arena->slab_next = chunk;
+        arena->slab_end = chunk + HUGEPAGE;
     }
-    struct ThreadEntry* thread = &thread_table[tfd];
 
-    if(tfd == thread_count) { 
-        spin_lock(&global_lock);
-        tfd = thread_count ++;
-        spin_unlock(&global_lock);
+    char *slab = arena->slab_next;
+    arena->slab_next += SLAB_SIZE;
+
+    slab_t *hdr = (slab_t *)slab;
+    hdr->cls = cls;
+    hdr->size = slab_sizes[cls];
+    hdr->node = slab_node;
+    return slab;
+}
+
+static void *slab_refill(int cls) {
+    slab_cache_t *cache = &slab_cache[cls];
+    slab_depot_t *depot = &slab_depot[slab_node][cls];
+    size_t size = slab_sizes[cls];
+
+    slab_hold();
+    if(depot->batches || depot->loose) {
+        int count = SLAB_BATCH;
+        spin_lock(&depot->lock);
+        void *batch = depot->batches;
+        if(batch) {
+            depot->batches = ((void **)batch)[1];
+        } else if((batch = depot->loose) != NULL) {
+            count = depot->loose_count;
+            depot->loose = NULL;
+            depot->loose_count = 0;
+        }
+        spin_unlock(&depot->lock);
 
-        thread->tid = tid;
-        thread->first_free = allocate_page(tfd, mem_blocks_size);
+        if(batch) {
+            cache->free = *(void **)batch;
+            cache->count = count - 1;
+            return batch;
+        }
     }
-    
-    
+
+    if(cache->bump + size > cache->end) {
+        char *slab = slab_new(cls);
+        if(!slab) return NULL;
+        cache->bump = slab + SLAB_HEADER;
+        cache->end = slab + SLAB_SIZE;
+    }
+
+    void *obj = cache->bump;
+    cache->bump += size;
+    return obj;
+}
+
+static inline void *slab_alloc(int cls) {
+    slab_cache_t *cache = &slab_cache[cls];
+    void *obj = cache->free;
+    if(!obj) return slab_refill(cls);
+
+    cache->free = *(void **)obj;
+    cache->count --;
+    return obj;
+}
+
+// the first SLAB_BATCH objects of the list go to the depot
+static void slab_flush(int cls) {
+    slab_cache_t *cache = &slab_cache[cls];
+    slab_depot_t *depot = &slab_depot[slab_node][cls];
+
+    void *batch = cache->free;
+    void *last = batch;
+    int i = 0;
+    for(i = 1; i < SLAB_BATCH; i ++) last = *(void **)last;
+
+    cache->free = *(void **)last;
+    cache->count -= SLAB_BATCH;
+    *(void **)last = NULL;
+
+    spin_lock(&depot->lock);
+    ((void **)batch)[1] = depot->batches;
+    depot->batches = batch;
+    spin_unlock(&depot->lock);
+}
+
+// a full foreign list is exactly one batch for the depot of its node
+static void slab_free_foreign(slab_t *hdr, void *ptr) {
+    slab_cache_t *cache = &slab_foreign[hdr->node][hdr->cls];
+
+    *(void **)ptr = cache->free;
+    cache->free = ptr;
+    if(++ cache->count < SLAB_BATCH) return;
+
+    slab_depot_t *depot = &slab_depot[hdr->node][hdr->cls];
+    void *batch = cache->free;
+    cache->free = NULL;
+    cache->count = 0;
+
+    spin_lock(&depot->lock);
+    ((void **)batch)[1] = depot->batches;
+    depot->batches = batch;
+    spin_unlock(&depot->lock);
+}
+
+static inline void slab_free(void *ptr) {
+    slab_t *hdr = (slab_t *)((uintptr_t)ptr & ~(uintptr_t)(SLAB_SIZE - 1));
+    slab_cache_t *cache = &slab_cache[hdr->cls];
+
+    // attaching sets slab_node, so it comes before the node check
+    if(!cache->free) slab_hold();
+    if(hdr->node != slab_node) {
+        slab_free_foreign(hdr, ptr);
+        return;
+    }
+
+    *(void **)ptr = cache->free;
+    cache->free = ptr;
+    if(++ cache->count > 2 * SLAB_BATCH) slab_flush(hdr->cls);
+}
+
+// a list of any length goes to a depot, the loose objects are cut into batches as they fill one
+static void slab_depot_put(uint32_t node, int cls, void *list) {
+    slab_depot_t *depot = &slab_depot[node][cls];
+
+    spin_lock(&depot->lock);
+    while(list) {
+        void *obj = list;
+        list = *(void **)obj;
+
+        *(void **)obj = depot->loose;
+        depot->loose = obj;
+        if(++ depot->loose_count < SLAB_BATCH) continue;
+
+        ((void **)obj)[1] = depot->batches;
+        depot->batches = obj;
+        depot->loose = NULL;
+        depot->loose_count = 0;
+    }
+    spin_unlock(&depot->lock);
+}
+
+// every object this thread holds goes back to its node's depot, the rest of its slabs carved up
+static void slab_drain(void) {
+    int cls = 0;
+
+    for(cls = 0; cls < SLAB_CLASSES; cls ++) {
+        slab_cache_t *cache = &slab_cache[cls];
+        size_t size = slab_sizes[cls];
+
+        while(cache->bump && cache->bump + size <= cache->end) {
+            *(void **)cache->bump = cache->free;
+            cache->free = cache->bump;
+            cache->bump += size;
+        }
+        slab_depot_put(slab_node, cls, cache->free);
+        cache->free = NULL;
+        cache->count = 0;
+        cache->bump = cache->end = NULL;
+
+        uint32_t node = 0;
+        for(node = 0; node < SLAB_NODES; node ++) {
+            slab_depot_put(node, cls, slab_foreign[node][cls].free);
+            slab_foreign[node][cls].free = NULL;
+            slab_foreign[node][cls].count = 0;
+        }
+    }
+}
+
+static void block_free(arena_t *arena, block *current);
+
+// runs at thread exit: hand the slab objects to the depots and leave the arena for the next thread
+static void arena_abandon(void *arg) {
+    arena_t *arena = arg;
+
+    slab_drain();
+
+    thread_arena = NULL;
+    spin_lock(&arena_lock);
+    arena->next = arena_abandoned;
+    arena_abandoned = arena;
+    spin_unlock(&arena_lock);
+}
+
+static void arena_key_create(void) {
+    pthread_key_create(&arena_key, arena_abandon);
+}
+
+static arena_t *arena_attach(void) {
+    pthread_once(&arena_once, arena_key_create);
+
+    spin_lock(&arena_lock);
+    arena_t *arena = arena_abandoned;
+    if(arena) arena_abandoned = arena->next;
+    spin_unlock(&arena_lock);
+
+    if(!arena) {
+        arena = vmalloc(NULL, PAGESIZE);
+        if(!arena) return NULL;
+        arena->decay_epoch = 1;
+        arena->socket = -1;
+    }
+
+    arena->next = NULL;
+    thread_arena = arena;
+    slab_node = slab_node_of(arena->socket);
+    pthread_setspecific(arena_key, arena);
+    return arena;
+}
+
+static void arena_push_remote(arena_t *arena, block *blk) {
+    block *head = atomic_load_explicit(&arena->remote, memory_order_relaxed);
+    do {
+        blk->next_remote = head;
+    } while(!atomic_compare_exchange_weak_explicit(&arena->remote, &head, blk,
+        memory_order_release, memory_order_relaxed));
+}
+
+static void arena_drain_remote(arena_t *arena) {
+    if(!atomic_load_explicit(&arena->remote, memory_order_relaxed)) return;
+
+    block *blk = atomic_exchange_explicit(&arena->remote, NULL, memory_order_acquire);
+    while(blk) {
+        block *next = blk->next_remote;
+        block_free(arena, blk);
+        blk = next;
+    }
+}
+
+void *mymalloc(size_t size) {
     if (size == 0) return NULL;
+    if (size <= SLAB_MAX_SIZE) {
+        void *obj = slab_alloc(slab_class(size));
+        if(obj) return obj;
+        // out of slab space, the block lists take it
+    }
+
+    arena_t *arena = thread_arena;
+    if(!arena) {
+        arena = arena_attach();
+        if(!arena) return NULL;
+    }
+    arena_drain_remote(arena);
+
     size = (size + 7) & ~7; // 8 字节对齐
 
-    void *ptr = NULL;
-    block *current = thread->first_free;
-    // block *prev = NULL; 
-
-    DBG_PRINT("===== Begin malloc(%p) =====\n", current);
-    // DBG_PRINT_FREELIST("Begin malloc", current);
-
-
-    while(!ptr) {
-        // 当前空间已经不足以分配
-        if(!current) {
-            // 计算所需空间，已经对齐
-            size_t needed_size = aligned_size(size + 3 * sizeof(block));
-
-            // 创建新空间
-            block* dummy = allocate_page(tfd, needed_size);
-            if(!dummy) return NULL;
-        
-            block* old_dummy = thread->first_free;
-            if(old_dummy) {
-                spin_lock(&old_dummy->lock);
-                thread->first_free = dummy;
-                spin_unlock(&old_dummy->lock);
-            } else {
-                thread->first_free = dummy;
-            }
-            
-            current = dummy;
-        }
+    DBG_PRINT("===== Begin malloc(%lu) =====\n", size);
+    // DBG_PRINT_FREELIST("Begin malloc", arena->first_free);
+
+    // 首次适配
+    block *current = arena->first_free;
+    while(current && current->size < size) current = current->next_free;
 
-        spin_lock(&current->lock);
-        // 尝试分配
-        if(current->is_free && current->size >= size + sizeof(block)) {
-            size_t remain = current->size - size;
-            
-            block *new_block = (block*)((void*)current + sizeof(block) + size);
-            new_block->size = remain - sizeof(block);
-            new_block->capacity = 0;  // 从母块拆分出来的块没有容量
-            new_block->is_free = 1;
-            if(current->next) {
-                current->next->prev = new_block;
-            }
-            new_block->head = current->head;
-            new_block->next = current->next;
-            new_block->prev = current;
-            new_block->tfd = tfd;
-
-            new_block->next_free = current->next_free;
-            
-
-            current->size = size;
-            current->next = new_block;
-            current->next_free = NULL;
-
-            ptr = (void *)(current + 1);
-            current->is_free = 0;
-            
+    // 当前空间已经不足以分配
+    if(!current) {
+        // 创建新空间，至少一个大页
+        if(!allocate_page(arena, chunk_size(size + 2 * sizeof(block)))) return NULL;
+        current = arena->first_free;
+    }
+
+    // 取用整个空 chunk 时把它移出缓存
+    if(current->prev == current->head && !current->next) chunk_reuse(arena, current->head);
+
+    if(current->size >= size + sizeof(block) + BLOCK_MIN_SPLIT) {
+        // 拆分，剩余部分接替 current 在空闲链表中的位置
+        block *new_block = (block*)((char *)(current + 1) + size);
+        new_block->size = current->size - size - sizeof(block);
+        new_block->capacity = 0;  // 从母块拆分出来的块没有容量
+        new_block->is_free = 1;
+        if(current->next) {
+            current->next->prev = new_block;
         }
-        spin_unlock(&current->lock);
-        current = current->next_free;
+        new_block->head = current->head;
+        new_block->next = current->next;
+        new_block->prev = current;
+        new_block->arena = arena;
+
+        new_block->prev_free = current->prev_free;
+        new_block->next_free = current->next_free;
+        if(current->prev_free) current->prev_free->next_free = new_block;
+        else arena->first_free = new_block;
+        if(current->next_free) current->next_free->prev_free = new_block;
+
+        current->size = size;
+        current->next = new_block;
+    } else {
+        free_list_remove(arena, current);
     }
-     
-    // DBG_PRINT_LIST("After malloc", thread->first_free->head);
+    current->is_free = 0;
+
+    void *ptr = (void *)(current + 1);
+
+    // DBG_PRINT_LIST("After malloc", current->head);
     DBG_PRINT("===== END malloc(%p) =====\n\n", ptr);
     return ptr;
 }
 
-void merge(block *curr_block, block *next_block) { 
+void merge(block *curr_block, block *next_block) {
 
     DBG_PRINT("merge current %ld and next_block %ld\n", curr_block->size, next_block->size);
 
@@ -245,70 +687,94 @@ void merge(block *curr_block, block *next_block) {
         next_block->next->prev = curr_block;
     }
     curr_block->next = next_block->next;
-    curr_block->next_free = next_block->next_free;
 
     DBG_PRINT("merge complete current size %ld\n", curr_block->size);
 
 }
 
-void myfree(void *ptr) {
-    block *current = (block *)ptr - 1;
-
-    int tfd = current->tfd;
-    struct ThreadEntry* thread = &thread_table[tfd];
-
-    DBG_PRINT("===== BEGIN free(%p) =====\n", ptr);
+// only the owning thread gets here
+static void block_free(arena_t *arena, block *current) {
+    DBG_PRINT("===== BEGIN free(%p) =====\n", current + 1);
     DBG_PRINT_LIST("Before free", current->head);
 
-    block *curr_block = current;
     block *next_block = current->next;
     block *prev_block = current->prev;
 
-    spin_lock(&curr_block->lock);
-    DBG_PRINT_LOCK_STATE("Curr lock", current);
+    current->is_free = 1;
 
     // 合并后一块
     if(next_block && next_block->is_free) {
-        spin_lock(&next_block->lock);
-        merge(curr_block, next_block);
+        free_list_remove(arena, next_block);
+        merge(current, next_block);
         DBG_PRINT_LIST("After forward merge", current->head);
-        spin_unlock(&next_block->lock);
     }
-    spin_unlock(&curr_block->lock);
-
-    // 合并前一块
-    if(prev_block && prev_block->is_free) {
-        spin_lock(&prev_block->lock);
-        spin_lock(&curr_block->lock);
-        // merge prev block
-        if(prev_block->capacity == 0) {
-            merge(prev_block, curr_block);            
-            DBG_PRINT_LIST("After backward merge", current->head);
-        }
-        spin_unlock(&prev_block->lock);
+
+    // 合并前一块，前一块已在空闲链表中
+    if(prev_block->is_free) {
+        merge(prev_block, current);
+        current = prev_block;
+        DBG_PRINT_LIST("After backward merge", current->head);
     } else {
-        spin_lock(&curr_block->lock);
+        free_list_push(arena, current);
     }
 
-    if(current->size + sizeof(block) == curr_block->prev->capacity) {
-        block *dummy = curr_block->prev;
+    // 整个 chunk 空闲时留作缓存，由 mymalloc_decay 归还
+    if(current->prev == current->head && !current->next) {
+        DBG_PRINT("Retire chunk %p capacity %lu\n", current->head, current->head->capacity);
+        chunk_retire(arena, current->head);
+    }
 
-        if(thread->first_free && dummy == thread->first_free->head) {
-            thread->first_free = NULL;
-        }
+    DBG_PRINT("===== END free(%p) =====\n\n", current + 1);
+}
+
+void myfree(void *ptr) {
+    if (!ptr) return;
+    if (slab_owns(ptr)) {
+        slab_free(ptr);
+        return;
+    }
 
-        DBG_PRINT("Checking head: current size %lu, head cap %lu\n",
-            current->size + sizeof(block), dummy->capacity);
-        
-        dummy->capacity = 0;
-        dummy->next_free = NULL;
-        dummy->next = NULL; 
-        vmfree(dummy, dummy->capacity + sizeof(block));
-        dummy = NULL;
+    block *current = (block *)ptr - 1;
+    arena_t *arena = current->arena;
 
-    } else {
-        spin_unlock(&curr_block->lock);
+    if(arena == thread_arena) block_free(arena, current);
+    else arena_push_remote(arena, current);
+}
+
+int mymalloc_decay(void) {
+    arena_t *arena = thread_arena;
+    if(!arena) return 0;
+
+    // an idle thread frees what other threads handed back as well
+    arena_drain_remote(arena);
+    arena->decay_epoch ++;
+
+    int count = 0;
+    block *dummy = arena->dirty;
+    while(dummy) {
+        block *next = dummy->next_free;
+        if(arena->decay_epoch - dummy->stamp >= DECAY_TICKS || arena->dirty_bytes > DIRTY_MAX) {
+            chunk_purge(arena, dummy);
+            count ++;
+        }
+        dummy = next;
     }
 
-    DBG_PRINT("===== END free(%p) =====\n\n", ptr);
+    return count;
+}
+
+int mymalloc_set_socket(int socket) {
+    arena_t *arena = thread_arena;
+    if(!arena) {
+        arena = arena_attach();
+        if(!arena) return -1;
+    }
+    if(arena->socket == socket) return 0;
+
+    // the objects cached for the old node go to its depots, later chunks and slabs come from the new one
+    slab_drain();
+    arena->socket = socket;
+    arena->slab_next = arena->slab_end = NULL;
+    slab_node = slab_node_of(socket);
+    return 0;
 }
@@ -1,3 +1,6 @@
+#ifndef __MYMALLOC_H__
+#define __MYMALLOC_H__
+
 #include <stddef.h>
 #include <stdint.h>
 #include <stdatomic.h>
@@ -23,7 +26,24 @@ static inline void spin_unlock(spinlock_t *lock) {
 void *mymalloc(size_t size);
 void myfree(void *ptr);
 
+#define MYMALLOC_HUGEPAGE_SIZE  (2 * 1024 * 1024)
+
+// where arenas take hugepages from before trying the kernel, spdk_malloc under SPDK
+typedef void *(*mymalloc_hugepage_alloc_t)(size_t size, size_t align, int socket);
+typedef void (*mymalloc_hugepage_free_t)(void *addr);
+
+void mymalloc_set_hugepages(mymalloc_hugepage_alloc_t alloc, mymalloc_hugepage_free_t free);
+
+// gives back the pages of the calling thread's cached empty chunks once
+// they sat unused for ten calls, run it on every thread every 100ms or so
+int mymalloc_decay(void);
+
+// places the calling thread's arena on a NUMA node, -1 for any
+int mymalloc_set_socket(int socket);
+
 #include <sys/mman.h>
 
 void *vmalloc(void *addr, size_t length);
-void vmfree(void *addr, size_t length);
\ No newline at end of file
+void vmfree(void *addr, size_t length);
+
+#endif
\ No newline at end of file
@@ -13,12 +13,19 @@
 #include <string.h>
 
 #include "../kvstore.h"
-
-int kvstore_request(char *msg, ssize_t len);
+#include "../mm/mymalloc.h"
 
 //
 #define ADDR_STR_LEN		INET6_ADDRSTRLEN
 #define BUFFER_SIZE			1024
+#define RECV_BUFFER_SIZE	(64 * 1024)			// free space kept for every recv
+#define RECV_BUFFER_MAX		KVS_MAX_FRAME			// largest request we reassemble
+#define SEND_HIGH_WATERMARK	(4 * 1024 * 1024)		// stop reading above this much unsent output
+#define SEND_LOW_WATERMARK	(1024 * 1024)			// and resume below this
+#define LOG_POLL_PERIOD_US	(10 * 1000)
+#define TICK_POLL_PERIOD_US	(1 * 1000)
+#define DECAY_POLL_PERIOD_US	(100 * 1000)
+#define RETURN_POLL_PERIOD_US	(100)
 
 static char *g_host;
 static int g_port;
@@ -31,17 +38,86 @@ struct server_context_t {
 	int port;
 	char *sock_impl_name;
 
-	int bytes_in;
-	int bytes_out;
-	
 	struct spdk_sock *sock;
+	int next_reactor;
+
+};
+
+/*
+ * one per core of the app core mask. a reactor owns a sock group, the
+ * connections added to it, and the engine instance of every key hashing
+ * to its index. nothing in here is touched from another core.
+ */
+struct server_reactor_t {
+
+	int index;
+	uint32_t core;
+
+	struct spdk_thread *thread;
 	struct spdk_sock_group *group;
+	struct spdk_poller *poller;
+	struct spdk_poller *tick_poller;
+	struct spdk_poller *decay_poller;
+	struct spdk_poller *return_poller;
+
+	struct server_shard_msg_t *returns;	// results the connection's reactor could not take yet
+
+	uint64_t bytes_in;
+	uint64_t bytes_out;
 
 };
 
+static struct server_reactor_t *g_reactors;
+static int g_reactor_count;
+
+// one per client, the protocol is fixed by the first byte it sends
+struct server_conn_t {
+
+	struct server_context_t *server;
+	struct server_reactor_t *reactor;
+	struct spdk_sock *sock;
+
+	kvs_proto_t proto;
+	int db;
+
+	int inflight;		// shard messages not returned yet
+	int writes;			// async writes not completed yet
+	bool closed;
+	struct kvs_request_queue requests;
+
+	kvs_buf_t rbuf;		// received bytes, a partial request stays at the front
+	size_t unsent;		// bytes of the writes still queued on the socket
+	bool paused;		// not read until the writes drain
+	bool quit;			// closes once the replies sent so far are written
+
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+
+};
+
+/*
+ * one async writev of encoded replies. the iovecs point into out, which
+ * holds the protocol bytes and a reference on every value sent in place.
+ */
+struct server_write_t {
+
+	struct server_conn_t *conn;
+	kvs_out_t out;
+
+	struct spdk_sock_request req;	// must be last, the iovecs follow it
+
+};
+
+// ops of one connection that are owned by another reactor
+struct server_shard_msg_t {
+
+	struct server_conn_t *conn;
+	struct server_shard_msg_t *next;	// on the owner's returns list
+	int nops;
+	kvs_op_t *ops[];
+
+};
 
-// printf();
-// debug
 
 static void spdk_server_shutdown_callback(void) {
 
@@ -52,7 +128,7 @@ static void spdk_server_shutdown_callback(void) {
 // -H 0.0.0.0 -P 8888 
 static int spdk_server_app_parse(int ch, char *arg) {
 
-	printf("spdk_server_app_parse: %s\n", arg);
+	KVS_DEBUGLOG("spdk_server_app_parse: %s\n", arg);
 	switch (ch) {
 
 	case 'H':
@@ -62,7 +138,7 @@ static int spdk_server_app_parse(int ch, char *arg) {
 	case 'P':
 		g_port = spdk_strtol(arg, 10);
 		if (g_port < 0) {
-			SPDK_ERRLOG("Invalid port ID\n");
+			KVS_ERRLOG("Invalid port ID\n");
 			return g_port;
 		}
 		break;
@@ -89,49 +165,375 @@ static void spdk_server_app_usage(void) {
 
 }
 
+static void spdk_server_conn_free(struct server_conn_t *conn) {
+
+	kvs_request_t *req;
+	while ((req = TAILQ_FIRST(&conn->requests)) != NULL) {
+		TAILQ_REMOVE(&conn->requests, req, link);
+		kvstore_request_free(req);
+	}
+	kvs_buf_free(&conn->rbuf);
+	kvstore_free(conn);
+
+}
+
+// a closed connection lives until its shard messages and writes are back
+static void spdk_server_conn_release(struct server_conn_t *conn) {
+
+	if (conn->closed && conn->inflight == 0 && conn->writes == 0) {
+		spdk_server_conn_free(conn);
+	}
+
+}
+
+static void spdk_server_close(struct server_conn_t *conn) {
+
+	if (conn->closed) {
+		return ;
+	}
+	conn->closed = true;
+
+	spdk_sock_group_remove_sock(conn->reactor->group, conn->sock);
+
+	// queued writes may complete from inside spdk_sock_close
+	conn->writes ++;
+	spdk_sock_close(&conn->sock);
+	conn->writes --;
+
+	spdk_server_conn_release(conn);
+
+}
+
+static kvs_proto_t spdk_server_detect(const char *buf, size_t len) {
+
+	if ((uint8_t)buf[0] == KVS_BIN_MAGIC_REQ) {
+		return KVS_PROTO_BINARY;
+	} else if (kvstore_resp_detect(buf, len)) {
+		return KVS_PROTO_RESP;
+	}
+	return KVS_PROTO_TEXT;
+
+}
+
+static int spdk_server_shard(const char *key, size_t klen) {
+
+	return key ? kvs_hash_key(key, klen) % g_reactor_count : 0;
+
+}
+
+/*
+ * stop reading a slow reader with too much unsent. the socket stays in its
+ * group, async writes only make progress inside spdk_sock_group_poll.
+ */
+static void spdk_server_backpressure(struct server_conn_t *conn) {
+
+	if (!conn->paused && conn->unsent > SEND_HIGH_WATERMARK) {
+		conn->paused = true;
+	} else if (conn->paused && conn->unsent < SEND_LOW_WATERMARK) {
+		conn->paused = false;
+	}
+
+}
+
+static void spdk_server_write_done(void *arg, int err) {
+
+	struct server_write_t *w = arg;
+	struct server_conn_t *conn = w->conn;
+
+	conn->writes --;
+	conn->unsent -= w->out.bytes;
+	if (err == 0) {
+		conn->bytes_out += w->out.bytes;
+		conn->reactor->bytes_out += w->out.bytes;
+	}
+
+	// drops the references on the values that were sent in place
+	kvs_out_free(&w->out);
+	kvstore_free(w);
+
+	if (conn->closed) {
+		spdk_server_conn_release(conn);
+		return ;
+	}
+	if (err) {
+		KVS_ERRLOG("Write failed, errno %d: %s\n", -err, spdk_strerror(-err));
+		spdk_server_close(conn);
+		return ;
+	}
+	if (conn->quit && conn->writes == 0) {
+		spdk_server_close(conn);
+		return ;
+	}
+	spdk_server_backpressure(conn);
+
+}
+
+/*
+ * encode every finished request at the head of the queue and hand all of
+ * the replies to the socket as one vectored async write.
+ */
+static void spdk_server_flush(struct server_conn_t *conn) {
+
+	kvs_out_t out = {0};
+	kvs_request_t *req;
+
+	while (!conn->quit && (req = TAILQ_FIRST(&conn->requests)) != NULL && req->pending == 0) {
+		if (kvstore_encode(req, &out)) {
+			KVS_ERRLOG("Cannot encode reply\n");
+			break;
+		}
+		// nothing after QUIT is answered
+		conn->quit = req->close;
+		TAILQ_REMOVE(&conn->requests, req, link);
+		kvstore_request_free(req);
+	}
+
+	if (out.nsegs == 0) {
+		kvs_out_free(&out);
+		return ;
+	}
+
+	struct server_write_t *w = kvstore_malloc(sizeof(struct server_write_t) +
+		out.nsegs * sizeof(struct iovec));
+	if (w == NULL) {
+		KVS_ERRLOG("Cannot allocate write, closing connection\n");
+		kvs_out_free(&out);
+		spdk_server_close(conn);
+		return ;
+	}
+	w->conn = conn;
+	w->out = out;
+
+	int i = 0;
+	for (i = 0; i < out.nsegs; i ++) {
+		kvs_seg_t *seg = &out.segs[i];
+		struct iovec *iov = SPDK_SOCK_REQUEST_IOV(&w->req, i);
+
+		iov->iov_base = seg->value ? seg->value->data + seg->off : out.buf.data + seg->off;
+		iov->iov_len = seg->len;
+	}
+	w->req.iovcnt = out.nsegs;
+	w->req.cb_fn = spdk_server_write_done;
+	w->req.cb_arg = w;
+
+	conn->writes ++;
+	conn->unsent += out.bytes;
+	spdk_sock_writev_async(conn->sock, &w->req);
+
+	if (!conn->closed) {
+		spdk_server_backpressure(conn);
+	}
+
+}
+
+static void spdk_server_shard_complete(void *arg) {
+
+	struct server_shard_msg_t *msg = arg;
+	struct server_conn_t *conn = msg->conn;
+
+	int i = 0;
+	for (i = 0; i < msg->nops; i ++) {
+		msg->ops[i]->req->pending --;
+	}
+	kvstore_free(msg);
+
+	conn->inflight --;
+	if (conn->closed) {
+		spdk_server_conn_release(conn);
+		return ;
+	}
+	spdk_server_flush(conn);
+
+}
+
+// the connection's counters are only touched on its own reactor, a result that cannot go back stays queued
+static int spdk_server_return_poll(void *arg) {
+
+	struct server_reactor_t *reactor = arg;
+	struct server_shard_msg_t *msg = reactor->returns;
+
+	if (msg == NULL) {
+		return SPDK_POLLER_IDLE;
+	}
+
+	reactor->returns = NULL;
+	while (msg != NULL) {
+		struct server_shard_msg_t *next = msg->next;
+
+		if (spdk_thread_send_msg(msg->conn->reactor->thread, spdk_server_shard_complete, msg)) {
+			msg->next = reactor->returns;
+			reactor->returns = msg;
+		}
+		msg = next;
+	}
+	return SPDK_POLLER_BUSY;
+}
+
+// runs on the owning reactor, the ops are handed back to the connection's
+static void spdk_server_shard_execute(void *arg) {
+
+	struct server_shard_msg_t *msg = arg;
+	struct server_reactor_t *owner = &g_reactors[msg->ops[0]->shard];
+
+	kvstore_execute_ops(msg->ops, msg->nops);
+
+	int rc = spdk_thread_send_msg(msg->conn->reactor->thread, spdk_server_shard_complete, msg);
+	if (rc) {
+		// the return poller resends it with the results as executed, inflight drops when it lands
+		KVS_ERRLOG("Cannot return ops to reactor %d, retrying\n", msg->conn->reactor->index);
+		msg->next = owner->returns;
+		owner->returns = msg;
+	}
+
+}
+
+/*
+ * execute the ops this reactor owns right away and send the rest to their
+ * owners, one message per owning reactor. either way the ops of one owner
+ * run as a single batch.
+ */
+static void spdk_server_dispatch(struct server_conn_t *conn, kvs_request_t *first) {
+
+	struct server_reactor_t *self = conn->reactor;
+	struct server_shard_msg_t *msgs[g_reactor_count];
+	int counts[g_reactor_count];
+	kvs_request_t *req;
+	int i = 0;
+
+	memset(counts, 0, sizeof(counts));
+	for (req = first; req != NULL; req = TAILQ_NEXT(req, link)) {
+		for (i = 0; i < req->nops; i ++) {
+			kvs_op_t *op = &req->ops[i];
+			// range ops come with one op per shard already
+			if (!(op->flags & KVS_OP_PINNED)) {
+				op->shard = spdk_server_shard(op->key, op->klen);
+			}
+			counts[op->shard] ++;
+		}
+	}
+
+	for (i = 0; i < g_reactor_count; i ++) {
+		msgs[i] = NULL;
+		if (counts[i] == 0) continue;
+
+		msgs[i] = kvstore_malloc(sizeof(struct server_shard_msg_t) + counts[i] * sizeof(kvs_op_t *));
+		if (msgs[i] == NULL) continue;
+		msgs[i]->conn = conn;
+		msgs[i]->nops = 0;
+	}
+
+	for (req = first; req != NULL; req = TAILQ_NEXT(req, link)) {
+		for (i = 0; i < req->nops; i ++) {
+			kvs_op_t *op = &req->ops[i];
+
+			if (msgs[op->shard] == NULL) {
+				// no memory for the batch, local ops still run one by one
+				if (op->shard == self->index) {
+					kvstore_execute_op(op);
+				} else {
+					op->status = -1;
+				}
+				req->pending --;
+				continue;
+			}
+			msgs[op->shard]->ops[msgs[op->shard]->nops ++] = op;
+		}
+	}
+
+	if (msgs[self->index] != NULL) {
+		struct server_shard_msg_t *local = msgs[self->index];
+
+		kvstore_execute_ops(local->ops, local->nops);
+		for (i = 0; i < local->nops; i ++) {
+			local->ops[i]->req->pending --;
+		}
+		kvstore_free(local);
+		msgs[self->index] = NULL;
+	}
+
+	for (i = 0; i < g_reactor_count; i ++) {
+		if (msgs[i] == NULL) continue;
+
+		int rc = spdk_thread_send_msg(g_reactors[i].thread, spdk_server_shard_execute, msgs[i]);
+		if (rc) {
+			KVS_ERRLOG("Cannot forward to reactor %d\n", i);
+			int j = 0;
+			for (j = 0; j < msgs[i]->nops; j ++) {
+				msgs[i]->ops[j]->status = -1;
+				msgs[i]->ops[j]->req->pending --;
+			}
+			kvstore_free(msgs[i]);
+			continue;
+		}
+		conn->inflight ++;
+	}
+
+}
+
 static void spdk_server_callback(void *arg, struct spdk_sock_group *group, struct spdk_sock *sock) {
 
-	struct server_context_t *ctx = arg;
-	char buf[BUFFER_SIZE] = {0};
-	struct iovec iov;
+	struct server_conn_t *conn = arg;
+	kvs_buf_t *rbuf = &conn->rbuf;
+
+	// the request stays in the kernel until the replies drain
+	if (conn->paused || conn->quit) {
+		return ;
+	}
+
+	if (rbuf->len - rbuf->pos > RECV_BUFFER_MAX || kvs_buf_reserve(rbuf, RECV_BUFFER_SIZE)) {
+		KVS_ERRLOG("Request too large, closing connection\n");
+		spdk_server_close(conn);
+		return ;
+	}
 	
-	ssize_t n =  spdk_sock_recv(sock, buf, sizeof(buf));
+	// keep one byte back, the parsers terminate strings in place
+	ssize_t n =  spdk_sock_recv(sock, rbuf->data + rbuf->len, rbuf->cap - rbuf->len - 1);
 	if (n < 0) {
 		if (errno == EAGAIN || errno == EWOULDBLOCK) {
-			SPDK_ERRLOG("spdk_sock_recv failed, errno %d: %s",
-				errno, spdk_strerror(errno));
 			return ;
 		}
 		
-		SPDK_ERRLOG("spdk_sock_recv failed, errno %d: %s",
+		KVS_ERRLOG("spdk_sock_recv failed, errno %d: %s\n",
 				errno, spdk_strerror(errno));
+		spdk_server_close(conn);
 	} else if (n == 0) {
 
-		SPDK_NOTICELOG("Connection closed\n");
-		spdk_sock_group_remove_sock(group, sock);
-		spdk_sock_close(&sock);
+		KVS_INFOLOG("Connection closed\n");
+		spdk_server_close(conn);
 
 		return ;
 
 	} else { 
 
-		printf("ret:%ld, recv: %s\n", n, buf);
+		rbuf->len += n;
+		rbuf->data[rbuf->len] = '\0';
+		conn->bytes_in += n;
+		conn->reactor->bytes_in += n;
 
-		// recv: buf
-		// sync 
-		
-		int len =  kvstore_request(buf, n);
-		printf("len %d\n", len);
+		char *buf = rbuf->data + rbuf->pos;
+		size_t len = rbuf->len - rbuf->pos;
 
-		ctx->bytes_in += len;
+		if (conn->proto == KVS_PROTO_UNKNOWN) {
+			conn->proto = spdk_server_detect(buf, len);
+		}
 
-		iov.iov_base = buf;
-		iov.iov_len = len;
+		KVS_DEBUGLOG("recv %zd bytes, %zu buffered\n", n, len);
+
+		// a request split over several segments stays buffered until complete
+		kvs_request_t *last = TAILQ_LAST(&conn->requests, kvs_request_queue);
+		ssize_t rc = kvstore_parse(conn->proto, buf, len, &conn->db, &conn->requests);
+		if (rc < 0) {
+			KVS_ERRLOG("Bad request, closing connection\n");
+			spdk_server_close(conn);
+			return ;
+		}
+		kvs_buf_consume(rbuf, rc);
 
-		int n = spdk_sock_writev(sock, &iov, 1);
-		if (n > 0) {
-			ctx->bytes_out += n;
+		kvs_request_t *first = last ? TAILQ_NEXT(last, link) : TAILQ_FIRST(&conn->requests);
+		if (first != NULL) {
+			spdk_server_dispatch(conn, first);
 		}
+		spdk_server_flush(conn);
 		return ;
 	}  
 
@@ -141,6 +543,22 @@ static void spdk_server_callback(void *arg, struct spdk_sock_group *group, struc
 }
 
 
+static void spdk_server_add_sock(void *arg) {
+
+	struct server_conn_t *conn = arg;
+
+	int rc = spdk_sock_group_add_sock(conn->reactor->group, conn->sock, 
+		spdk_server_callback, conn);
+	if (rc < 0) {
+
+		KVS_ERRLOG("Cannot add socket to reactor %d\n", conn->reactor->index);
+		spdk_sock_close(&conn->sock);
+		kvstore_free(conn);
+
+	}
+
+}
+
 // 
 static int spdk_server_accept(void *arg) {
 
@@ -149,7 +567,6 @@ static int spdk_server_accept(void *arg) {
 	uint16_t sport, cport;
 	int count = 0;
 
-	// printf("spdk_server_accept\n");
 	if (!g_running) {
 		spdk_sock_close(&ctx->sock);
 		return SPDK_POLLER_IDLE;		
@@ -170,18 +587,35 @@ static int spdk_server_accept(void *arg) {
 				caddr, sizeof(caddr), &cport);
 		if (rc < 0) {
 
-			SPDK_ERRLOG("Cannot get connection address\n");
+			KVS_ERRLOG("Cannot get connection address\n");
 			spdk_sock_close(&ctx->sock);
 			return SPDK_POLLER_IDLE;
 
 		}
 
-		rc = spdk_sock_group_add_sock(ctx->group, client_sock, 
-			spdk_server_callback, ctx);
+		struct server_conn_t *conn = kvstore_malloc(sizeof(struct server_conn_t));
+		if (conn == NULL) {
+
+			KVS_ERRLOG("Cannot allocate connection context\n");
+			spdk_sock_close(&client_sock);
+			return SPDK_POLLER_IDLE;
+
+		}
+		memset(conn, 0, sizeof(struct server_conn_t));
+		conn->server = ctx;
+		conn->sock = client_sock;
+		TAILQ_INIT(&conn->requests);
+
+		// connections are spread round robin, keys are routed by owner
+		conn->reactor = &g_reactors[ctx->next_reactor];
+		ctx->next_reactor = (ctx->next_reactor + 1) % g_reactor_count;
+
+		rc = spdk_thread_send_msg(conn->reactor->thread, spdk_server_add_sock, conn);
 		if (rc < 0) {
 
-			SPDK_ERRLOG("Cannot get connection address\n");
+			KVS_ERRLOG("Cannot hand connection to reactor %d\n", conn->reactor->index);
 			spdk_sock_close(&client_sock);
+			kvstore_free(conn);
 			return SPDK_POLLER_IDLE;
 
 		}
@@ -194,45 +628,149 @@ static int spdk_server_accept(void *arg) {
 }
 
 
+// formats and writes the log records of every reactor, off the request path
+static int spdk_server_log_poll(void *arg) {
+
+	return kvs_log_flush() > 0 ? SPDK_POLLER_BUSY : SPDK_POLLER_IDLE;
+}
+
+
 static int spdk_server_group_poll(void *arg) {
 
-	struct server_context_t *ctx = arg;
+	struct server_reactor_t *reactor = arg;
 
-	int rc = spdk_sock_group_poll(ctx->group);
+	// also flushes the queued async writes of every socket in the group
+	int rc = spdk_sock_group_poll(reactor->group);
 	if (rc < 0) {
-		SPDK_ERRLOG("Failed to poll sock_group = %p\n", ctx->group);
+		KVS_ERRLOG("Failed to poll sock_group = %p\n", reactor->group);
 	}
 	return rc > 0 ? SPDK_POLLER_BUSY : SPDK_POLLER_IDLE;
 }
 
 
+// engine upkeep such as resizing, kept apart from the group poll so it is rate limited
+static int spdk_server_tick_poll(void *arg) {
+
+	return kvstore_tick() > 0 ? SPDK_POLLER_BUSY : SPDK_POLLER_IDLE;
+}
+
+
+// hands the pages of chunks the reactor's arena no longer uses back to the kernel
+static int spdk_server_decay_poll(void *arg) {
+
+	return mymalloc_decay() > 0 ? SPDK_POLLER_BUSY : SPDK_POLLER_IDLE;
+}
+
+
+// runs on the reactor's own thread, the engines it creates are thread local
+static void spdk_server_reactor_start(void *arg) {
+
+	struct server_reactor_t *reactor = arg;
+
+	// engines and buffers of this reactor live on its own NUMA node
+	mymalloc_set_socket((int)spdk_env_get_socket_id(reactor->core));
+
+	if (kvstore_init()) {
+		KVS_ERRLOG("Cannot create engines on core %u\n", reactor->core);
+		spdk_app_stop(-1);
+		return ;
+	}
+
+	reactor->group = spdk_sock_group_create(NULL); //epoll
+	if (reactor->group == NULL) {
+		KVS_ERRLOG("Cannot create sock group on core %u\n", reactor->core);
+		spdk_app_stop(-1);
+		return ;
+	}
+
+	reactor->poller = SPDK_POLLER_REGISTER(spdk_server_group_poll, reactor, 0);
+	reactor->tick_poller = SPDK_POLLER_REGISTER(spdk_server_tick_poll, reactor, TICK_POLL_PERIOD_US);
+	reactor->decay_poller = SPDK_POLLER_REGISTER(spdk_server_decay_poll, reactor, DECAY_POLL_PERIOD_US);
+	reactor->return_poller = SPDK_POLLER_REGISTER(spdk_server_return_poll, reactor, RETURN_POLL_PERIOD_US);
+
+}
+
+static int spdk_server_reactors_create(void) {
+
+	struct spdk_cpuset cpumask;
+	char name[32];
+	uint32_t core;
+	int i = 0;
+
+	g_reactor_count = spdk_env_get_core_count();
+	g_reactors = kvstore_malloc(g_reactor_count * sizeof(struct server_reactor_t));
+	if (g_reactors == NULL) {
+		return -1;
+	}
+	memset(g_reactors, 0, g_reactor_count * sizeof(struct server_reactor_t));
+	kvstore_set_shards(g_reactor_count);
+
+	SPDK_ENV_FOREACH_CORE(core) {
+		struct server_reactor_t *reactor = &g_reactors[i];
+
+		reactor->index = i ++;
+		reactor->core = core;
+
+		spdk_cpuset_zero(&cpumask);
+		spdk_cpuset_set_cpu(&cpumask, core, true);
+		snprintf(name, sizeof(name), "kvs_reactor_%u", core);
+
+		reactor->thread = spdk_thread_create(name, &cpumask);
+		if (reactor->thread == NULL) {
+			KVS_ERRLOG("Cannot create thread on core %u\n", core);
+			return -1;
+		}
+		spdk_thread_send_msg(reactor->thread, spdk_server_reactor_start, reactor);
+	}
+
+	return 0;
+}
+
+
 // spdk sock 
 static int spdk_server_listen(struct server_context_t *ctx) {
 
 	ctx->sock = spdk_sock_listen(ctx->host, ctx->port, ctx->sock_impl_name);
 	if (ctx->sock == NULL) {
-		SPDK_ERRLOG("Cannot create server socket");
+		KVS_ERRLOG("Cannot create server socket\n");
 		return -1;
 	}
 
-	ctx->group = spdk_sock_group_create(NULL); //epoll
+	if (spdk_server_reactors_create()) {
+		KVS_ERRLOG("Cannot create reactors\n");
+		spdk_sock_close(&ctx->sock);
+		return -1;
+	}
 
 	g_running = true;
 
 	SPDK_POLLER_REGISTER(spdk_server_accept, ctx, 2000 * 1000);
-	SPDK_POLLER_REGISTER(spdk_server_group_poll, ctx, 0);
+	SPDK_POLLER_REGISTER(spdk_server_log_poll, NULL, LOG_POLL_PERIOD_US);
 
-	printf("spdk_server_listen\n");
+	KVS_INFOLOG("listening on %s:%d, %d reactors\n", ctx->host, ctx->port, g_reactor_count);
 
 	return 0;
 }
 
 
+// arenas take their chunks from the hugepages SPDK reserved at startup, on the reactor's socket
+static void *spdk_server_hugepage_alloc(size_t size, size_t align, int socket) {
+
+	return spdk_malloc(size, align, NULL, socket < 0 ? SPDK_ENV_SOCKET_ID_ANY : socket, SPDK_MALLOC_DMA);
+}
+
+static void spdk_server_hugepage_free(void *addr) {
+
+	spdk_free(addr);
+}
+
+
 static void sdpk_server_start(void *arg) {
 
 	struct server_context_t *ctx = arg;
+
+	mymalloc_set_hugepages(spdk_server_hugepage_alloc, spdk_server_hugepage_free);
 	
-	printf("sdpk_server_start\n");
 	int rc = spdk_server_listen(ctx);
 	if (rc) {
 		spdk_app_stop(-1);
@@ -254,25 +792,26 @@ int spdk_entry(int argc, char *argv[]) {
 	opts.name = "spdk_server";
 	opts.shutdown_cb = spdk_server_shutdown_callback;
 
-	printf("spdk_app_parse_args\n");
 	spdk_app_parse_args(argc, argv, &opts, "H:P:N:SVzZ", NULL,
 		spdk_server_app_parse, spdk_server_app_usage);
 
-	printf("spdk_app_parse_args 11\n");
 	struct server_context_t server_context = {};
 	server_context.host = g_host;
 	server_context.port = g_port;
 	server_context.sock_impl_name = g_sock_impl_name;
 
-	printf("host: %s, port: %d, impl_name: %s\n", g_host, g_port, g_sock_impl_name);
+	KVS_DEBUGLOG("host: %s, port: %d, impl_name: %s\n", g_host, g_port, g_sock_impl_name);
 	//sdpk_server_start(&server_context);
 
 	int rc = spdk_app_start(&opts, sdpk_server_start, &server_context); // ?
 	if (rc) {
-		SPDK_ERRLOG("Error starting application\n");
+		KVS_ERRLOG("Error starting application\n");
 	}
 
+	// the env is about to go, later chunks come from the kernel
+	mymalloc_set_hugepages(NULL, NULL);
 	spdk_app_fini();
+	kvs_log_flush();
 	return 0;
 }
 